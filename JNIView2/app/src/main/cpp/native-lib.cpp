@@ -32,17 +32,13 @@ public:
     }
 
     void init(const uint8_t *shader, size_t size) {
-        std::vector<uint8_t> code;
-        for (size_t i = 0; i < size; i += 1) {
-            code.push_back(shader[i]);
-        }
-        m_shader = m_device->createShader(code, VK_SHADER_STAGE_COMPUTE_BIT);
+        m_shader = m_device->createShader(shader, size, VK_SHADER_STAGE_COMPUTE_BIT);
         LOGI("3. Shader ready");
 
         m_pipeline = m_device->createComputePipeline(m_shader, {{std::make_tuple(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER), std::make_tuple(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)}});
         LOGI("4. Pipeline ready");
 
-        m_buffer = m_device->createBuffer(1024 * 1024 * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        m_buffer = m_device->createBuffer(1024 * 1024 * 4, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, vk::MemoryIntent::Readback);
         m_pipeline->feedBuffer(0, 0, m_buffer, 0, 1024 * 1024 * 4);
         m_uniform = m_device->createBuffer(2 * 4, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
         m_pipeline->feedBuffer(0, 0, m_uniform, 0, 2 * 4);
@@ -78,7 +74,7 @@ public:
 private:
     std::unique_ptr<vk::Instance> m_instance;
     std::unique_ptr<vk::Device> m_device;
-    std::unique_ptr<vk::Shader> m_shader;
+    std::shared_ptr<vk::Shader> m_shader;
     std::unique_ptr<vk::ComputePipeline> m_pipeline;
     std::unique_ptr<vk::Buffer> m_buffer;
     std::unique_ptr<vk::Buffer> m_uniform;
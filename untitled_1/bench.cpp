@@ -0,0 +1,676 @@
+// clang-format off
+#include <array>
+#include <cmath>
+#include <tuple>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include <naive_vulkan/vulkan.hpp>
+#include <naive_vulkan/bitmap.hpp>
+#include <naive_vulkan/gemm.hpp>
+#include <naive_vulkan/host.hpp>
+#include <naive_vulkan/mandelbrot.hpp>
+#include <naive_vulkan/multi_device.hpp>
+#include <naive_vulkan/primitives.hpp>
+// clang-format on
+
+// ----------
+// ./naive_vulkan_bench [--json | --csv]
+// without a GPU, point the loader at a software driver, e.g.
+// VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json
+// ----------
+
+// An empty compute shader, local size 1x1x1
+static const uint32_t emptySpv[] = {
+    0x07230203, 0x00010000, 0x00000000, 0x00000006, 0x00000000, // header
+    0x00020011, 0x00000001,                         // OpCapability Shader
+    0x0003000E, 0x00000000, 0x00000001,             // OpMemoryModel
+    0x0005000F, 0x00000005, 0x00000004, 0x6E69616D, // OpEntryPoint "main"
+    0x00000000,                                     //
+    0x00060010, 0x00000004, 0x00000011, 0x00000001, // OpExecutionMode
+    0x00000001, 0x00000001,                         // LocalSize 1 1 1
+    0x00020013, 0x00000002,                         // %2 = OpTypeVoid
+    0x00030021, 0x00000003, 0x00000002,             // %3 = OpTypeFunction
+    0x00050036, 0x00000002, 0x00000004, 0x00000000, // %4 = OpFunction
+    0x00000003,                                     //
+    0x000200F8, 0x00000005,                         // %5 = OpLabel
+    0x000100FD,                                     // OpReturn
+    0x00010038,                                     // OpFunctionEnd
+};
+
+// Heap allocations of the whole process, for allocations per frame
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *data = std::malloc(size == 0 ? 1 : size)) {
+    return data;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *data) noexcept { std::free(data); }
+
+void operator delete(void *data, size_t) noexcept { std::free(data); }
+
+struct Result {
+  std::string name;
+  std::string param;
+  double value;
+  std::string unit;
+};
+
+class Bench {
+public:
+  // Median of several rounds, in nanoseconds per iteration
+  template <typename F> static double measure(size_t iterations, F f) {
+    const size_t rounds = 5;
+    f(); // warm up
+    std::vector<double> samples;
+    for (size_t round = 0; round < rounds; round += 1) {
+      auto begin = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < iterations; i += 1) {
+        f();
+      }
+      auto end = std::chrono::steady_clock::now();
+      samples.push_back(
+          std::chrono::duration<double, std::nano>(end - begin).count() /
+          double(iterations));
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[rounds / 2];
+  }
+
+  void add(const std::string &name, const std::string &param, double value,
+           const std::string &unit) {
+    std::cerr << name << " " << param << ": " << value << " " << unit
+              << std::endl;
+    m_results.push_back({name, param, value, unit});
+  }
+
+  void printCsv(std::ostream &out) const {
+    out << "name,param,value,unit" << std::endl;
+    for (const auto &result : m_results) {
+      out << result.name << "," << result.param << "," << result.value << ","
+          << result.unit << std::endl;
+    }
+  }
+
+  void printJson(std::ostream &out, const std::string &deviceName) const {
+    out << "{\"device\":\"" << deviceName << "\",\"results\":[";
+    for (size_t i = 0; i < m_results.size(); i += 1) {
+      const auto &result = m_results[i];
+      out << (i == 0 ? "\n" : ",\n") << "{\"name\":\"" << result.name
+          << "\",\"param\":\"" << result.param << "\",\"value\":"
+          << result.value << ",\"unit\":\"" << result.unit << "\"}";
+    }
+    out << "\n]}" << std::endl;
+  }
+
+private:
+  std::vector<Result> m_results;
+};
+
+void bench_bandwidth(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  const std::vector<std::tuple<std::string, VkMemoryPropertyFlags>> memories =
+      {std::make_tuple("coherent", VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+       std::make_tuple("cached", VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_CACHED_BIT),
+       std::make_tuple("device_local", VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)};
+  // the ranked types, readback should match "cached" where there is one
+  const std::vector<std::tuple<std::string, vk::MemoryIntent>> intents = {
+      std::make_tuple("intent_upload", vk::MemoryIntent::Upload),
+      std::make_tuple("intent_readback", vk::MemoryIntent::Readback)};
+  const std::vector<size_t> sizes = {4 << 10, 64 << 10, 1 << 20, 16 << 20};
+
+  auto measure = [&](const std::string &name, vk::Buffer &buffer,
+                     size_t size) {
+    std::vector<uint8_t> host(size, 0x5A);
+    size_t iterations = std::max(size_t(4), (size_t(64) << 20) / size);
+    auto param = name + "/" + std::to_string(size);
+
+    double upload = Bench::measure(
+        iterations, [&]() { buffer.update(host.data(), host.size()); });
+    bench.add("upload", param, double(size) / upload, "GB/s");
+
+    double readback = Bench::measure(
+        iterations, [&]() { buffer.dump(host.data(), host.size()); });
+    bench.add("readback", param, double(size) / readback, "GB/s");
+  };
+
+  for (const auto &memory : memories) {
+    for (const auto &size : sizes) {
+      std::unique_ptr<vk::Buffer> buffer;
+      try {
+        buffer = device->createBuffer(
+            size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, std::get<1>(memory));
+      } catch (const std::runtime_error &) {
+        break; // no such memory type on this device
+      }
+      measure(std::get<0>(memory), *buffer, size);
+    }
+  }
+  for (const auto &intent : intents) {
+    for (const auto &size : sizes) {
+      auto buffer = device->makeBuffer(
+          size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, std::get<1>(intent));
+      measure(std::get<0>(intent), buffer, size);
+    }
+  }
+}
+
+void bench_latency(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  auto pipeline = device->createComputePipeline(device->createShader(
+      emptySpv, sizeof(emptySpv), VK_SHADER_STAGE_COMPUTE_BIT));
+
+  // an empty command buffer only pays for submit and fence signal
+  auto nothing = device->createCommand({});
+  double fence = Bench::measure(200, [&]() { nothing->submit()->wait(); });
+  bench.add("fence_round_trip", "empty_submit", fence / 1000.0, "us");
+
+  auto command = pipeline->createCommand(1);
+  double dispatch = Bench::measure(200, [&]() { command->submit()->wait(); });
+  bench.add("dispatch_latency", "1x1x1", dispatch / 1000.0, "us");
+
+  double blocking = Bench::measure(
+      200, [&]() { command->submit()->waitFor(UINT64_MAX); });
+  bench.add("dispatch_latency", "1x1x1/blocking", blocking / 1000.0, "us");
+
+  auto reusable = device->makeFence();
+  double reused = Bench::measure(200, [&]() {
+    command->submit(reusable);
+    reusable.wait();
+  });
+  bench.add("dispatch_latency", "1x1x1/reused_fence", reused / 1000.0, "us");
+}
+
+// A frame uploads, runs one recorded command and reads back
+void bench_allocations(Bench &bench,
+                       const std::unique_ptr<vk::Device> &device) {
+  const size_t frames = 100;
+  auto count = [&](const std::function<void()> &frame) {
+    frame(); // warm up
+    size_t before = allocations.load();
+    for (size_t i = 0; i < frames; i += 1) {
+      frame();
+    }
+    return double(allocations.load() - before) / double(frames);
+  };
+
+  auto shader =
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+  auto pipeline = device->makeComputePipeline(shader);
+  auto buffer = device->makeBuffer(64 * sizeof(uint32_t),
+                                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline.feedBuffer(0, 0, buffer, 0, 64 * sizeof(uint32_t));
+  auto command = pipeline.makeCommand(64);
+  auto fence = device->makeFence();
+  std::array<uint32_t, 64> data = {};
+
+  double owned = count([&]() {
+    buffer.update(data.data(), sizeof(data));
+    command.submit()->wait();
+    buffer.dump(data.data(), sizeof(data));
+  });
+  bench.add("allocations", "frame/new_fence", owned, "per_frame");
+
+  double reused = count([&]() {
+    buffer.update(data.data(), sizeof(data));
+    command.submit(fence);
+    fence.wait();
+    buffer.dump(data.data(), sizeof(data));
+  });
+  bench.add("allocations", "frame/reused_fence", reused, "per_frame");
+}
+
+void bench_descriptor(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  auto pipeline = device->createComputePipeline(
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->createBuffer(64 * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  double update = Bench::measure(10000, [&]() {
+    pipeline->feedBuffer(0, 0, buffer, 0, 64 * sizeof(uint32_t));
+  });
+  bench.add("descriptor_update", "storage_buffer", update, "ns");
+}
+
+void bench_pipeline(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  auto shader =
+      device->createShader("./shaders/test_2.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+  double sync = Bench::measure(
+      20, [&]() { device->createComputePipeline(shader); });
+  bench.add("pipeline_create", "sync", sync / 1000.0, "us");
+
+  const size_t batch = 16;
+  std::vector<std::shared_ptr<vk::Shader>> shaders(batch, shader);
+  double async = Bench::measure(
+      4, [&]() { device->createComputePipelinesAsync(shaders); });
+  bench.add("pipeline_create", "async", async / double(batch) / 1000.0, "us");
+}
+
+void bench_mandelbrot(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  const uint32_t width = 1024, height = 1024;
+  auto pipeline = device->createComputePipeline(device->createShader(
+      "./shaders/mandelbrot.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->createBuffer(width * height * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline->feedBuffer(0, 0, buffer, 0, width * height * sizeof(uint32_t));
+
+  auto command = pipeline->createCommand(width, height);
+  double wall = Bench::measure(10, [&]() { command->submit()->wait(); });
+  bench.add("mandelbrot", "1024x1024", double(width * height) / wall * 1000.0,
+            "Mpixel/s");
+
+  try {
+    auto profiled = device->createCommand({pipeline->dispatch(width, height)},
+                                          true);
+    profiled->submit()->wait();
+    bench.add("mandelbrot_gpu", "1024x1024", profiled->durations()[0] / 1000.0,
+              "us");
+  } catch (const std::runtime_error &) {
+    // timestamps not supported by queue
+  }
+
+  // steady panning by 8 pixels a frame, mostly served from the tile cache
+  vk::TiledMandelbrot tiled(*device, width, height);
+  double centre = -0.5, radius = 2.0;
+  tiled.render(centre, 0.0, radius)->wait();
+  double frame = Bench::measure(10, [&]() {
+    centre += 8 * 2.0 * radius / width;
+    tiled.render(centre, 0.0, radius)->wait();
+  });
+  bench.add("mandelbrot_tiled_pan", "1024x1024", frame / 1000.0, "us/frame");
+  bench.add("mandelbrot_tiled_pan_tiles", "1024x1024", tiled.renderedTiles(),
+            "tiles/frame");
+}
+
+// CPU baseline of shaders/mandelbrot.comp, 64 pixels of a row per
+// workgroup with a fixed trip count so the inner loop vectorizes. An
+// escaped point only grows, or turns NaN, so the mask matches the break.
+static bool hostMandelbrot = vk::host::registerKernel(
+    "mandelbrot_host", {64, 1, 1}, [](const vk::host::WorkGroup &group) {
+      auto data = group.buffer<uint32_t>(0);
+      uint32_t x0 = group.id[0] * 64, y = group.id[1];
+      float cy = -2.0f + y * (4.0f / 1024);
+      float zx[64] = {}, zy[64] = {};
+      uint32_t c[64] = {};
+      for (uint32_t i = 0; i < 50; i += 1) {
+        for (uint32_t x = 0; x < 64; x += 1) {
+          float cx = -2.0f + (x0 + x) * (4.0f / 1024);
+          float t = zx[x] * zx[x] - zy[x] * zy[x] + cx;
+          zy[x] = 2 * zx[x] * zy[x] + cy;
+          zx[x] = t;
+          c[x] += zx[x] * zx[x] + zy[x] * zy[x] <= 4.0f ? 0x500u : 0u;
+        }
+      }
+      for (uint32_t x = 0; x < 64; x += 1) {
+        data[y * 1024 + x0 + x] = c[x] | 0xFF000000u;
+      }
+    });
+
+void bench_host(Bench &bench) {
+  auto device = vk::host::createInstance()->getComputeDevice();
+  const uint32_t width = 1024, height = 1024;
+  auto pipeline = device->createComputePipeline(device->createShader(
+      "mandelbrot_host", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->createBuffer(width * height * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline->feedBuffer(0, 0, buffer, 0, width * height * sizeof(uint32_t));
+  auto command = pipeline->createCommand(width / 64, height);
+  double wall = Bench::measure(2, [&]() { command->submit()->wait(); });
+  bench.add("mandelbrot_host", "1024x1024", double(width * height) / wall * 1000.0,
+            "Mpixel/s");
+}
+
+void bench_perturbation(Bench &bench,
+                        const std::unique_ptr<vk::Device> &device) {
+  const uint32_t width = 1024, height = 1024;
+  vk::PerturbationMandelbrot mandelbrot(*device, width, height);
+  // cost should stay close to flat as the zoom deepens
+  for (int exponent : {2, 6, 10, 14}) {
+    long double radius = std::pow(10.0L, -exponent);
+    double time = Bench::measure(2, [&]() {
+      mandelbrot.render(-0.743643887037151L, 0.131825904205330L, radius, 1000)
+          ->wait();
+    });
+    bench.add("mandelbrot_perturbation", "1e-" + std::to_string(exponent),
+              double(width * height) / time * 1000.0, "Mpixel/s");
+  }
+}
+
+void bench_multi_device(Bench &bench, const vk::Instance &instance) {
+  const uint32_t width = 1024, height = 1024;
+  vk::MultiDevice devices(instance);
+  std::vector<uint32_t> pixels(width * height);
+  auto frame = [&]() {
+    devices.dispatch("./shaders/mandelbrot_rows.spv", height,
+                     width * sizeof(uint32_t), 1, pixels.data(), &width,
+                     sizeof(width));
+  };
+  // the first frames settle the shares
+  for (int i = 0; i < 4; i += 1) {
+    frame();
+  }
+  double time = Bench::measure(10, frame);
+  bench.add("mandelbrot_multi_device", std::to_string(devices.size()) + " devices",
+            double(width * height) / time * 1000.0, "Mpixel/s");
+}
+
+void bench_primitives(Bench &bench,
+                      const std::unique_ptr<vk::Device> &device) {
+  vk::Primitives primitives(*device);
+  for (uint32_t count : {1u << 16, 1u << 20, 1u << 24}) {
+    auto keys = device->createBuffer(count * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    auto values = device->createBuffer(count * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    auto output = device->createBuffer(count * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    auto param = std::to_string(count);
+    // element rate in Melem/s, contents are irrelevant for the timing
+    double reduce = Bench::measure(4, [&]() {
+      primitives.reduce<uint32_t>(keys, count, vk::ReduceOp::Sum);
+    });
+    bench.add("reduce_sum", param, count / reduce * 1000.0, "Melem/s");
+    double scan = Bench::measure(
+        4, [&]() { primitives.exclusiveScan(keys, output, count); });
+    bench.add("exclusive_scan", param, count / scan * 1000.0, "Melem/s");
+    double compact = Bench::measure(
+        4, [&]() { primitives.compact(values, keys, output, count); });
+    bench.add("compact", param, count / compact * 1000.0, "Melem/s");
+    double sort = Bench::measure(
+        2, [&]() { primitives.sortPairs(keys, values, count); });
+    bench.add("radix_sort_pairs", param, count / sort * 1000.0, "Melem/s");
+  }
+}
+
+void bench_gemm(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  vk::Gemm gemm(*device);
+  auto create = [&](uint32_t size) {
+    return device->createBuffer(size * sizeof(float),
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  };
+  for (uint32_t size : {256u, 512u, 1024u}) {
+    auto a = create(size * size), b = create(size * size),
+         c = create(size * size);
+    double time = Bench::measure(
+        2, [&]() { gemm.run(a, b, c, size, size, size); });
+    bench.add("gemm_f32", std::to_string(size), 2.0 * size * size * size / time,
+              "GFLOP/s");
+  }
+
+  const uint32_t batch = 4096, size = 16;
+  auto a = create(batch * size * size), b = create(batch * size * size),
+       c = create(batch * size * size);
+  double time = Bench::measure(
+      4, [&]() { gemm.run(a, b, c, size, size, size, 1.0f, 0.0f, batch); });
+  bench.add("gemm_f32_batched", "4096x16", 2.0 * batch * size * size * size / time,
+            "GFLOP/s");
+
+  if (!vk::Gemm::supportsFloat16(*device)) {
+    return;
+  }
+  vk::Gemm gemm16(*device, "./shaders", true);
+  for (uint32_t size : {256u, 512u, 1024u}) {
+    auto create16 = [&]() {
+      return device->createArray<vk::half>(size * size,
+                                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    };
+    auto a = create16(), b = create16(), c = create16();
+    double time = Bench::measure(
+        2, [&]() { gemm16.run(a, b, c, size, size, size); });
+    bench.add("gemm_f16", std::to_string(size), 2.0 * size * size * size / time,
+              "GFLOP/s");
+  }
+}
+
+// y = a * x + y over elements of T, reports the bytes moved
+template <typename T>
+void bench_axpy(Bench &bench, const std::unique_ptr<vk::Device> &device,
+                const std::string &name) {
+  const uint32_t count = 1u << 24;
+  auto pipeline = device->createComputePipeline(device->createShader(
+      "./shaders/" + name + ".spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto x = device->createArray<T>(count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  auto y = device->createArray<T>(count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  pipeline->feedBuffer(0, 0, x, 0, count * sizeof(T));
+  pipeline->feedBuffer(0, 1, y, 0, count * sizeof(T));
+  struct {
+    uint32_t count;
+    float a;
+  } params = {count, 0.5f};
+  pipeline->pushConstants(&params, sizeof(params));
+  auto command = pipeline->createCommand(count / 256);
+  double time = Bench::measure(4, [&]() { command->submit()->wait(); });
+  bench.add(name, std::to_string(count), 3.0 * count * sizeof(T) / time,
+            "GB/s");
+}
+
+void bench_storage(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  const auto &capabilities = device->capabilities();
+  bench_axpy<float>(bench, device, "axpy");
+  if (capabilities.shaderFloat16 && capabilities.storageBuffer16BitAccess) {
+    bench_axpy<vk::half>(bench, device, "axpy_f16");
+  }
+  if (capabilities.shaderInt8 && capabilities.storageBuffer8BitAccess) {
+    bench_axpy<uint8_t>(bench, device, "axpy_u8");
+  }
+}
+
+void bench_bitmap(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  vk::BitmapOps ops(*device);
+  const uint32_t width = 1024, height = 1024;
+  auto image = device->createBuffer(width * height * sizeof(uint32_t),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  auto hist = device->createBuffer(1024 * sizeof(uint32_t),
+                                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  std::vector<float> taps(9, 1.0f / 9.0f);
+  std::array<uint32_t, 256> lut;
+  for (uint32_t v = 0; v < 256; v += 1) {
+    lut[v] = (255 - v) * 0x01010101u;
+  }
+  double time = Bench::measure(4, [&]() {
+    ops.run({ops.convolve(image, image, width, height, taps),
+             {ops.applyLut(image, width, height, lut)},
+             ops.histogram(image, width, height, hist)});
+  });
+  bench.add("bitmap_chain", "1024x1024", width * height / time * 1000.0,
+            "Mpixel/s");
+}
+
+// 64 thumbnails of 128x128 a batch, one quad each, read back to the host
+void bench_graphics(Bench &bench, const vk::Instance &instance) {
+  const uint32_t size = 128, batch = 64;
+  auto device = instance.getGraphicDevice();
+  auto pipeline = device->makeGraphicsPipeline(
+      device->createShader("./shaders/shape_vert.spv",
+                           VK_SHADER_STAGE_VERTEX_BIT),
+      device->createShader("./shaders/shape_frag.spv",
+                           VK_SHADER_STAGE_FRAGMENT_BIT),
+      {6 * sizeof(float),
+       {std::make_tuple(0, VK_FORMAT_R32G32_SFLOAT, 0),
+        std::make_tuple(1, VK_FORMAT_R32G32B32A32_SFLOAT, 2 * sizeof(float))}});
+  std::vector<float> vertices = {-1.0f, -1.0f, 1.0f, 1.0f, 1.0f, 1.0f,
+                                 1.0f,  -1.0f, 1.0f, 1.0f, 1.0f, 1.0f,
+                                 -1.0f, 1.0f,  1.0f, 1.0f, 1.0f, 1.0f,
+                                 1.0f,  1.0f,  1.0f, 1.0f, 1.0f, 1.0f,
+                                 -1.0f, 1.0f,  1.0f, 1.0f, 1.0f, 1.0f,
+                                 1.0f,  -1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
+  auto vertexBuffer = device->makeBuffer(
+      vertices.size() * sizeof(float), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  vertexBuffer.update(vertices);
+
+  std::vector<vk::RenderTarget> targets;
+  std::vector<vk::Pass> passes;
+  for (uint32_t i = 0; i < batch; i += 1) {
+    float transform[4] = {0.5f, 0.5f, (i % 8) / 8.0f - 0.5f,
+                          (i / 8) / 8.0f - 0.5f};
+    pipeline.pushConstants(transform, sizeof(transform));
+    targets.push_back(pipeline.makeTarget(size, size));
+    passes.push_back(targets.back().pass({pipeline.draw(vertexBuffer, 6)}));
+  }
+  auto command = device->makeRenderCommand(passes);
+  auto fence = device->makeFence();
+  std::vector<uint8_t> pixels(targets[0].size());
+  double time = Bench::measure(4, [&]() {
+    command.submit(fence);
+    fence.wait();
+    for (const auto &target : targets) {
+      target.dump(pixels.data(), pixels.size());
+    }
+  });
+  bench.add("graphics_thumbnails", "64x128x128", batch / time * 1e9,
+            "thumbnails/s");
+}
+
+// Bilinear 1024x1024 to 768x768, packed pixels in storage buffers against
+// a sampled image written to a storage image
+void bench_images(Bench &bench, const std::unique_ptr<vk::Device> &device) {
+  const uint32_t width = 1024, height = 1024, size = 768;
+  auto fence = device->makeFence();
+
+  vk::BitmapOps ops(*device);
+  auto sourceBuffer = device->createBuffer(
+      width * height * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      vk::MemoryIntent::DeviceOnly);
+  auto targetBuffer = device->createBuffer(
+      size * size * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      vk::MemoryIntent::DeviceOnly);
+  auto buffers = device->makeCommand(
+      {ops.resize(sourceBuffer, targetBuffer, width, height, size, size)});
+  double buffer = Bench::measure(20, [&]() {
+    buffers.submit(fence);
+    fence.wait();
+  });
+  bench.add("resize", "buffer/1024->768", size * size / buffer * 1000.0,
+            "Mpixel/s");
+
+  auto source = device->makeImage(width, height, VK_FORMAT_R8G8B8A8_UNORM,
+                                  VK_IMAGE_USAGE_SAMPLED_BIT);
+  auto target = device->makeImage(size, size, VK_FORMAT_R8G8B8A8_UNORM,
+                                  VK_IMAGE_USAGE_STORAGE_BIT);
+  auto sampler = device->makeSampler(VK_FILTER_LINEAR);
+  auto pipeline = device->makeComputePipeline(device->createShader(
+      "./shaders/image_resize.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  pipeline.feedImage(0, 0, source, sampler);
+  pipeline.feedImage(0, 1, target);
+  auto images = device->makeCommand({pipeline.dispatch(size / 16, size / 16)});
+  double image = Bench::measure(20, [&]() {
+    images.submit(fence);
+    fence.wait();
+  });
+  bench.add("resize", "image/1024->768", size * size / image * 1000.0,
+            "Mpixel/s");
+}
+
+// A Mandelbrot frame shown through a headless swapchain, against the
+// same frame read back to the host the way JNIView2 does it
+void bench_present(Bench &bench, const vk::Instance &instance) {
+  std::unique_ptr<vk::Surface> surface;
+  try {
+    surface = instance.createHeadlessSurface();
+  } catch (const std::runtime_error &) {
+    return; // no VK_EXT_headless_surface
+  }
+  const uint32_t width = 1024, height = 1024;
+  auto device = instance.getGraphicDevice();
+  auto presenter = device->createPresenter(*surface, width, height);
+  auto pipeline = device->makeComputePipeline(device->createShader(
+      "./shaders/mandelbrot.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->makeBuffer(
+      width * height * sizeof(uint32_t),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline.feedBuffer(0, 0, buffer, 0, width * height * sizeof(uint32_t));
+
+  presenter->record({pipeline.dispatch(width, height)}, buffer);
+  double present = Bench::measure(10, [&]() { presenter->present(); });
+  presenter->wait();
+  bench.add("present_frame", "1024x1024", present / 1000.0, "us/frame");
+
+  auto command = pipeline.makeCommand(width, height);
+  auto fence = device->makeFence();
+  std::vector<uint32_t> pixels(width * height);
+  double readback = Bench::measure(10, [&]() {
+    command.submit(fence);
+    fence.wait();
+    buffer.dump(pixels);
+  });
+  bench.add("readback_frame", "1024x1024", readback / 1000.0, "us/frame");
+}
+
+int main(int argc, char **argv) {
+  bool json = false;
+  for (int i = 1; i < argc; i += 1) {
+    if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (std::strcmp(argv[i], "--csv") == 0) {
+      json = false;
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json | --csv]" << std::endl;
+      return 1;
+    }
+  }
+
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+
+  Bench bench;
+  // the first bring-up in the process, phase by phase
+  for (const auto &phase : context->startupTimes().phases) {
+    bench.add("startup", phase.first, phase.second, "us");
+  }
+  double create = Bench::measure(1, []() {
+    auto instance = vk::createInstance("naive_vulkan_bench");
+    instance->getComputeDevice();
+  });
+  bench.add("device_create", "instance+device", create / 1000.0, "us");
+  bench_bandwidth(bench, device);
+  bench_latency(bench, device);
+  bench_allocations(bench, device);
+  bench_descriptor(bench, device);
+  bench_pipeline(bench, device);
+  bench_mandelbrot(bench, device);
+  bench_perturbation(bench, device);
+  bench_multi_device(bench, *context->instance());
+  bench_host(bench);
+  bench_primitives(bench, device);
+  bench_gemm(bench, device);
+  bench_storage(bench, device);
+  bench_bitmap(bench, device);
+  bench_images(bench, device);
+  bench_graphics(bench, *context->instance());
+  bench_present(bench, *context->instance());
+
+  if (json) {
+    bench.printJson(std::cout, device->name());
+  } else {
+    bench.printCsv(std::cout);
+  }
+  return 0;
+}
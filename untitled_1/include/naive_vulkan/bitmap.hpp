@@ -0,0 +1,184 @@
+#ifndef __BITMAP_HPP__
+#define __BITMAP_HPP__
+
+// clang-format off
+#include <array>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "vulkan.hpp"
+// clang-format on
+
+namespace vk {
+
+// Kernels over packed RGBA8 images in storage buffers, one uint32 per
+// pixel with red in the low byte, as the Android bitmap path uses.
+// Every operation binds its buffers and returns dispatches, so a chain
+// runs in one command before a single readback. An operation binds a
+// pipeline of its own, so each appears at most once per chain.
+class BitmapOps {
+public:
+  BitmapOps() = delete;
+  BitmapOps(const Device &device, const std::string &shaderDir = "./shaders")
+      : m_device(device), m_weightCapacity(0), m_scratchCapacity(0) {
+    NAIVE_VULKAN_TRACE("BitmapOps::create");
+    auto load = [&](const std::string &name) {
+      return m_device.createShader(shaderDir + "/" + name + ".spv",
+                                   VK_SHADER_STAGE_COMPUTE_BIT);
+    };
+    auto convolve = load("convolve");
+    auto pipelines = m_device.createComputePipelinesAsync(
+        {convolve, convolve, load("resize"), load("lut"), load("histogram")});
+    m_horizontal = pipelines[0].get();
+    m_vertical = pipelines[1].get();
+    m_resize = pipelines[2].get();
+    m_lut = pipelines[3].get();
+    m_histogram = pipelines[4].get();
+    m_lutTable = m_device.createBuffer(256 * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  }
+
+public:
+  // Horizontal then vertical pass of a separable kernel with an odd
+  // number of taps, through an internal scratch image; target may be
+  // the source
+  std::vector<Dispatch> convolve(const std::unique_ptr<Buffer> &source,
+                                 const std::unique_ptr<Buffer> &target,
+                                 uint32_t width, uint32_t height,
+                                 const std::vector<float> &taps) {
+    NAIVE_VULKAN_TRACE("BitmapOps::convolve");
+    if (taps.size() % 2 == 0) {
+      throw std::runtime_error("convolution needs an odd number of taps!");
+    }
+    uint32_t range = width * height * sizeof(uint32_t);
+    uint32_t tapCount = static_cast<uint32_t>(taps.size());
+    if (m_weightCapacity < tapCount) {
+      m_weights = m_device.createBuffer(tapCount * sizeof(float),
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+      m_weightCapacity = tapCount;
+    }
+    m_weights->update(const_cast<float *>(taps.data()),
+                      tapCount * sizeof(float));
+    if (m_scratchCapacity < range) {
+      m_scratch = m_device.createBuffer(range,
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      m_scratchCapacity = range;
+    }
+
+    ConvolveParams params = {width, height, tapCount / 2, 0};
+    m_horizontal->feedBuffer(0, 0, source, 0, range);
+    m_horizontal->feedBuffer(0, 1, m_scratch, 0, range);
+    m_horizontal->feedBuffer(0, 2, m_weights, 0, tapCount * sizeof(float));
+    m_horizontal->pushConstants(&params, sizeof(params));
+    params.vertical = 1;
+    m_vertical->feedBuffer(0, 0, m_scratch, 0, range);
+    m_vertical->feedBuffer(0, 1, target, 0, range);
+    m_vertical->feedBuffer(0, 2, m_weights, 0, tapCount * sizeof(float));
+    m_vertical->pushConstants(&params, sizeof(params));
+    return {m_horizontal->dispatch(divUp(width, 16), divUp(height, 16)),
+            m_vertical->dispatch(divUp(width, 16), divUp(height, 16))};
+  }
+
+  // Bilinear, target must not alias the source
+  Dispatch resize(const std::unique_ptr<Buffer> &source,
+                  const std::unique_ptr<Buffer> &target, uint32_t sourceWidth,
+                  uint32_t sourceHeight, uint32_t targetWidth,
+                  uint32_t targetHeight) {
+    NAIVE_VULKAN_TRACE("BitmapOps::resize");
+    ResizeParams params = {sourceWidth, sourceHeight, targetWidth,
+                           targetHeight};
+    m_resize->feedBuffer(0, 0, source, 0,
+                         sourceWidth * sourceHeight * sizeof(uint32_t));
+    m_resize->feedBuffer(0, 1, target, 0,
+                         targetWidth * targetHeight * sizeof(uint32_t));
+    m_resize->pushConstants(&params, sizeof(params));
+    return m_resize->dispatch(divUp(targetWidth, 16), divUp(targetHeight, 16));
+  }
+
+  // In place, byte c of lut[v] replaces value v of channel c
+  Dispatch applyLut(const std::unique_ptr<Buffer> &image, uint32_t width,
+                    uint32_t height, const std::array<uint32_t, 256> &lut) {
+    NAIVE_VULKAN_TRACE("BitmapOps::applyLut");
+    uint32_t count = width * height;
+    m_lutTable->update(const_cast<uint32_t *>(lut.data()),
+                       lut.size() * sizeof(uint32_t));
+    m_lut->feedBuffer(0, 0, image, 0, count * sizeof(uint32_t));
+    m_lut->feedBuffer(0, 1, m_lutTable, 0, 256 * sizeof(uint32_t));
+    m_lut->pushConstants(&count, sizeof(count));
+    return m_lut->dispatch(divUp(count, 256));
+  }
+
+  // Clears and fills hist, 4 x 256 uint32 bins as hist[channel * 256 + v]
+  std::vector<Dispatch> histogram(const std::unique_ptr<Buffer> &image,
+                                  uint32_t width, uint32_t height,
+                                  const std::unique_ptr<Buffer> &hist) {
+    NAIVE_VULKAN_TRACE("BitmapOps::histogram");
+    uint32_t count = width * height;
+    m_histogram->feedBuffer(0, 0, image, 0, count * sizeof(uint32_t));
+    m_histogram->feedBuffer(0, 1, hist, 0, 1024 * sizeof(uint32_t));
+
+    std::vector<Dispatch> dispatches;
+    HistogramParams params = {count, 0};
+    m_histogram->pushConstants(&params, sizeof(params));
+    dispatches.push_back(m_histogram->dispatch(4));
+    params.mode = 1;
+    m_histogram->pushConstants(&params, sizeof(params));
+    dispatches.push_back(
+        m_histogram->dispatch(std::min(divUp(count, 256), uint32_t(256))));
+    return dispatches;
+  }
+
+  // Runs a chain and waits, the buffers stay on the device throughout
+  void run(const std::vector<std::vector<Dispatch>> &stages) {
+    std::vector<Dispatch> dispatches;
+    for (const auto &stage : stages) {
+      dispatches.insert(dispatches.end(), stage.begin(), stage.end());
+    }
+    m_device.createCommand(dispatches)->submit()->wait();
+  }
+
+private:
+  struct ConvolveParams {
+    uint32_t width;
+    uint32_t height;
+    uint32_t radius;
+    uint32_t vertical;
+  };
+
+  struct ResizeParams {
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    uint32_t targetWidth;
+    uint32_t targetHeight;
+  };
+
+  struct HistogramParams {
+    uint32_t count;
+    uint32_t mode;
+  };
+
+  static uint32_t divUp(uint32_t a, uint32_t b) { return (a + b - 1) / b; }
+
+private:
+  const Device &m_device;
+  std::unique_ptr<ComputePipeline> m_horizontal;
+  std::unique_ptr<ComputePipeline> m_vertical;
+  std::unique_ptr<ComputePipeline> m_resize;
+  std::unique_ptr<ComputePipeline> m_lut;
+  std::unique_ptr<ComputePipeline> m_histogram;
+  std::unique_ptr<Buffer> m_lutTable;
+  std::unique_ptr<Buffer> m_weights;
+  uint32_t m_weightCapacity;
+  std::unique_ptr<Buffer> m_scratch;
+  uint32_t m_scratchCapacity;
+};
+
+} // namespace vk
+
+#endif
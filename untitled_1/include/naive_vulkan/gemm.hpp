@@ -0,0 +1,127 @@
+#ifndef __GEMM_HPP__
+#define __GEMM_HPP__
+
+// clang-format off
+#include <tuple>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "vulkan.hpp"
+// clang-format on
+
+namespace vk {
+
+// Specialization of gemm.comp, a workgroup covers a
+// (threadsY * workM) x (threadsX * workN) tile of C
+struct GemmTiling {
+  uint32_t threadsX = 16;
+  uint32_t threadsY = 16;
+  uint32_t tileK = 16;
+  uint32_t workM = 4;
+  uint32_t workN = 4;
+};
+
+// C = alpha * A * B + beta * C on row-major matrices in storage buffers.
+// A batch of equally shaped matrices runs in one dispatch, one per
+// workgroup z, matrices of a batch lie back to back in each buffer.
+// With float16 the buffers hold halves and the arithmetic runs in fp16,
+// which needs shaderFloat16 and 16-bit storage in the device capabilities.
+class Gemm {
+public:
+  Gemm() = delete;
+  Gemm(const Device &device, const std::string &shaderDir = "./shaders",
+       bool float16 = false, const GemmTiling &large = GemmTiling())
+      : m_device(device), m_float16(float16), m_largeTiling(large) {
+    NAIVE_VULKAN_TRACE("Gemm::create");
+    if (float16 && !supportsFloat16(device)) {
+      throw std::runtime_error("failed to find float16 support on device!");
+    }
+    auto shader = m_device.createShader(
+        shaderDir + (float16 ? "/gemm_f16.spv" : "/gemm.spv"),
+        VK_SHADER_STAGE_COMPUTE_BIT);
+    m_smallTiling.threadsX = 8;
+    m_smallTiling.threadsY = 8;
+    m_smallTiling.tileK = 8;
+    m_smallTiling.workM = 1;
+    m_smallTiling.workN = 1;
+    m_large = createPipeline(shader, m_largeTiling);
+    m_small = createPipeline(shader, m_smallTiling);
+  }
+
+public:
+  // Whether the float16 variant runs on device
+  static bool supportsFloat16(const Device &device) {
+    const auto &capabilities = device.capabilities();
+    return capabilities.shaderFloat16 && capabilities.storageBuffer16BitAccess;
+  }
+
+  // Binds the buffers and returns a dispatch, for chaining with other
+  // stages in Device::createCommand before the next call rebinds them
+  Dispatch multiply(const std::unique_ptr<Buffer> &a,
+                    const std::unique_ptr<Buffer> &b,
+                    const std::unique_ptr<Buffer> &c, uint32_t m, uint32_t n,
+                    uint32_t k, float alpha = 1.0f, float beta = 0.0f,
+                    uint32_t batch = 1) {
+    NAIVE_VULKAN_TRACE("Gemm::multiply");
+    // small matrices waste most of a large tile
+    bool small = m <= 16 && n <= 16;
+    auto &pipeline = small ? m_small : m_large;
+    const auto &tiling = small ? m_smallTiling : m_largeTiling;
+
+    uint32_t elementSize = m_float16 ? 2 : 4;
+    pipeline->feedBuffer(0, 0, a, 0, batch * m * k * elementSize);
+    pipeline->feedBuffer(0, 1, b, 0, batch * k * n * elementSize);
+    pipeline->feedBuffer(0, 2, c, 0, batch * m * n * elementSize);
+
+    Params params = {m, n, k, m * k, k * n, m * n, alpha, beta};
+    pipeline->pushConstants(&params, sizeof(params));
+    uint32_t tileM = tiling.threadsY * tiling.workM;
+    uint32_t tileN = tiling.threadsX * tiling.workN;
+    return pipeline->dispatch((n + tileN - 1) / tileN, (m + tileM - 1) / tileM,
+                              batch);
+  }
+
+  void run(const std::unique_ptr<Buffer> &a, const std::unique_ptr<Buffer> &b,
+           const std::unique_ptr<Buffer> &c, uint32_t m, uint32_t n,
+           uint32_t k, float alpha = 1.0f, float beta = 0.0f,
+           uint32_t batch = 1) {
+    auto dispatch = multiply(a, b, c, m, n, k, alpha, beta, batch);
+    m_device.createCommand({dispatch})->submit()->wait();
+  }
+
+private:
+  struct Params {
+    uint32_t m;
+    uint32_t n;
+    uint32_t k;
+    uint32_t strideA;
+    uint32_t strideB;
+    uint32_t strideC;
+    float alpha;
+    float beta;
+  };
+
+  std::unique_ptr<ComputePipeline>
+  createPipeline(const std::shared_ptr<Shader> &shader,
+                 const GemmTiling &tiling) {
+    return m_device.createComputePipeline(
+        shader, shader->reflection().setsBindings(),
+        {std::make_tuple(0, tiling.threadsX),
+         std::make_tuple(1, tiling.threadsY), std::make_tuple(2, tiling.tileK),
+         std::make_tuple(3, tiling.workM), std::make_tuple(4, tiling.workN)});
+  }
+
+private:
+  const Device &m_device;
+  bool m_float16;
+  GemmTiling m_largeTiling;
+  GemmTiling m_smallTiling;
+  std::unique_ptr<ComputePipeline> m_large;
+  std::unique_ptr<ComputePipeline> m_small;
+};
+
+} // namespace vk
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef __HALF_HPP__
+#define __HALF_HPP__
+
+// clang-format off
+#include <cstdint>
+#include <cstring>
+// clang-format on
+
+namespace vk {
+
+// IEEE binary16 as stored by float16 kernels, converted on the host.
+// Rounds to nearest even, keeps subnormals, infinities and NaN.
+struct half {
+  uint16_t bits;
+
+  half() = default;
+  explicit half(float value) : bits(fromFloat(value)) {}
+
+  operator float() const { return toFloat(bits); }
+
+  static half fromBits(uint16_t bits) {
+    half value;
+    value.bits = bits;
+    return value;
+  }
+
+private:
+  static uint16_t fromFloat(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000u;
+    uint32_t exponent = (f >> 23) & 0xFFu;
+    uint32_t mantissa = f & 0x7FFFFFu;
+
+    if (exponent == 0xFFu) {
+      // keep NaN a NaN when the payload sits in the low bits
+      return uint16_t(sign | 0x7C00u | (mantissa ? 0x200u | (mantissa >> 13) : 0u));
+    }
+    int32_t e = int32_t(exponent) - 127 + 15;
+    if (e >= 0x1F) {
+      return uint16_t(sign | 0x7C00u);
+    }
+    if (e <= 0) {
+      if (e < -10) {
+        return uint16_t(sign);
+      }
+      // subnormal, the implicit bit shifts in
+      mantissa |= 0x800000u;
+      uint32_t shift = uint32_t(14 - e);
+      uint32_t result = mantissa >> shift;
+      uint32_t rest = mantissa & ((1u << shift) - 1);
+      uint32_t halfway = 1u << (shift - 1);
+      if (rest > halfway || (rest == halfway && (result & 1u))) {
+        result += 1;
+      }
+      return uint16_t(sign | result);
+    }
+    uint32_t result = (uint32_t(e) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFFu;
+    // a carry into the exponent rounds up to the next binade or infinity
+    if (rest > 0x1000u || (rest == 0x1000u && (result & 1u))) {
+      result += 1;
+    }
+    return uint16_t(sign | result);
+  }
+
+  static float toFloat(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1Fu;
+    uint32_t mantissa = h & 0x3FFu;
+    uint32_t f;
+    if (exponent == 0x1Fu) {
+      f = sign | 0x7F800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+      f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+      f = sign;
+    } else {
+      // subnormal, normalize into a float
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400u)) {
+        mantissa <<= 1;
+        exponent -= 1;
+      }
+      f = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+    }
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+    return value;
+  }
+};
+
+static_assert(sizeof(half) == 2, "half must be 16-bit");
+
+} // namespace vk
+
+#endif
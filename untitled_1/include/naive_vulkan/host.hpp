@@ -0,0 +1,704 @@
+#ifndef __HOST_HPP__
+#define __HOST_HPP__
+
+// clang-format off
+#include <map>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <tuple>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "trace.hpp"
+// clang-format on
+
+// ----------
+// CPU backend with the API of vk::Instance, vk::Device, vk::Buffer,
+// vk::ComputePipeline and vk::Command, for machines without a Vulkan
+// device. Shaders are C++ kernels registered under the file name of
+// their SPIR-V, so createShader("./shaders/test_1.spv", ...) picks the
+// kernel registered as "test_1". Only the Vulkan headers are needed.
+// ----------
+
+namespace vk {
+namespace host {
+
+// Work-stealing pool, every worker owns a deque and pops from its back,
+// idle workers steal from the front of the others. Ranges are split
+// lazily, a task keeps the front half and leaves the back half to steal.
+class WorkStealingPool {
+public:
+  WorkStealingPool() = delete;
+  WorkStealingPool(size_t threadCount)
+      : m_queues(std::max(threadCount, size_t(1))), m_stop(false),
+        m_pending(0) {
+    for (size_t i = 0; i < m_queues.size(); i += 1) {
+      m_threads.emplace_back([this, i]() { work(i); });
+    }
+  }
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    for (auto &thread : m_threads) {
+      thread.join();
+    }
+  }
+
+public:
+  // Runs body(i) for i in [0, count) and returns when all have finished,
+  // the calling thread takes part
+  void parallelFor(uint32_t count,
+                   const std::function<void(uint32_t)> &body) {
+    if (count == 0) {
+      return;
+    }
+    Job job;
+    job.body = &body;
+    job.remaining = count;
+    job.grain = std::max(count / uint32_t(8 * m_queues.size()), uint32_t(1));
+
+    // one slice per worker to start with
+    uint32_t slices = std::min(count, uint32_t(m_queues.size()));
+    for (uint32_t i = 0; i < slices; i += 1) {
+      push(i, {&job, count * i / slices, count * (i + 1) / slices});
+    }
+    wake();
+
+    // help until every index has run
+    Task task;
+    while (job.remaining.load(std::memory_order_acquire) != 0) {
+      if (steal(0, task)) {
+        run(0, task);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  size_t size() const { return m_threads.size(); }
+
+private:
+  struct Job {
+    const std::function<void(uint32_t)> *body;
+    std::atomic<uint32_t> remaining;
+    uint32_t grain;
+  };
+
+  struct Task {
+    Job *job;
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void push(size_t index, const Task &task) {
+    {
+      std::lock_guard<std::mutex> lock(m_queues[index].mutex);
+      m_queues[index].tasks.push_back(task);
+    }
+    m_pending.fetch_add(1, std::memory_order_release);
+  }
+
+  // Taking the lock orders the wakeup after a worker's check of m_pending
+  void wake() {
+    { std::lock_guard<std::mutex> lock(m_mutex); }
+    m_condition.notify_all();
+  }
+
+  bool pop(size_t index, Task &task) {
+    std::lock_guard<std::mutex> lock(m_queues[index].mutex);
+    if (m_queues[index].tasks.empty()) {
+      return false;
+    }
+    task = m_queues[index].tasks.back();
+    m_queues[index].tasks.pop_back();
+    m_pending.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Own queue first, then the others starting from the next one
+  bool steal(size_t index, Task &task) {
+    if (pop(index, task)) {
+      return true;
+    }
+    for (size_t i = 1; i < m_queues.size(); i += 1) {
+      auto &victim = m_queues[(index + i) % m_queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(size_t index, Task task) {
+    while (task.end - task.begin > task.job->grain) {
+      uint32_t middle = task.begin + (task.end - task.begin) / 2;
+      push(index, {task.job, middle, task.end});
+      wake();
+      task.end = middle;
+    }
+    for (uint32_t i = task.begin; i < task.end; i += 1) {
+      (*task.job->body)(i);
+    }
+    task.job->remaining.fetch_sub(task.end - task.begin,
+                                  std::memory_order_release);
+  }
+
+  void work(size_t index) {
+    Task task;
+    for (;;) {
+      if (steal(index, task)) {
+        run(index, task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [this]() {
+        return m_stop || m_pending.load(std::memory_order_acquire) != 0;
+      });
+      if (m_stop) {
+        return;
+      }
+    }
+  }
+
+private:
+  std::vector<Queue> m_queues;
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_stop;
+  std::atomic<uint32_t> m_pending;
+};
+
+class Buffer {
+public:
+  Buffer() = delete;
+  Buffer(uint32_t size, VkBufferUsageFlags usage,
+         VkMemoryPropertyFlags /*properties*/)
+      : m_size(size), m_storage(size + Alignment) {
+    VkBufferUsageFlags descUsage =
+        usage & (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    if (descUsage == VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+      m_descType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    } else if (descUsage == VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+      m_descType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    } else {
+      throw std::runtime_error("not implemented");
+    }
+    // aligned for vector loads in kernels
+    auto address = reinterpret_cast<uintptr_t>(m_storage.data());
+    m_data = m_storage.data() + (Alignment - address % Alignment) % Alignment;
+  }
+
+public:
+  uint8_t *data() const { return m_data; }
+
+  uint32_t size() const { return m_size; }
+
+  const VkDescriptorType &descType() const { return m_descType; }
+
+  void update(void *in, size_t size) {
+    NAIVE_VULKAN_TRACE("Buffer::update");
+    std::memcpy(m_data, in, std::min(size_t(m_size), size));
+  }
+
+  void print() const {
+    for (size_t i = 0; i < m_size / sizeof(uint32_t); i += 1) {
+      std::cout << reinterpret_cast<uint32_t *>(m_data)[i] << " ";
+    }
+    std::cout << std::endl;
+  }
+
+  void dump(void *out, size_t size) const {
+    NAIVE_VULKAN_TRACE("Buffer::dump");
+    std::memcpy(out, m_data, std::min(size_t(m_size), size));
+  }
+
+private:
+  enum : uintptr_t { Alignment = 64 };
+
+  uint32_t m_size;
+  std::vector<uint8_t> m_storage;
+  uint8_t *m_data;
+  VkDescriptorType m_descType;
+};
+
+// What a kernel sees of one workgroup. A kernel runs all invocations of
+// its workgroup, so shared memory is a local array and a barrier is the
+// end of a loop over the invocations. Keep the loop over local x
+// innermost and free of branches so the compiler can vectorize it.
+struct WorkGroup {
+  std::array<uint32_t, 3> id;    // gl_WorkGroupID
+  std::array<uint32_t, 3> count; // gl_NumWorkGroups
+  std::array<uint32_t, 3> size;  // gl_WorkGroupSize
+  const std::vector<std::vector<uint8_t *>> *bindings;
+  const std::vector<uint8_t> *pushConstants;
+  const std::vector<std::tuple<uint32_t, uint32_t>> *specialization;
+
+  template <typename T> T *buffer(uint32_t binding, uint32_t set = 0) const {
+    return reinterpret_cast<T *>((*bindings)[set][binding]);
+  }
+
+  template <typename T> const T &params() const {
+    return *reinterpret_cast<const T *>(pushConstants->data());
+  }
+
+  uint32_t constant(uint32_t id, uint32_t fallback) const {
+    for (const auto &constant : *specialization) {
+      if (std::get<0>(constant) == id) {
+        return std::get<1>(constant);
+      }
+    }
+    return fallback;
+  }
+};
+
+typedef std::function<void(const WorkGroup &)> Kernel;
+
+class Shader {
+public:
+  Shader() = delete;
+  Shader(const std::string &name, const std::array<uint32_t, 3> &localSize,
+         const Kernel &kernel)
+      : m_name(name), m_localSize(localSize), m_kernel(kernel) {}
+
+public:
+  const std::string &name() const { return m_name; }
+
+  const std::array<uint32_t, 3> &localSize() const { return m_localSize; }
+
+  const Kernel &kernel() const { return m_kernel; }
+
+private:
+  std::string m_name;
+  std::array<uint32_t, 3> m_localSize;
+  Kernel m_kernel;
+};
+
+// Process-wide kernel registry, keyed by name
+class KernelRegistry {
+public:
+  void add(const std::string &name, const std::array<uint32_t, 3> &localSize,
+           const Kernel &kernel) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_kernels[name] = std::make_shared<Shader>(name, localSize, kernel);
+  }
+
+  std::shared_ptr<Shader> find(const std::string &name) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_kernels.find(name);
+    if (it == m_kernels.end()) {
+      throw std::runtime_error("failed to find host kernel " + name + "!");
+    }
+    return it->second;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::map<std::string, std::shared_ptr<Shader>> m_kernels;
+};
+
+inline KernelRegistry &kernels() {
+  static KernelRegistry registry;
+  return registry;
+}
+
+// Returns true so it can initialize a static at namespace scope
+inline bool registerKernel(const std::string &name,
+                           const std::array<uint32_t, 3> &localSize,
+                           const Kernel &kernel) {
+  kernels().add(name, localSize, kernel);
+  return true;
+}
+
+class Fence {
+public:
+  Fence() = delete;
+  Fence(std::shared_future<void> future) : m_future(std::move(future)) {}
+
+public:
+  bool isReady() const { return waitFor(0); }
+
+  // Returns false if the timeout (in nanoseconds) expires first
+  bool waitFor(uint64_t timeout) const {
+    NAIVE_VULKAN_TRACE("Fence::wait");
+    if (timeout == UINT64_MAX) {
+      m_future.wait();
+    } else {
+      // wait_for adds to now() and overflows on huge timeouts, so wait in
+      // slices of at most an hour
+      const uint64_t slice = 3600ull * 1000 * 1000 * 1000;
+      for (;;) {
+        uint64_t step = std::min(timeout, slice);
+        if (m_future.wait_for(std::chrono::nanoseconds(step)) ==
+            std::future_status::ready) {
+          break;
+        }
+        timeout -= step;
+        if (timeout == 0) {
+          return false;
+        }
+      }
+    }
+    m_future.get(); // rethrows a failed submit
+    return true;
+  }
+
+  void wait() const {
+    NAIVE_VULKAN_TRACE("Fence::wait");
+    m_future.get();
+  }
+
+  // Index of a signaled fence, or fences.size() on timeout
+  static size_t waitAny(const std::vector<std::unique_ptr<Fence>> &fences,
+                        uint64_t timeout = UINT64_MAX) {
+    auto begin = std::chrono::steady_clock::now();
+    for (;;) {
+      for (size_t i = 0; i < fences.size(); i += 1) {
+        if (fences[i]->isReady()) {
+          return i;
+        }
+      }
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - begin);
+      if (fences.empty() || uint64_t(elapsed.count()) >= timeout) {
+        return fences.size();
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  static bool waitAll(const std::vector<std::unique_ptr<Fence>> &fences,
+                      uint64_t timeout = UINT64_MAX) {
+    auto begin = std::chrono::steady_clock::now();
+    for (const auto &fence : fences) {
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - begin);
+      uint64_t spent = uint64_t(elapsed.count());
+      if (spent > timeout ||
+          !fence->waitFor(timeout == UINT64_MAX ? timeout : timeout - spent)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  std::shared_future<void> m_future;
+};
+
+struct Dispatch {
+  std::shared_ptr<Shader> shader;
+  std::vector<std::vector<uint8_t *>> bindings;
+  std::vector<uint8_t> pushConstants;
+  std::shared_ptr<std::vector<std::tuple<uint32_t, uint32_t>>> specialization;
+  std::array<uint32_t, 3> workers;
+  // When set, workgroup counts are read from a VkDispatchIndirectCommand
+  // here at execution time instead of workers
+  const uint8_t *indirect = nullptr;
+};
+
+// In-order execution of commands, the host counterpart of a queue
+class Queue {
+public:
+  Queue(size_t threadCount)
+      : m_pool(threadCount), m_stop(false), m_thread([this]() { work(); }) {}
+  ~Queue() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_one();
+    m_thread.join();
+  }
+
+public:
+  std::shared_future<void> submit(std::function<void()> f) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(f));
+    auto future = task->get_future().share();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.emplace([task]() { (*task)(); });
+    }
+    m_condition.notify_one();
+    return future;
+  }
+
+  WorkStealingPool &pool() { return m_pool; }
+
+private:
+  void work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+        if (m_tasks.empty()) {
+          return;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop();
+      }
+      task();
+    }
+  }
+
+private:
+  WorkStealingPool m_pool;
+  bool m_stop;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::queue<std::function<void()>> m_tasks;
+  std::thread m_thread;
+};
+
+class Command {
+public:
+  Command() = delete;
+  Command(Queue &queue, const std::vector<Dispatch> &dispatches,
+          bool profile = false)
+      : m_queue(queue), m_dispatches(dispatches), m_profile(profile),
+        m_durations(std::make_shared<std::vector<double>>()) {}
+
+public:
+  std::unique_ptr<Fence> submit() {
+    NAIVE_VULKAN_TRACE("Command::submit");
+    auto dispatches = m_dispatches;
+    auto durations = m_durations;
+    bool profile = m_profile;
+    Queue &queue = m_queue;
+    return std::make_unique<Fence>(m_queue.submit([=, &queue]() {
+      durations->clear();
+      for (const auto &dispatch : dispatches) {
+        auto begin = std::chrono::steady_clock::now();
+        execute(queue.pool(), dispatch);
+        if (profile) {
+          durations->push_back(double(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - begin)
+                  .count()));
+        }
+      }
+    }));
+  }
+
+  // Wall time of each dispatch in nanoseconds, valid once the fence signals
+  std::vector<double> durations() const { return *m_durations; }
+
+private:
+  // One task per workgroup, x fastest
+  static void execute(WorkStealingPool &pool, const Dispatch &dispatch) {
+    NAIVE_VULKAN_TRACE("host::dispatch");
+    std::array<uint32_t, 3> count = dispatch.workers;
+    if (dispatch.indirect != nullptr) {
+      std::memcpy(count.data(), dispatch.indirect, sizeof(count));
+    }
+    uint64_t total = uint64_t(count[0]) * count[1] * count[2];
+    if (total == 0) {
+      return;
+    }
+    if (total > UINT32_MAX) {
+      throw std::runtime_error("too many workgroups!");
+    }
+    const Kernel &kernel = dispatch.shader->kernel();
+    pool.parallelFor(uint32_t(total), [&](uint32_t index) {
+      WorkGroup group;
+      group.id = {index % count[0], index / count[0] % count[1],
+                  index / count[0] / count[1]};
+      group.count = count;
+      group.size = dispatch.shader->localSize();
+      group.bindings = &dispatch.bindings;
+      group.pushConstants = &dispatch.pushConstants;
+      group.specialization = dispatch.specialization.get();
+      kernel(group);
+    });
+  }
+
+private:
+  Queue &m_queue;
+  std::vector<Dispatch> m_dispatches;
+  bool m_profile;
+  std::shared_ptr<std::vector<double>> m_durations;
+};
+
+class ComputePipeline {
+public:
+  ComputePipeline() = delete;
+  ComputePipeline(
+      Queue &queue, const std::shared_ptr<Shader> &shader,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization = {})
+      : m_queue(queue), m_shader(shader),
+        m_specialization(
+            std::make_shared<std::vector<std::tuple<uint32_t, uint32_t>>>(
+                specialization)) {
+    NAIVE_VULKAN_TRACE("ComputePipeline::create");
+    for (const auto &bindings : setsBindings) {
+      uint32_t count = 0;
+      for (const auto &bind : bindings) {
+        count = std::max(count, std::get<0>(bind) + 1);
+      }
+      m_bindings.emplace_back(count, nullptr);
+    }
+  }
+
+public:
+  void feedBuffer(uint32_t set, uint32_t binding,
+                  const std::unique_ptr<Buffer> &buffer, uint32_t offset,
+                  uint32_t range) {
+    NAIVE_VULKAN_TRACE("ComputePipeline::feedBuffer");
+    if (uint64_t(offset) + range > buffer->size()) {
+      throw std::runtime_error("failed to bind buffer, range out of bounds!");
+    }
+    if (m_bindings.size() <= set) {
+      m_bindings.resize(set + 1);
+    }
+    if (m_bindings[set].size() <= binding) {
+      m_bindings[set].resize(binding + 1, nullptr);
+    }
+    m_bindings[set][binding] = buffer->data() + offset;
+  }
+
+  // Recorded into every command created afterwards
+  void pushConstants(const void *data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    m_pushConstants.assign(bytes, bytes + size);
+  }
+
+  // Unlike descriptor sets, bindings are captured when the dispatch is made
+  Dispatch dispatch(uint32_t x, uint32_t y = 1, uint32_t z = 1) const {
+    Dispatch dispatch;
+    dispatch.shader = m_shader;
+    dispatch.bindings = m_bindings;
+    dispatch.pushConstants = m_pushConstants;
+    dispatch.specialization = m_specialization;
+    dispatch.workers = {x, y, z};
+    return dispatch;
+  }
+
+  Dispatch dispatchIndirect(const std::unique_ptr<Buffer> &buffer,
+                            VkDeviceSize offset = 0) const {
+    Dispatch dispatch = this->dispatch(0, 0, 0);
+    dispatch.indirect = buffer->data() + offset;
+    return dispatch;
+  }
+
+  std::unique_ptr<Command> createCommand(uint32_t x, uint32_t y = 1,
+                                         uint32_t z = 1) {
+    return std::make_unique<Command>(m_queue,
+                                     std::vector<Dispatch>{dispatch(x, y, z)});
+  }
+
+  const std::array<uint32_t, 3> &localSize() const {
+    return m_shader->localSize();
+  }
+
+private:
+  Queue &m_queue;
+  std::shared_ptr<Shader> m_shader;
+  std::shared_ptr<std::vector<std::tuple<uint32_t, uint32_t>>>
+      m_specialization;
+  std::vector<std::vector<uint8_t *>> m_bindings;
+  std::vector<uint8_t> m_pushConstants;
+};
+
+class Device {
+public:
+  Device(size_t threadCount = std::thread::hardware_concurrency())
+      : m_queue(std::make_unique<Queue>(std::max(threadCount, size_t(1)))) {
+    NAIVE_VULKAN_TRACE("Device::create");
+  }
+
+public:
+  std::unique_ptr<Buffer> createBuffer(uint32_t size, VkBufferUsageFlags usage,
+                                       VkMemoryPropertyFlags properties) const {
+    return std::make_unique<Buffer>(size, usage, properties);
+  }
+
+  // The kernel registered under the file name without directory and
+  // extension, "./shaders/test_1.spv" -> "test_1"
+  std::shared_ptr<Shader> createShader(const std::string &shaderPath,
+                                       VkShaderStageFlagBits shaderStage) const {
+    if (shaderStage != VK_SHADER_STAGE_COMPUTE_BIT) {
+      throw std::runtime_error("not implemented");
+    }
+    size_t begin = shaderPath.find_last_of("/\\");
+    begin = begin == std::string::npos ? 0 : begin + 1;
+    size_t end = shaderPath.find_last_of('.');
+    if (end == std::string::npos || end < begin) {
+      end = shaderPath.size();
+    }
+    return kernels().find(shaderPath.substr(begin, end - begin));
+  }
+
+  std::unique_ptr<ComputePipeline> createComputePipeline(
+      const std::shared_ptr<Shader> &shader,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization =
+          {}) const {
+    return std::make_unique<ComputePipeline>(*m_queue, shader, setsBindings,
+                                             specialization);
+  }
+
+  // Bindings grow as buffers are fed
+  std::unique_ptr<ComputePipeline>
+  createComputePipeline(const std::shared_ptr<Shader> &shader) const {
+    return createComputePipeline(shader, {});
+  }
+
+  std::unique_ptr<Command> createCommand(const std::vector<Dispatch> &dispatches,
+                                         bool profile = false) const {
+    return std::make_unique<Command>(*m_queue, dispatches, profile);
+  }
+
+  std::string name() const {
+    return "host (" + std::to_string(m_queue->pool().size()) + " threads)";
+  }
+
+private:
+  std::unique_ptr<Queue> m_queue;
+};
+
+class Instance {
+public:
+  std::unique_ptr<Device> getComputeDevice() const {
+    return std::make_unique<Device>();
+  }
+};
+
+inline std::unique_ptr<Instance> createInstance() {
+  return std::make_unique<Instance>();
+}
+
+} // namespace host
+} // namespace vk
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef __MANDELBROT_HPP__
+#define __MANDELBROT_HPP__
+
+// clang-format off
+#include <map>
+#include <list>
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "vulkan.hpp"
+// clang-format on
+
+namespace vk {
+
+// Mandelbrot view that keeps computed 16x16 tiles in a device atlas.
+// Tiles live on a grid of zoom levels, 8 per octave, and a view samples
+// the finest level not finer than its own step, so a pan or a zoom that
+// stays within a level only renders the newly exposed tiles. The missing
+// tiles go through an indirect dispatch, the command is recorded once.
+class TiledMandelbrot {
+public:
+  TiledMandelbrot() = delete;
+  TiledMandelbrot(const Device &device, uint32_t width = 1024,
+                  uint32_t height = 1024,
+                  const std::string &shaderDir = "./shaders",
+                  uint32_t cacheTiles = 0)
+      : m_device(device), m_width(width), m_height(height), m_frame(0),
+        m_rendered(0) {
+    NAIVE_VULKAN_TRACE("TiledMandelbrot::create");
+    // one level step is at most 2^(1/8) times finer than the view step,
+    // plus a tile of float rounding on either side
+    double levelRatio = std::exp2(1.0 / LevelsPerOctave);
+    m_tableWidth = uint32_t(std::ceil(width * levelRatio / 16)) + 2;
+    m_tableHeight = uint32_t(std::ceil(height * levelRatio / 16)) + 2;
+    uint32_t visible = m_tableWidth * m_tableHeight;
+    m_slotCount = std::max(cacheTiles, 2 * visible);
+    for (uint32_t slot = 0; slot < m_slotCount; slot += 1) {
+      m_freeSlots.push_back(m_slotCount - 1 - slot);
+    }
+
+    auto hostBuffer = [&](uint32_t size, VkBufferUsageFlags usage) {
+      return m_device.createBuffer(size, usage,
+                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    };
+    m_frameParams = hostBuffer(sizeof(Frame), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+    m_tiles = hostBuffer(visible * sizeof(Tile),
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    m_table = hostBuffer(visible * sizeof(uint32_t),
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    m_indirect = hostBuffer(3 * sizeof(uint32_t),
+                            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+    m_image = m_device.createBuffer(width * height * sizeof(uint32_t),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                    MemoryIntent::Readback);
+    m_atlas = m_device.createBuffer(m_slotCount * 256 * sizeof(uint32_t),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                    MemoryIntent::DeviceOnly);
+
+    auto load = [&](const std::string &name) {
+      return m_device.createShader(shaderDir + "/" + name + ".spv",
+                                   VK_SHADER_STAGE_COMPUTE_BIT);
+    };
+    m_render = m_device.createComputePipeline(load("tile_render"));
+    m_render->feedBuffer(0, 0, m_frameParams, 0, sizeof(Frame));
+    m_render->feedBuffer(0, 1, m_tiles, 0, visible * sizeof(Tile));
+    m_render->feedBuffer(0, 2, m_atlas, 0, m_slotCount * 256 * sizeof(uint32_t));
+    m_compose = m_device.createComputePipeline(load("tile_compose"));
+    m_compose->feedBuffer(0, 0, m_frameParams, 0, sizeof(Frame));
+    m_compose->feedBuffer(0, 1, m_table, 0, visible * sizeof(uint32_t));
+    m_compose->feedBuffer(0, 2, m_atlas, 0,
+                          m_slotCount * 256 * sizeof(uint32_t));
+    m_compose->feedBuffer(0, 3, m_image, 0, width * height * sizeof(uint32_t));
+    m_command = m_device.createCommand(
+        {m_render->dispatchIndirect(m_indirect),
+         m_compose->dispatch((width + 15) / 16, (height + 15) / 16)});
+  }
+
+public:
+  // Renders the view of [centre - radius, centre + radius] across the
+  // width, square pixels. The parameter buffers are rewritten on every
+  // call, so wait for the returned fence before the next one.
+  std::unique_ptr<Fence> render(double centreX, double centreY,
+                                double radius) {
+    NAIVE_VULKAN_TRACE("TiledMandelbrot::render");
+    m_frame += 1;
+    double step = 2.0 * radius / m_width;
+    int level = int(std::floor(std::log2(step) * LevelsPerOctave));
+    double levelStep = std::exp2(double(level) / LevelsPerOctave);
+    double ratio = step / levelStep;
+
+    // level pixels under the first and last output pixels
+    double left = (centreX - radius) / levelStep;
+    double top = (centreY - step * m_height / 2) / levelStep;
+    int firstX = floorDiv(int64_t(std::floor(left)), 16);
+    int firstY = floorDiv(int64_t(std::floor(top)), 16);
+    int lastX = floorDiv(int64_t(std::floor(left + m_width * ratio)), 16);
+    int lastY = floorDiv(int64_t(std::floor(top + m_height * ratio)), 16);
+    uint32_t columns = std::min(uint32_t(lastX - firstX + 1), m_tableWidth);
+    uint32_t rows = std::min(uint32_t(lastY - firstY + 1), m_tableHeight);
+
+    std::vector<uint32_t> table(columns * rows);
+    std::vector<Tile> missing;
+    for (uint32_t y = 0; y < rows; y += 1) {
+      for (uint32_t x = 0; x < columns; x += 1) {
+        Key key = std::make_tuple(level, firstX + int(x), firstY + int(y));
+        auto it = m_cache.find(key);
+        if (it != m_cache.end()) {
+          m_lru.splice(m_lru.begin(), m_lru, it->second.position);
+        } else {
+          Entry entry = {acquireSlot(), m_frame, m_lru.end()};
+          m_lru.push_front(key);
+          entry.position = m_lru.begin();
+          it = m_cache.emplace(key, entry).first;
+          missing.push_back({entry.slot, std::get<1>(key), std::get<2>(key)});
+        }
+        it->second.frame = m_frame;
+        table[y * columns + x] = it->second.slot;
+      }
+    }
+    m_rendered = static_cast<uint32_t>(missing.size());
+
+    Frame frame = {};
+    frame.firstTileX = firstX;
+    frame.firstTileY = firstY;
+    frame.offsetX = float(left - firstX * 16.0);
+    frame.offsetY = float(top - firstY * 16.0);
+    frame.ratio = float(ratio);
+    frame.levelStep = float(levelStep);
+    frame.tableWidth = columns;
+    frame.tableHeight = rows;
+    frame.width = m_width;
+    frame.height = m_height;
+    m_frameParams->update(&frame, sizeof(frame));
+    m_table->update(table.data(), table.size() * sizeof(uint32_t));
+    if (!missing.empty()) {
+      m_tiles->update(missing.data(), missing.size() * sizeof(Tile));
+    }
+    uint32_t workgroups[3] = {m_rendered, 1, 1};
+    m_indirect->update(workgroups, sizeof(workgroups));
+    return m_command->submit();
+  }
+
+  // Packed RGBA8 pixels of the last render, row-major
+  const std::unique_ptr<Buffer> &image() const { return m_image; }
+
+  // Tiles the last render computed, the rest came from the cache
+  uint32_t renderedTiles() const { return m_rendered; }
+
+  uint32_t cachedTiles() const {
+    return static_cast<uint32_t>(m_cache.size());
+  }
+
+private:
+  enum : int { LevelsPerOctave = 8 };
+
+  // (level, tile x, tile y)
+  typedef std::tuple<int, int, int> Key;
+
+  struct Entry {
+    uint32_t slot;
+    uint64_t frame;
+    std::list<Key>::iterator position;
+  };
+
+  struct Frame {
+    int32_t firstTileX;
+    int32_t firstTileY;
+    float offsetX;
+    float offsetY;
+    float ratio;
+    float levelStep;
+    uint32_t tableWidth;
+    uint32_t tableHeight;
+    uint32_t width;
+    uint32_t height;
+  };
+
+  struct Tile {
+    uint32_t slot;
+    int32_t x;
+    int32_t y;
+  };
+
+  static int floorDiv(int64_t a, int64_t b) {
+    return static_cast<int>(a >= 0 ? a / b : -((-a + b - 1) / b));
+  }
+
+  // A free slot, else the least recently used tile not in this frame
+  uint32_t acquireSlot() {
+    if (!m_freeSlots.empty()) {
+      uint32_t slot = m_freeSlots.back();
+      m_freeSlots.pop_back();
+      return slot;
+    }
+    auto it = m_cache.find(m_lru.back());
+    if (it->second.frame == m_frame) {
+      throw std::runtime_error("failed to find a free tile slot!");
+    }
+    uint32_t slot = it->second.slot;
+    m_lru.pop_back();
+    m_cache.erase(it);
+    return slot;
+  }
+
+private:
+  const Device &m_device;
+  uint32_t m_width;
+  uint32_t m_height;
+  uint32_t m_tableWidth;
+  uint32_t m_tableHeight;
+  uint32_t m_slotCount;
+  uint64_t m_frame;
+  uint32_t m_rendered;
+  //
+  std::map<Key, Entry> m_cache;
+  std::list<Key> m_lru;
+  std::vector<uint32_t> m_freeSlots;
+  //
+  std::unique_ptr<Buffer> m_frameParams;
+  std::unique_ptr<Buffer> m_tiles;
+  std::unique_ptr<Buffer> m_table;
+  std::unique_ptr<Buffer> m_indirect;
+  std::unique_ptr<Buffer> m_image;
+  std::unique_ptr<Buffer> m_atlas;
+  std::unique_ptr<ComputePipeline> m_render;
+  std::unique_ptr<ComputePipeline> m_compose;
+  std::unique_ptr<Command> m_command;
+};
+
+// Deep-zoom Mandelbrot by perturbation. The host iterates one reference
+// orbit at the view centre in long double and uploads it, the GPU
+// iterates per-pixel float offsets from it and rebases glitched pixels
+// onto the start of the orbit. The orbit is reused while its point stays
+// in view, so a zoom into a fixed centre uploads it once. Depth is bound
+// by long double precision of the centre, about 1e-16 of radius.
+class PerturbationMandelbrot {
+public:
+  PerturbationMandelbrot() = delete;
+  PerturbationMandelbrot(const Device &device, uint32_t width = 1024,
+                         uint32_t height = 1024,
+                         const std::string &shaderDir = "./shaders")
+      : m_device(device), m_width(width), m_height(height),
+        m_orbitCapacity(0), m_orbitLength(0), m_orbitIterations(0),
+        m_referenceX(0), m_referenceY(0), m_orbitUploads(0) {
+    NAIVE_VULKAN_TRACE("PerturbationMandelbrot::create");
+    m_pipeline = m_device.createComputePipeline(m_device.createShader(
+        shaderDir + "/perturb.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+    m_image = m_device.createBuffer(width * height * sizeof(uint32_t),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    m_stats = m_device.createBuffer(sizeof(uint32_t),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    m_pipeline->feedBuffer(0, 1, m_image, 0, width * height * sizeof(uint32_t));
+    m_pipeline->feedBuffer(0, 2, m_stats, 0, sizeof(uint32_t));
+  }
+
+public:
+  // Renders [centre - radius, centre + radius] across the width, square
+  // pixels. Wait for the returned fence before the next call.
+  std::unique_ptr<Fence> render(long double centreX, long double centreY,
+                                long double radius,
+                                uint32_t maxIterations = 1000) {
+    NAIVE_VULKAN_TRACE("PerturbationMandelbrot::render");
+    long double step = 2 * radius / m_width;
+    long double left = centreX - radius;
+    long double top = centreY - step * m_height / 2;
+    bool inView = m_referenceX >= left &&
+                  m_referenceX <= left + step * m_width &&
+                  m_referenceY >= top &&
+                  m_referenceY <= top + step * m_height;
+    if (m_orbitLength == 0 || !inView || m_orbitIterations != maxIterations) {
+      updateOrbit(centreX, centreY, maxIterations);
+    }
+
+    uint32_t rebased = 0;
+    m_stats->update(&rebased, sizeof(rebased));
+    Params params = {m_width,
+                     m_height,
+                     maxIterations,
+                     m_orbitLength,
+                     float(left - m_referenceX),
+                     float(top - m_referenceY),
+                     float(step)};
+    m_pipeline->pushConstants(&params, sizeof(params));
+    // kept until the next call, the command may still be executing
+    m_command = m_device.createCommand(
+        {m_pipeline->dispatch((m_width + 15) / 16, (m_height + 15) / 16)});
+    return m_command->submit();
+  }
+
+  // Packed RGBA8 pixels of the last render, row-major
+  const std::unique_ptr<Buffer> &image() const { return m_image; }
+
+  // Pixels of the last render that needed rebasing, valid after its fence
+  uint32_t rebasedPixels() const {
+    uint32_t rebased = 0;
+    m_stats->dump(&rebased, sizeof(rebased));
+    return rebased;
+  }
+
+  uint32_t orbitLength() const { return m_orbitLength; }
+
+  uint32_t orbitUploads() const { return m_orbitUploads; }
+
+private:
+  struct Params {
+    uint32_t width;
+    uint32_t height;
+    uint32_t maxIterations;
+    uint32_t orbitLength;
+    float delta0X;
+    float delta0Y;
+    float step;
+  };
+
+  // Z(0) = 0, Z(n + 1) = Z(n)^2 + c until escape or maxIterations + 1
+  void updateOrbit(long double x, long double y, uint32_t maxIterations) {
+    NAIVE_VULKAN_TRACE("PerturbationMandelbrot::updateOrbit");
+    std::vector<float> orbit = {0.0f, 0.0f};
+    long double zx = 0, zy = 0;
+    for (uint32_t i = 0; i < maxIterations; i += 1) {
+      long double t = zx * zx - zy * zy + x;
+      zy = 2 * zx * zy + y;
+      zx = t;
+      orbit.push_back(float(zx));
+      orbit.push_back(float(zy));
+      if (zx * zx + zy * zy > 4) {
+        break;
+      }
+    }
+
+    uint32_t length = static_cast<uint32_t>(orbit.size() / 2);
+    if (m_orbitCapacity < length) {
+      m_orbit = m_device.createBuffer(length * 2 * sizeof(float),
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+      m_orbitCapacity = length;
+    }
+    m_orbit->update(orbit.data(), orbit.size() * sizeof(float));
+    m_pipeline->feedBuffer(0, 0, m_orbit, 0, length * 2 * sizeof(float));
+    m_orbitLength = length;
+    m_orbitIterations = maxIterations;
+    m_referenceX = x;
+    m_referenceY = y;
+    m_orbitUploads += 1;
+  }
+
+private:
+  const Device &m_device;
+  uint32_t m_width;
+  uint32_t m_height;
+  uint32_t m_orbitCapacity;
+  uint32_t m_orbitLength;
+  uint32_t m_orbitIterations;
+  long double m_referenceX;
+  long double m_referenceY;
+  uint32_t m_orbitUploads;
+  //
+  std::unique_ptr<ComputePipeline> m_pipeline;
+  std::unique_ptr<Buffer> m_orbit;
+  std::unique_ptr<Buffer> m_image;
+  std::unique_ptr<Buffer> m_stats;
+  std::unique_ptr<Command> m_command;
+};
+
+} // namespace vk
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef __MULTI_DEVICE_HPP__
+#define __MULTI_DEVICE_HPP__
+
+// clang-format off
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "vulkan.hpp"
+// clang-format on
+
+namespace vk {
+
+// Splits units across devices by weight and moves the weights towards
+// the throughput each device showed. Shares start equal.
+class Balancer {
+public:
+  // Contiguous units [first, first + count) computed by one device
+  struct Share {
+    size_t device;
+    uint32_t first;
+    uint32_t count;
+  };
+
+  // Below this share a device costs more in latency than it adds, with
+  // many devices the even share is lower and the bar drops to half of it
+  static constexpr double MinWeight = 0.05;
+  // A device left out is measured again after this many dispatches
+  static constexpr size_t ProbeInterval = 16;
+
+  Balancer() = delete;
+  explicit Balancer(size_t devices)
+      : m_weights(devices, 1.0 / devices), m_idle(devices, 0),
+        m_minWeight(std::min(MinWeight, 0.5 / devices)) {}
+
+public:
+  // Fraction of the units each device gets, sums to 1
+  const std::vector<double> &weights() const { return m_weights; }
+
+  // Devices under the minimum weight get nothing, the rest split units by
+  // weight
+  std::vector<Share> partition(uint32_t units) const {
+    double total = 0.0;
+    for (double weight : m_weights) {
+      total += weight >= m_minWeight ? weight : 0.0;
+    }
+    std::vector<Share> shares;
+    uint32_t first = 0;
+    double accumulated = 0.0;
+    for (size_t i = 0; i < m_weights.size(); i += 1) {
+      if (m_weights[i] < m_minWeight) {
+        continue;
+      }
+      accumulated += m_weights[i];
+      uint32_t end = uint32_t(std::llround(units * accumulated / total));
+      end = std::min(std::max(end, first), units);
+      if (end > first) {
+        shares.push_back({i, first, end - first});
+      }
+      first = end;
+    }
+    if (first < units && !shares.empty()) {
+      shares.back().count += units - first;
+    }
+    return shares;
+  }
+
+  // Moves the weights of the devices that took part halfway to their
+  // measured units per second, elapsed[i] seconds for shares[i]. A device
+  // left out keeps its weight until it is due a probe share.
+  void update(const std::vector<Share> &shares,
+              const std::vector<double> &elapsed) {
+    std::vector<double> throughput(m_weights.size(), 0.0);
+    double total = 0.0;
+    double share = 0.0;
+    for (size_t i = 0; i < shares.size(); i += 1) {
+      throughput[shares[i].device] = shares[i].count / elapsed[i];
+      total += throughput[shares[i].device];
+      share += m_weights[shares[i].device];
+    }
+    if (total == 0.0) {
+      return;
+    }
+    std::vector<bool> probed(m_weights.size(), false);
+    for (size_t i = 0; i < m_weights.size(); i += 1) {
+      if (throughput[i] != 0.0) {
+        m_idle[i] = 0;
+        m_weights[i] =
+            0.5 * m_weights[i] + 0.5 * share * throughput[i] / total;
+      } else if (++m_idle[i] >= ProbeInterval) {
+        m_idle[i] = 0;
+        m_weights[i] = std::max(m_weights[i], m_minWeight);
+        probed[i] = true;
+      }
+    }
+    // the rest make room for the probes
+    double probes = 0.0;
+    double rest = 0.0;
+    for (size_t i = 0; i < m_weights.size(); i += 1) {
+      (probed[i] ? probes : rest) += m_weights[i];
+    }
+    for (size_t i = 0; i < m_weights.size(); i += 1) {
+      m_weights[i] *= probed[i] ? 1.0 : (1.0 - probes) / rest;
+    }
+  }
+
+private:
+  std::vector<double> m_weights;
+  std::vector<size_t> m_idle;
+  double m_minWeight;
+};
+
+// One Device per physical device, splitting embarrassingly parallel
+// dispatches into contiguous unit ranges, rows of an image or elements
+// of a 1-D map. Shares follow the throughput each device showed on the
+// previous dispatches, starting equal.
+class MultiDevice {
+public:
+  using Share = Balancer::Share;
+
+  MultiDevice() = delete;
+  MultiDevice(const Instance &instance,
+              VkQueueFlagBits queueFlag = VK_QUEUE_COMPUTE_BIT) {
+    NAIVE_VULKAN_TRACE("MultiDevice::create");
+    for (const auto &info : instance.physicalDevices(queueFlag)) {
+      m_devices.push_back(
+          std::make_unique<Device>(info.device, info.queueFamilyIndex,
+                                   info.capabilities));
+    }
+    if (m_devices.empty()) {
+      throw std::runtime_error("failed to find a device!");
+    }
+    m_balancer = std::make_unique<Balancer>(m_devices.size());
+    m_slots.resize(m_devices.size());
+  }
+
+public:
+  size_t size() const { return m_devices.size(); }
+
+  const Device &device(size_t index) const { return *m_devices[index]; }
+
+  // Fraction of the units each device gets, sums to 1
+  const std::vector<double> &weights() const { return m_balancer->weights(); }
+
+  std::vector<Share> partition(uint32_t units) const {
+    return m_balancer->partition(units);
+  }
+
+  // Runs shaderPath over units split across the devices and gathers the
+  // output into out, unitBytes per unit. The shader writes its share to
+  // binding 0 of set 0 from offset 0, and its push constants start with
+  //   uint first; uint count;
+  // followed by params. One workgroup covers unitsPerWorkgroup units.
+  void dispatch(const std::string &shaderPath, uint32_t units,
+                uint32_t unitBytes, uint32_t unitsPerWorkgroup, void *out,
+                const void *params = nullptr, size_t paramsSize = 0) {
+    NAIVE_VULKAN_TRACE("MultiDevice::dispatch");
+    auto shares = partition(units);
+    std::vector<uint8_t> pushConstants(2 * sizeof(uint32_t) + paramsSize);
+    if (paramsSize != 0) {
+      std::memcpy(pushConstants.data() + 2 * sizeof(uint32_t), params,
+                  paramsSize);
+    }
+
+    // every device starts before any is waited for
+    std::vector<std::unique_ptr<Command>> commands;
+    std::vector<std::unique_ptr<Fence>> fences;
+    auto begin = std::chrono::steady_clock::now();
+    for (const auto &share : shares) {
+      auto &slot = m_slots[share.device];
+      const auto &device = *m_devices[share.device];
+      auto &pipeline = slot.pipelines[shaderPath];
+      if (!pipeline) {
+        pipeline = device.createComputePipeline(
+            device.createShader(shaderPath, VK_SHADER_STAGE_COMPUTE_BIT));
+      }
+      uint32_t bytes = share.count * unitBytes;
+      if (slot.capacity < bytes) {
+        slot.output = device.createBuffer(bytes,
+                                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                          MemoryIntent::Readback);
+        slot.capacity = bytes;
+      }
+      pipeline->feedBuffer(0, 0, slot.output, 0, bytes);
+      uint32_t range[2] = {share.first, share.count};
+      std::memcpy(pushConstants.data(), range, sizeof(range));
+      pipeline->pushConstants(pushConstants.data(), pushConstants.size());
+      commands.push_back(device.createCommand({pipeline->dispatch(
+          (share.count + unitsPerWorkgroup - 1) / unitsPerWorkgroup)}));
+      fences.push_back(commands.back()->submit());
+    }
+
+    // fences of different devices cannot be waited on together, poll
+    std::vector<double> elapsed(shares.size(), 0.0);
+    size_t pending = shares.size();
+    while (pending != 0) {
+      for (size_t i = 0; i < shares.size(); i += 1) {
+        if (elapsed[i] == 0.0 && fences[i]->isReady()) {
+          elapsed[i] = std::max(
+              std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            begin)
+                  .count(),
+              1e-9);
+          pending -= 1;
+        }
+      }
+      if (pending != 0) {
+        std::this_thread::yield();
+      }
+    }
+
+    for (const auto &share : shares) {
+      m_slots[share.device].output->dump(
+          reinterpret_cast<uint8_t *>(out) + size_t(share.first) * unitBytes,
+          size_t(share.count) * unitBytes);
+    }
+    m_balancer->update(shares, elapsed);
+  }
+
+private:
+  struct Slot {
+    std::map<std::string, std::unique_ptr<ComputePipeline>> pipelines;
+    std::unique_ptr<Buffer> output;
+    uint32_t capacity = 0;
+  };
+
+private:
+  std::vector<std::unique_ptr<Device>> m_devices;
+  std::unique_ptr<Balancer> m_balancer;
+  std::vector<Slot> m_slots;
+};
+
+} // namespace vk
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef __PRIMITIVES_HPP__
+#define __PRIMITIVES_HPP__
+
+// clang-format off
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+#include "vulkan.hpp"
+// clang-format on
+
+namespace vk {
+
+enum class ReduceOp : uint32_t { Sum = 0, Min = 1, Max = 2 };
+
+// 32-bit element types understood by the reduce kernel
+template <typename T> struct ElementType;
+template <> struct ElementType<uint32_t> {
+  static constexpr uint32_t value = 0;
+};
+template <> struct ElementType<int32_t> {
+  static constexpr uint32_t value = 1;
+};
+template <> struct ElementType<float> {
+  static constexpr uint32_t value = 2;
+};
+
+// Reduce, exclusive scan, stream compaction and radix sort over 32-bit
+// storage buffers. Each call records one command and waits for it.
+// Not thread safe, scratch buffers are reused between calls.
+class Primitives {
+public:
+  Primitives() = delete;
+  // The subgroup variants wherever the device has subgroup arithmetic
+  Primitives(const Device &device, const std::string &shaderDir = "./shaders")
+      : Primitives(device, shaderDir, subgroupArithmetic(device)) {}
+  Primitives(const Device &device, const std::string &shaderDir,
+             bool subgroups)
+      : m_device(device), m_subgroups(subgroups) {
+    NAIVE_VULKAN_TRACE("Primitives::create");
+    auto load = [&](const std::string &name) {
+      return m_device.createShader(shaderDir + "/" + name +
+                                       (subgroups ? "_subgroup.spv" : ".spv"),
+                                   VK_SHADER_STAGE_COMPUTE_BIT);
+    };
+    auto reduce = load("reduce");
+    auto scan = load("scan");
+    auto compact = load("compact");
+    auto sort = load("radix_sort");
+
+    // one pipeline per role, every role keeps its own descriptor set
+    auto pipelines = m_device.createComputePipelinesAsync(
+        {reduce, scan, scan, compact, scan, sort});
+    m_reduce = pipelines[0].get();
+    m_scan = pipelines[1].get();
+    m_compactScan = pipelines[2].get();
+    m_compact = pipelines[3].get();
+    m_sortScan = pipelines[4].get();
+    m_sort = pipelines[5].get();
+    m_capacity.fill(0);
+  }
+
+public:
+  // Whether the subgroup variants are in use
+  bool subgroups() const { return m_subgroups; }
+
+  template <typename T>
+  T reduce(const std::unique_ptr<Buffer> &input, uint32_t count, ReduceOp op) {
+    static_assert(sizeof(T) == sizeof(uint32_t), "32-bit elements only");
+    uint32_t bits = reduceBits(input, count, static_cast<uint32_t>(op),
+                               ElementType<T>::value);
+    T value;
+    std::memcpy(&value, &bits, sizeof(T));
+    return value;
+  }
+
+  // output[i] = input[0] + ... + input[i - 1], input may alias output
+  void exclusiveScan(const std::unique_ptr<Buffer> &input,
+                     const std::unique_ptr<Buffer> &output, uint32_t count) {
+    NAIVE_VULKAN_TRACE("Primitives::exclusiveScan");
+    if (count == 0) {
+      return;
+    }
+    checkCount(count);
+    auto &sums = scratch(ScanSums, scanScratchSize(count));
+    m_scan->feedBuffer(0, 0, input, 0, count * sizeof(uint32_t));
+    m_scan->feedBuffer(0, 1, output, 0, count * sizeof(uint32_t));
+    m_scan->feedBuffer(0, 2, sums, 0,
+                       scanScratchSize(count) * sizeof(uint32_t));
+
+    std::vector<Dispatch> dispatches;
+    recordScan(*m_scan, count, false, dispatches);
+    m_device.createCommand(dispatches)->submit()->wait();
+  }
+
+  // Stable, keeps values[i] where flags[i] != 0, returns the kept count
+  uint32_t compact(const std::unique_ptr<Buffer> &values,
+                   const std::unique_ptr<Buffer> &flags,
+                   const std::unique_ptr<Buffer> &output, uint32_t count) {
+    NAIVE_VULKAN_TRACE("Primitives::compact");
+    if (count == 0) {
+      return 0;
+    }
+    checkCount(count);
+    uint32_t range = count * sizeof(uint32_t);
+    auto &positions = scratch(Positions, count);
+    auto &sums = scratch(CompactSums, scanScratchSize(count));
+    auto &result = scratch(Result, 1, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    m_compactScan->feedBuffer(0, 0, flags, 0, range);
+    m_compactScan->feedBuffer(0, 1, positions, 0, range);
+    m_compactScan->feedBuffer(0, 2, sums, 0,
+                              scanScratchSize(count) * sizeof(uint32_t));
+    m_compact->feedBuffer(0, 0, values, 0, range);
+    m_compact->feedBuffer(0, 1, flags, 0, range);
+    m_compact->feedBuffer(0, 2, positions, 0, range);
+    m_compact->feedBuffer(0, 3, output, 0, range);
+    m_compact->feedBuffer(0, 4, result, 0, sizeof(uint32_t));
+
+    std::vector<Dispatch> dispatches;
+    recordScan(*m_compactScan, count, true, dispatches);
+    m_compact->pushConstants(&count, sizeof(count));
+    dispatches.push_back(m_compact->dispatch(divUp(count, WorkgroupSize)));
+    m_device.createCommand(dispatches)->submit()->wait();
+
+    uint32_t kept = 0;
+    result->dump(&kept, sizeof(kept));
+    return kept;
+  }
+
+  // Ascending, stable, in place
+  void sort(const std::unique_ptr<Buffer> &keys, uint32_t count) {
+    radixSort(keys, keys, false, count);
+  }
+
+  void sortPairs(const std::unique_ptr<Buffer> &keys,
+                 const std::unique_ptr<Buffer> &values, uint32_t count) {
+    radixSort(keys, values, true, count);
+  }
+
+private:
+  enum : uint32_t {
+    WorkgroupSize = 256,
+    BlockSize = 1024, // scan and sort, 4 elements per invocation
+    MaxPartials = 1024,
+    MaxGroups = 65535,
+  };
+
+  enum Slot {
+    Partials,
+    Result,
+    ScanSums,
+    Positions,
+    CompactSums,
+    SortKeys,
+    SortValues,
+    SortHist,
+    SortSums,
+    SlotCount
+  };
+
+  struct ReduceParams {
+    uint32_t count;
+    uint32_t op;
+    uint32_t type;
+    uint32_t pass;
+  };
+
+  struct ScanParams {
+    uint32_t count;
+    uint32_t mode;
+    uint32_t nested;
+    uint32_t predicate;
+    uint32_t dataOffset;
+    uint32_t sumOffset;
+  };
+
+  struct SortParams {
+    uint32_t count;
+    uint32_t mode;
+    uint32_t shift;
+    uint32_t flip;
+    uint32_t blockCount;
+    uint32_t hasValues;
+  };
+
+  static uint32_t divUp(uint32_t a, uint32_t b) { return (a + b - 1) / b; }
+
+  static bool subgroupArithmetic(const Device &device) {
+#ifdef VK_VERSION_1_1
+    return device.capabilities().subgroups(VK_SUBGROUP_FEATURE_BASIC_BIT |
+                                           VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+#else
+    return false;
+#endif
+  }
+
+  static void checkCount(uint32_t count) {
+    if (divUp(count, BlockSize) > MaxGroups) {
+      throw std::runtime_error("count exceeds dispatch limit!");
+    }
+  }
+
+  // Words used by the per-block totals of every scan level
+  static uint32_t scanScratchSize(uint32_t count) {
+    uint32_t size = 0;
+    do {
+      count = divUp(count, BlockSize);
+      size += count;
+    } while (count > 1);
+    return size;
+  }
+
+  // Grows the buffer of a slot to hold at least `words` 32-bit words
+  const std::unique_ptr<Buffer> &
+  scratch(Slot slot, uint32_t words,
+          VkMemoryPropertyFlags properties =
+              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) {
+    if (m_capacity[slot] < words) {
+      m_scratch[slot] = m_device.createBuffer(
+          words * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+          properties);
+      m_capacity[slot] = words;
+    }
+    return m_scratch[slot];
+  }
+
+  uint32_t reduceBits(const std::unique_ptr<Buffer> &input, uint32_t count,
+                      uint32_t op, uint32_t type) {
+    NAIVE_VULKAN_TRACE("Primitives::reduce");
+    uint32_t groups = std::max(
+        uint32_t(1), std::min(divUp(count, BlockSize), uint32_t(MaxPartials)));
+    auto &partials = scratch(Partials, MaxPartials);
+    auto &result = scratch(Result, 1, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    m_reduce->feedBuffer(0, 0, input, 0,
+                         std::max(count, uint32_t(1)) * sizeof(uint32_t));
+    m_reduce->feedBuffer(0, 1, partials, 0, MaxPartials * sizeof(uint32_t));
+    m_reduce->feedBuffer(0, 2, result, 0, sizeof(uint32_t));
+
+    std::vector<Dispatch> dispatches;
+    ReduceParams params = {count, op, type, 0};
+    m_reduce->pushConstants(&params, sizeof(params));
+    dispatches.push_back(m_reduce->dispatch(groups));
+    params = {groups, op, type, 1};
+    m_reduce->pushConstants(&params, sizeof(params));
+    dispatches.push_back(m_reduce->dispatch(1));
+    m_device.createCommand(dispatches)->submit()->wait();
+
+    uint32_t bits = 0;
+    result->dump(&bits, sizeof(bits));
+    return bits;
+  }
+
+  // Level l scans its data into block totals, which level l + 1 scans in
+  // place, then the scanned totals are added back from the top level down
+  void recordScan(ComputePipeline &pipeline, uint32_t count, bool predicate,
+                  std::vector<Dispatch> &dispatches) {
+    std::vector<ScanParams> levels;
+    uint32_t dataOffset = 0, sumOffset = 0;
+    while (true) {
+      uint32_t blocks = divUp(count, BlockSize);
+      bool nested = !levels.empty();
+      ScanParams params = {count,      0,         nested, predicate && !nested,
+                           dataOffset, sumOffset};
+      levels.push_back(params);
+      pipeline.pushConstants(&params, sizeof(params));
+      dispatches.push_back(pipeline.dispatch(blocks));
+      if (blocks == 1) {
+        break;
+      }
+      count = blocks;
+      dataOffset = sumOffset;
+      sumOffset += blocks;
+    }
+    for (size_t level = levels.size() - 1; level-- > 0;) {
+      ScanParams params = levels[level];
+      params.mode = 1;
+      pipeline.pushConstants(&params, sizeof(params));
+      dispatches.push_back(
+          pipeline.dispatch(divUp(params.count, BlockSize)));
+    }
+  }
+
+  // Eight 4-bit LSD passes ping-pong between the inputs and scratch, so
+  // the result lands back in the input buffers
+  void radixSort(const std::unique_ptr<Buffer> &keys,
+                 const std::unique_ptr<Buffer> &values, bool hasValues,
+                 uint32_t count) {
+    NAIVE_VULKAN_TRACE("Primitives::sort");
+    if (count == 0) {
+      return;
+    }
+    checkCount(count);
+    uint32_t range = count * sizeof(uint32_t);
+    uint32_t blockCount = divUp(count, BlockSize);
+    uint32_t histCount = 16 * blockCount;
+    auto &keysB = scratch(SortKeys, count);
+    auto &valuesB = scratch(SortValues, hasValues ? count : 1);
+    auto &hist = scratch(SortHist, histCount);
+    auto &sums = scratch(SortSums, scanScratchSize(histCount));
+    m_sort->feedBuffer(0, 0, keys, 0, range);
+    m_sort->feedBuffer(0, 1, values, 0, range);
+    m_sort->feedBuffer(0, 2, keysB, 0, range);
+    m_sort->feedBuffer(0, 3, valuesB, 0,
+                       hasValues ? range : uint32_t(sizeof(uint32_t)));
+    m_sort->feedBuffer(0, 4, hist, 0, histCount * sizeof(uint32_t));
+    m_sortScan->feedBuffer(0, 0, hist, 0, histCount * sizeof(uint32_t));
+    m_sortScan->feedBuffer(0, 1, hist, 0, histCount * sizeof(uint32_t));
+    m_sortScan->feedBuffer(0, 2, sums, 0,
+                           scanScratchSize(histCount) * sizeof(uint32_t));
+
+    std::vector<Dispatch> dispatches;
+    for (uint32_t pass = 0; pass < 8; pass += 1) {
+      SortParams params = {count,      0, 4 * pass, pass & 1,
+                           blockCount, hasValues};
+      m_sort->pushConstants(&params, sizeof(params));
+      dispatches.push_back(m_sort->dispatch(blockCount));
+      recordScan(*m_sortScan, histCount, false, dispatches);
+      params.mode = 1;
+      m_sort->pushConstants(&params, sizeof(params));
+      dispatches.push_back(m_sort->dispatch(blockCount));
+    }
+    m_device.createCommand(dispatches)->submit()->wait();
+  }
+
+private:
+  const Device &m_device;
+  bool m_subgroups;
+  std::unique_ptr<ComputePipeline> m_reduce;
+  std::unique_ptr<ComputePipeline> m_scan;
+  std::unique_ptr<ComputePipeline> m_compactScan;
+  std::unique_ptr<ComputePipeline> m_compact;
+  std::unique_ptr<ComputePipeline> m_sortScan;
+  std::unique_ptr<ComputePipeline> m_sort;
+  std::array<std::unique_ptr<Buffer>, SlotCount> m_scratch;
+  std::array<uint32_t, SlotCount> m_capacity;
+};
+
+} // namespace vk
+
+#endif
@@ -0,0 +1,689 @@
+#ifndef __SERVICE_HPP__
+#define __SERVICE_HPP__
+
+// clang-format off
+#include <map>
+#include <set>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "vulkan.hpp"
+// clang-format on
+
+// One process owns the device and runs kernels for others on the same
+// node. Requests go over a Unix domain socket, payloads stay in memfds
+// that both sides map. Linux only.
+namespace vk {
+namespace service {
+
+const uint32_t MaxBuffers = 8;
+const uint32_t MaxPushConstants = 128;
+const uint32_t MaxKernelName = 64;
+
+// $NAIVE_VULKAN_SERVICE, or a fixed path under /tmp
+inline std::string defaultPath() {
+  const char *path = std::getenv("NAIVE_VULKAN_SERVICE");
+  return path != nullptr ? path : "/tmp/naive_vulkan.sock";
+}
+
+enum class Op : uint32_t {
+  Register, // size bytes of the memfd passed along, replied with an id
+  Release,  // buffer id, no reply
+  Run       // kernel over buffers, replied once it finished
+};
+
+// Fixed size and one per send on a SOCK_SEQPACKET socket, so there is
+// no framing and a passed descriptor arrives with its message
+struct Request {
+  Op op;
+  uint32_t id;
+  uint64_t size;
+  char kernel[MaxKernelName]; // a .spv in the server's shader directory
+  uint32_t groups[3];
+  uint32_t bufferCount;
+  uint32_t buffers[MaxBuffers]; // buffer i is set 0, binding i
+  uint32_t pushConstantSize;
+  uint8_t pushConstants[MaxPushConstants];
+};
+
+struct Reply {
+  uint32_t id;
+  uint32_t imported; // the device works on the shared memory in place
+  char error[128];   // empty on success
+};
+
+inline void sendMessage(int socket, const void *data, size_t size,
+                        int fd = -1) {
+  iovec iov = {const_cast<void *>(data), size};
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  if (fd >= 0) {
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+  }
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent != static_cast<ssize_t>(size)) {
+    throw std::runtime_error("failed to send service message!");
+  }
+}
+
+// false once the peer is gone or sent something else; a passed
+// descriptor lands in fd, -1 when there was none
+inline bool receiveMessage(int socket, void *data, size_t size,
+                           int *fd = nullptr) {
+  iovec iov = {data, size};
+  msghdr message = {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+
+  int passed = -1;
+  for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+      std::memcpy(&passed, CMSG_DATA(header), sizeof(int));
+    }
+  }
+  if (fd != nullptr) {
+    *fd = passed;
+  } else if (passed >= 0) {
+    close(passed);
+  }
+  if (received != static_cast<ssize_t>(size) ||
+      (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    if (fd != nullptr && *fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+inline sockaddr_un socketAddress(const std::string &path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("service socket path is too long!");
+  }
+  std::strcpy(address.sun_path, path.c_str());
+  return address;
+}
+
+// The compute device getComputeDevice() picks, with robust buffer access
+inline std::unique_ptr<Device> createDevice(const Instance &instance,
+                                            const std::string &selector = "") {
+  auto info = instance.selectDevice(VK_QUEUE_COMPUTE_BIT, selector);
+  info.capabilities.robustBufferAccess = true;
+  return std::make_unique<Device>(info.device, info.queueFamilyIndex,
+                                  info.capabilities);
+}
+
+// Owns the device for all clients, with one pipeline cache and queue.
+// Kernels are loaded by name from shaderDir on first use. Jobs that
+// arrive together run in one submit, each on its own pipeline instance.
+// The device needs robust buffer access, kernels do not check bounds and
+// client memory sits side by side, see createDevice(). Not thread safe
+// apart from stop().
+class Server {
+public:
+  Server() = delete;
+  Server(const Device &device, const std::string &path,
+         const std::string &shaderDir = "./shaders")
+      : m_device(device), m_path(path), m_shaderDir(shaderDir),
+        m_fence(device.makeFence()), m_nextClient(0) {
+    if (!device.capabilities().robustBufferAccess) {
+      throw std::runtime_error("service device needs robust buffer access!");
+    }
+    if (pipe2(m_wake, O_CLOEXEC) != 0) {
+      throw std::runtime_error("failed to create service pipe!");
+    }
+    m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un address = socketAddress(path);
+    unlink(path.c_str());
+    if (m_socket < 0 ||
+        bind(m_socket, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+        listen(m_socket, SOMAXCONN) != 0) {
+      destroy();
+      throw std::runtime_error("failed to listen on service socket!");
+    }
+  }
+  Server(const Server &) = delete;
+  ~Server() { destroy(); }
+
+  Server &operator=(const Server &) = delete;
+
+public:
+  // Serves until stop()
+  void run() {
+    for (;;) {
+      std::vector<pollfd> fds = {{m_wake[0], POLLIN, 0},
+                                 {m_socket, POLLIN, 0}};
+      std::vector<uint64_t> ids;
+      for (const auto &client : m_clients) {
+        fds.push_back({client.second.socket, POLLIN, 0});
+        ids.push_back(client.first);
+      }
+      if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("failed to poll service sockets!");
+      }
+      if (fds[0].revents != 0) {
+        char byte;
+        while (read(m_wake[0], &byte, 1) < 0 && errno == EINTR) {
+        }
+        return;
+      }
+      if (fds[1].revents & POLLIN) {
+        accept();
+      }
+
+      std::vector<Job> jobs;
+      for (size_t i = 2; i < fds.size(); i += 1) {
+        if (fds[i].revents != 0) {
+          serve(ids[i - 2], jobs);
+        }
+      }
+      execute(jobs);
+      // after execute, its jobs may still point at their buffers
+      for (auto id : m_dropped) {
+        disconnect(id);
+      }
+      m_dropped.clear();
+    }
+  }
+
+  // From any thread or a signal handler
+  void stop() {
+    char byte = 0;
+    while (write(m_wake[1], &byte, 1) < 0 && errno == EINTR) {
+    }
+  }
+
+private:
+  // A client's memfd mapped here, and the buffer kernels bind: over the
+  // mapping when imported, otherwise a device copy synced around jobs
+  struct Mapping {
+    void *data;
+    size_t size;
+    std::unique_ptr<Buffer> buffer;
+    bool imported;
+
+    ~Mapping() {
+      buffer.reset();
+      munmap(data, size);
+    }
+  };
+
+  struct Client {
+    int socket;
+    uint32_t nextBuffer;
+    std::map<uint32_t, std::unique_ptr<Mapping>> buffers;
+  };
+
+  struct Job {
+    uint64_t client;
+    Request request;
+  };
+
+  void accept() {
+    int socket =
+        ::accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (socket >= 0) {
+      m_clients[m_nextClient++] = Client{socket, 0, {}};
+    }
+  }
+
+  void disconnect(uint64_t id) {
+    auto client = m_clients.find(id);
+    if (client != m_clients.end()) {
+      close(client->second.socket);
+      m_clients.erase(client);
+    }
+  }
+
+  // Client sockets do not block, a client that is gone or does not read
+  // its replies is dropped once the round is over
+  void reply(uint64_t client, const std::string &error, uint32_t id = 0,
+             bool imported = false) {
+    auto it = m_clients.find(client);
+    if (it == m_clients.end() || m_dropped.count(client) != 0) {
+      return;
+    }
+    Reply reply = {};
+    reply.id = id;
+    reply.imported = imported;
+    std::strncpy(reply.error, error.c_str(), sizeof(reply.error) - 1);
+    try {
+      sendMessage(it->second.socket, &reply, sizeof(reply));
+    } catch (const std::runtime_error &) {
+      m_dropped.insert(client);
+    }
+  }
+
+  // One message of a readable client, runs are queued for execute()
+  void serve(uint64_t id, std::vector<Job> &jobs) {
+    auto &client = m_clients[id];
+    Request request;
+    int fd = -1;
+    if (!receiveMessage(client.socket, &request, sizeof(request), &fd)) {
+      disconnect(id);
+      return;
+    }
+
+    switch (request.op) {
+    case Op::Register: {
+      try {
+        auto mapping = map(fd, request.size);
+        uint32_t buffer = client.nextBuffer++;
+        bool imported = mapping->imported;
+        client.buffers[buffer] = std::move(mapping);
+        reply(id, "", buffer, imported);
+      } catch (const std::runtime_error &error) {
+        reply(id, error.what());
+      }
+      break;
+    }
+    case Op::Release: {
+      client.buffers.erase(request.id);
+      break;
+    }
+    case Op::Run: {
+      jobs.push_back(Job{id, request});
+      break;
+    }
+    default: {
+      disconnect(id);
+      break;
+    }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  std::unique_ptr<Mapping> map(int fd, uint64_t size) {
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0 || size == 0 ||
+        size > std::numeric_limits<uint32_t>::max() ||
+        uint64_t(status.st_size) < size) {
+      throw std::runtime_error("register needs a memfd of its size!");
+    }
+    // a client shrinking the memfd later would SIGBUS the server
+    const int required = F_SEAL_SHRINK | F_SEAL_GROW;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & required) != required) {
+      throw std::runtime_error("register needs a memfd sealed to its size!");
+    }
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("failed to map client memory!");
+    }
+    auto mapping = std::make_unique<Mapping>();
+    mapping->data = data;
+    mapping->size = size;
+    mapping->imported = false;
+#if defined(VK_VERSION_1_1) && defined(VK_EXT_external_memory_host)
+    if (m_device.capabilities().externalMemoryHost) {
+      try {
+        mapping->buffer = std::make_unique<Buffer>(m_device.importBuffer(
+            data, uint32_t(size), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT));
+        mapping->imported = true;
+      } catch (const std::runtime_error &) {
+        // unaligned, or the driver refused this memory
+      }
+    }
+#endif
+    if (!mapping->imported) {
+      mapping->buffer = m_device.createBuffer(
+          uint32_t(size), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+          MemoryIntent::Readback);
+    }
+    return mapping;
+  }
+
+  // Every valid job in one command, the replies go out once it finished
+  void execute(std::vector<Job> &jobs) {
+    std::vector<Dispatch> dispatches;
+    std::vector<const Job *> ready;
+    std::vector<Mapping *> copies;
+    std::map<std::string, size_t> used;
+    for (const auto &job : jobs) {
+      auto client = m_clients.find(job.client);
+      if (client == m_clients.end() || m_dropped.count(job.client) != 0) {
+        continue;
+      }
+      try {
+        dispatches.push_back(prepare(client->second, job.request, used,
+                                     copies));
+        ready.push_back(&job);
+      } catch (const std::runtime_error &error) {
+        reply(job.client, error.what());
+      }
+    }
+    if (dispatches.empty()) {
+      return;
+    }
+
+    std::string error;
+    try {
+      for (auto mapping : copies) {
+        mapping->buffer->update(mapping->data, mapping->size);
+      }
+      auto command = m_device.makeCommand(dispatches);
+      command.submit(m_fence);
+      m_fence.wait();
+      for (auto mapping : copies) {
+        mapping->buffer->dump(mapping->data, mapping->size);
+      }
+    } catch (const std::runtime_error &failure) {
+      error = failure.what();
+    }
+    for (auto job : ready) {
+      reply(job->client, error);
+    }
+  }
+
+  Dispatch prepare(Client &client, const Request &request,
+                   std::map<std::string, size_t> &used,
+                   std::vector<Mapping *> &copies) {
+    std::string kernel(request.kernel,
+                       strnlen(request.kernel, sizeof(request.kernel)));
+    if (kernel.empty() || kernel.size() == sizeof(request.kernel) ||
+        kernel.find('/') != std::string::npos) {
+      throw std::runtime_error("invalid kernel name!");
+    }
+    if (request.bufferCount > MaxBuffers ||
+        request.pushConstantSize > MaxPushConstants) {
+      throw std::runtime_error("too many buffers or push constants!");
+    }
+    if (request.groups[0] == 0 || request.groups[1] == 0 ||
+        request.groups[2] == 0) {
+      throw std::runtime_error("empty dispatch!");
+    }
+
+    // one instance per job of a submit, each with its own descriptors
+    auto &pipelines = m_pipelines[kernel];
+    size_t &index = used[kernel];
+    if (index == pipelines.size()) {
+      pipelines.push_back(m_device.makeComputePipeline(m_device.createShader(
+          m_shaderDir + "/" + kernel + ".spv", VK_SHADER_STAGE_COMPUTE_BIT)));
+    }
+    auto &pipeline = pipelines[index++];
+
+    // every binding is fed by this job, none is left pointing at the
+    // buffers of an earlier one
+    const auto &reflection = pipeline.shader()->reflection();
+    const auto &setsBindings = reflection.setsBindings();
+    bool matches = setsBindings.size() == (request.bufferCount != 0 ? 1 : 0);
+    for (const auto &bindings : setsBindings) {
+      matches = matches && bindings.size() == request.bufferCount &&
+                reflection.descriptorCounts()[0].empty();
+      for (const auto &bind : bindings) {
+        matches = matches && std::get<0>(bind) < request.bufferCount &&
+                  std::get<1>(bind) == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      }
+    }
+    if (!matches) {
+      throw std::runtime_error("buffers do not match the kernel's bindings!");
+    }
+    if (request.pushConstantSize > reflection.pushConstantSize()) {
+      throw std::runtime_error("more push constants than the kernel takes!");
+    }
+
+    for (uint32_t i = 0; i < request.bufferCount; i += 1) {
+      auto buffer = client.buffers.find(request.buffers[i]);
+      if (buffer == client.buffers.end()) {
+        throw std::runtime_error("unknown buffer!");
+      }
+      auto &mapping = *buffer->second;
+      pipeline.feedBuffer(0, i, *mapping.buffer, 0, uint32_t(mapping.size));
+      if (!mapping.imported) {
+        copies.push_back(&mapping);
+      }
+    }
+    pipeline.pushConstants(request.pushConstants, request.pushConstantSize);
+    return pipeline.dispatch(request.groups[0], request.groups[1],
+                             request.groups[2]);
+  }
+
+  void destroy() {
+    for (auto &client : m_clients) {
+      close(client.second.socket);
+    }
+    m_clients.clear();
+    if (m_socket >= 0) {
+      close(m_socket);
+      unlink(m_path.c_str());
+    }
+    close(m_wake[0]);
+    close(m_wake[1]);
+  }
+
+private:
+  const Device &m_device;
+  std::string m_path;
+  std::string m_shaderDir;
+  Fence m_fence;
+  int m_wake[2] = {-1, -1};
+  int m_socket = -1;
+  uint64_t m_nextClient;
+  std::map<uint64_t, Client> m_clients;
+  std::set<uint64_t> m_dropped;
+  std::map<std::string, std::vector<ComputePipeline>> m_pipelines;
+};
+
+// Memory shared with the server, written and read in place. Released
+// on the server when dropped.
+class SharedBuffer {
+public:
+  SharedBuffer() = delete;
+  SharedBuffer(int socket, uint32_t id, void *data, size_t size,
+               bool imported)
+      : m_socket(socket), m_id(id), m_data(data), m_size(size),
+        m_imported(imported) {}
+  SharedBuffer(const SharedBuffer &) = delete;
+  SharedBuffer(SharedBuffer &&other) noexcept
+      : m_socket(other.m_socket), m_id(other.m_id), m_data(other.m_data),
+        m_size(other.m_size), m_imported(other.m_imported) {
+    other.m_data = nullptr;
+  }
+  ~SharedBuffer() { destroy(); }
+
+  SharedBuffer &operator=(const SharedBuffer &) = delete;
+  SharedBuffer &operator=(SharedBuffer &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_socket = other.m_socket;
+      m_id = other.m_id;
+      m_data = other.m_data;
+      m_size = other.m_size;
+      m_imported = other.m_imported;
+      other.m_data = nullptr;
+    }
+    return *this;
+  }
+
+public:
+  uint32_t id() const { return m_id; }
+  void *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  // the device works on this memory directly, no copies on the server
+  bool imported() const { return m_imported; }
+
+  template <typename T> T *as() const { return reinterpret_cast<T *>(m_data); }
+
+private:
+  void destroy() {
+    if (m_data == nullptr) {
+      return;
+    }
+    munmap(m_data, m_size);
+    Request request = {};
+    request.op = Op::Release;
+    request.id = m_id;
+    try {
+      sendMessage(m_socket, &request, sizeof(request));
+    } catch (const std::runtime_error &) {
+      // the server frees everything of a closed connection
+    }
+  }
+
+private:
+  int m_socket;
+  uint32_t m_id;
+  void *m_data;
+  size_t m_size;
+  bool m_imported;
+};
+
+// A connection to a Server, one thread at a time. Buffers must not
+// outlive it.
+class Client {
+public:
+  explicit Client(const std::string &path = defaultPath()) {
+    m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un address = socketAddress(path);
+    if (m_socket < 0 ||
+        connect(m_socket, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) != 0) {
+      if (m_socket >= 0) {
+        close(m_socket);
+      }
+      throw std::runtime_error("failed to connect to service!");
+    }
+  }
+  Client(const Client &) = delete;
+  ~Client() { close(m_socket); }
+
+  Client &operator=(const Client &) = delete;
+
+public:
+  // Rounded up to whole pages, so the server can import it
+  SharedBuffer allocate(size_t size) {
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size = (size + page - 1) / page * page;
+    int fd = memfd_create("naive_vulkan", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, off_t(size)) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw std::runtime_error("failed to create shared memory!");
+    }
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("failed to map shared memory!");
+    }
+
+    Request request = {};
+    request.op = Op::Register;
+    request.size = size;
+    try {
+      sendMessage(m_socket, &request, sizeof(request), fd);
+    } catch (...) {
+      close(fd);
+      munmap(data, size);
+      throw;
+    }
+    close(fd);
+    Reply reply;
+    try {
+      reply = receive();
+    } catch (...) {
+      munmap(data, size);
+      throw;
+    }
+    return SharedBuffer(m_socket, reply.id, data, size, reply.imported);
+  }
+
+  // Sent with every later run
+  void pushConstants(const void *data, size_t size) {
+    if (size > MaxPushConstants) {
+      throw std::runtime_error("too many push constants!");
+    }
+    m_pushConstantSize = uint32_t(size);
+    std::memcpy(m_pushConstants.data(), data, size);
+  }
+
+  // Blocks until the kernel finished, buffer i is set 0, binding i
+  void run(const std::string &kernel,
+           const std::vector<const SharedBuffer *> &buffers, uint32_t x,
+           uint32_t y = 1, uint32_t z = 1) {
+    if (kernel.size() >= MaxKernelName || buffers.size() > MaxBuffers) {
+      throw std::runtime_error("invalid kernel name or too many buffers!");
+    }
+    Request request = {};
+    request.op = Op::Run;
+    std::strcpy(request.kernel, kernel.c_str());
+    request.groups[0] = x;
+    request.groups[1] = y;
+    request.groups[2] = z;
+    request.bufferCount = uint32_t(buffers.size());
+    for (size_t i = 0; i < buffers.size(); i += 1) {
+      request.buffers[i] = buffers[i]->id();
+    }
+    request.pushConstantSize = m_pushConstantSize;
+    std::memcpy(request.pushConstants, m_pushConstants.data(),
+                m_pushConstantSize);
+    sendMessage(m_socket, &request, sizeof(request));
+    receive();
+  }
+
+private:
+  Reply receive() {
+    Reply reply;
+    if (!receiveMessage(m_socket, &reply, sizeof(reply))) {
+      throw std::runtime_error("failed to receive service reply!");
+    }
+    reply.error[sizeof(reply.error) - 1] = '\0';
+    if (reply.error[0] != '\0') {
+      throw std::runtime_error(reply.error);
+    }
+    return reply;
+  }
+
+private:
+  int m_socket;
+  std::array<uint8_t, MaxPushConstants> m_pushConstants = {};
+  uint32_t m_pushConstantSize = 0;
+};
+
+} // namespace service
+} // namespace vk
+
+#endif
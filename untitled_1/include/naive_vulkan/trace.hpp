@@ -0,0 +1,283 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+// clang-format off
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <ostream>
+#include <iostream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#ifdef __ANDROID__
+#include "vulkan_wrapper.h"
+#else
+#include <vulkan/vulkan.h>
+#endif
+// clang-format on
+
+// ----------
+// NAIVE_VULKAN_TRACE=trace.json ./untitled_1
+// or vk::trace::enable() ... vk::trace::dump("trace.json")
+// open the file in chrome://tracing or ui.perfetto.dev
+// ----------
+#ifdef NAIVE_VULKAN_NO_TRACE
+#define NAIVE_VULKAN_TRACE(name)
+#else
+#define NAIVE_VULKAN_TRACE_CONCAT(a, b) a##b
+#define NAIVE_VULKAN_TRACE_NAME(line) NAIVE_VULKAN_TRACE_CONCAT(traceScope, line)
+#define NAIVE_VULKAN_TRACE(name)                                               \
+  vk::trace::Scope NAIVE_VULKAN_TRACE_NAME(__LINE__)(name)
+#endif
+
+namespace vk {
+namespace trace {
+
+struct Event {
+  const char *name;
+  int64_t begin;
+  int64_t end;
+};
+
+// Single writer, readers only see slots published through count
+class ThreadBuffer {
+public:
+  ThreadBuffer() = delete;
+  ThreadBuffer(uint32_t tid) : m_tid(tid), m_head(new Chunk), m_tail(m_head) {}
+  ~ThreadBuffer() {
+    Chunk *chunk = m_head;
+    while (chunk != nullptr) {
+      Chunk *next = chunk->next.load(std::memory_order_acquire);
+      delete chunk;
+      chunk = next;
+    }
+  }
+
+public:
+  void push(const Event &event) {
+    size_t count = m_tail->count.load(std::memory_order_relaxed);
+    if (count == ChunkSize) {
+      Chunk *chunk = new Chunk;
+      m_tail->next.store(chunk, std::memory_order_release);
+      m_tail = chunk;
+      count = 0;
+    }
+    m_tail->events[count] = event;
+    m_tail->count.store(count + 1, std::memory_order_release);
+  }
+
+  template <typename F> void forEach(F f) const {
+    for (const Chunk *chunk = m_head; chunk != nullptr;
+         chunk = chunk->next.load(std::memory_order_acquire)) {
+      size_t count = chunk->count.load(std::memory_order_acquire);
+      for (size_t i = 0; i < count; i += 1) {
+        f(chunk->events[i]);
+      }
+    }
+  }
+
+  uint32_t tid() const { return m_tid; }
+
+private:
+  enum : size_t { ChunkSize = 4096 };
+
+  struct Chunk {
+    Event events[ChunkSize];
+    std::atomic<size_t> count{0};
+    std::atomic<Chunk *> next{nullptr};
+  };
+
+private:
+  uint32_t m_tid;
+  Chunk *m_head;
+  Chunk *m_tail;
+};
+
+struct Labels {
+  PFN_vkQueueBeginDebugUtilsLabelEXT queueBegin = nullptr;
+  PFN_vkQueueEndDebugUtilsLabelEXT queueEnd = nullptr;
+  PFN_vkCmdBeginDebugUtilsLabelEXT cmdBegin = nullptr;
+  PFN_vkCmdEndDebugUtilsLabelEXT cmdEnd = nullptr;
+};
+
+class Tracer {
+public:
+  Tracer() : m_enabled(false), m_epoch(std::chrono::steady_clock::now()) {
+    const char *path = std::getenv("NAIVE_VULKAN_TRACE");
+    if (path != nullptr && path[0] != '\0') {
+      m_path = path;
+      m_enabled.store(true, std::memory_order_relaxed);
+    }
+  }
+  // Runs during static destruction, a throw here would terminate
+  ~Tracer() {
+    if (!m_path.empty()) {
+      try {
+        dump(m_path);
+      } catch (const std::exception &e) {
+        std::cerr << "naive_vulkan trace " << m_path << ": " << e.what()
+                  << std::endl;
+      }
+    }
+  }
+
+public:
+  bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+  void enable(bool enabled) {
+    m_enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  int64_t now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - m_epoch)
+        .count();
+  }
+
+  // The only lock, taken once per thread
+  ThreadBuffer &threadBuffer() {
+    thread_local ThreadBuffer *buffer = nullptr;
+    if (buffer == nullptr) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_buffers.emplace_back(
+          new ThreadBuffer(static_cast<uint32_t>(m_buffers.size() + 1)));
+      buffer = m_buffers.back().get();
+    }
+    return *buffer;
+  }
+
+  Labels &labels() { return m_labels; }
+
+  // Chrome trace event format, complete events in microseconds
+  void write(std::ostream &out) {
+#if defined(__unix__) || defined(__APPLE__)
+    long pid = static_cast<long>(getpid());
+#else
+    long pid = 0;
+#endif
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : m_buffers) {
+      buffer->forEach([&](const Event &event) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+            << "\",\"cat\":\"naive_vulkan\",\"ph\":\"X\",\"ts\":"
+            << double(event.begin) / 1000.0
+            << ",\"dur\":" << double(event.end - event.begin) / 1000.0
+            << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid() << "}";
+        first = false;
+      });
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+  void dump(const std::string &path) {
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file.is_open()) {
+      throw std::runtime_error("failed to open file!");
+    }
+    write(file);
+  }
+
+private:
+  std::atomic<bool> m_enabled;
+  std::chrono::steady_clock::time_point m_epoch;
+  std::string m_path;
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+  Labels m_labels;
+};
+
+inline Tracer &tracer() {
+  static Tracer instance;
+  return instance;
+}
+
+inline bool enabled() { return tracer().enabled(); }
+
+inline void enable(bool enabled = true) { tracer().enable(enabled); }
+
+inline void dump(const std::string &path) { tracer().dump(path); }
+
+class Scope {
+public:
+  Scope() = delete;
+  Scope(const char *name)
+      : m_name(name), m_begin(enabled() ? tracer().now() : -1) {}
+  ~Scope() {
+    if (m_begin >= 0) {
+      tracer().threadBuffer().push({m_name, m_begin, tracer().now()});
+    }
+  }
+
+private:
+  const char *m_name;
+  int64_t m_begin;
+};
+
+// debug_utils labels, resolved by the instance when the extension is on
+inline void loadLabels(VkInstance instance) {
+  auto &labels = tracer().labels();
+  labels.queueBegin = reinterpret_cast<PFN_vkQueueBeginDebugUtilsLabelEXT>(
+      vkGetInstanceProcAddr(instance, "vkQueueBeginDebugUtilsLabelEXT"));
+  labels.queueEnd = reinterpret_cast<PFN_vkQueueEndDebugUtilsLabelEXT>(
+      vkGetInstanceProcAddr(instance, "vkQueueEndDebugUtilsLabelEXT"));
+  labels.cmdBegin = reinterpret_cast<PFN_vkCmdBeginDebugUtilsLabelEXT>(
+      vkGetInstanceProcAddr(instance, "vkCmdBeginDebugUtilsLabelEXT"));
+  labels.cmdEnd = reinterpret_cast<PFN_vkCmdEndDebugUtilsLabelEXT>(
+      vkGetInstanceProcAddr(instance, "vkCmdEndDebugUtilsLabelEXT"));
+}
+
+class QueueLabel {
+public:
+  QueueLabel() = delete;
+  QueueLabel(VkQueue queue, const char *name) : m_queue(VK_NULL_HANDLE) {
+    const auto &labels = tracer().labels();
+    if (enabled() && labels.queueBegin != nullptr) {
+      VkDebugUtilsLabelEXT label = {};
+      label.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+      label.pLabelName = name;
+      labels.queueBegin(queue, &label);
+      m_queue = queue;
+    }
+  }
+  ~QueueLabel() {
+    if (m_queue != VK_NULL_HANDLE) {
+      tracer().labels().queueEnd(m_queue);
+    }
+  }
+
+private:
+  VkQueue m_queue;
+};
+
+inline bool cmdBeginLabel(VkCommandBuffer commandBuffer, const char *name) {
+  const auto &labels = tracer().labels();
+  if (!enabled() || labels.cmdBegin == nullptr) {
+    return false;
+  }
+  VkDebugUtilsLabelEXT label = {};
+  label.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+  label.pLabelName = name;
+  labels.cmdBegin(commandBuffer, &label);
+  return true;
+}
+
+inline void cmdEndLabel(VkCommandBuffer commandBuffer) {
+  tracer().labels().cmdEnd(commandBuffer);
+}
+
+} // namespace trace
+} // namespace vk
+
+#endif
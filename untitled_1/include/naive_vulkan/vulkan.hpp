@@ -2,20 +2,45 @@
 #define __VULKAN_HPP__
 
 // clang-format off
+#include <map>
+#include <mutex>
+#include <queue>
 #include <tuple>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
 #include <vector>
 #include <memory>
+#include <limits>
+#include <cctype>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iterator>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifdef __ANDROID__
 #include "vulkan_wrapper.h"
 #else
 #include <vulkan/vulkan.h>
 #endif
+
+#include "half.hpp"
+#include "trace.hpp"
 // clang-format on
 
 namespace std {
@@ -30,609 +55,4224 @@ std::unique_ptr<T> make_unique(Args &&... args) {
 
 namespace vk {
 
-class Buffer {
+class ThreadPool {
 public:
-  Buffer() = delete;
-  Buffer(const VkPhysicalDevice &physicalDevice, const VkDevice &device,
-         uint32_t size, VkBufferUsageFlags usage,
-         VkMemoryPropertyFlags properties)
-      : m_physicalDevice(physicalDevice), m_device(device) {
-    //
-    if (usage == VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
-      m_descType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    } else if (usage == VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
-      m_descType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    } else {
-      throw std::runtime_error("not implemented");
+  ThreadPool() = delete;
+  ThreadPool(size_t threadCount) : m_stop(false) {
+    for (size_t i = 0; i < std::max(threadCount, size_t(1)); i += 1) {
+      m_threads.emplace_back([this]() { work(); });
+    }
+  }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    for (auto &thread : m_threads) {
+      thread.join();
+    }
+  }
+
+public:
+  template <typename F> std::future<decltype(std::declval<F>()())> submit(F f) {
+    typedef decltype(f()) R;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+    auto future = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.emplace([task]() { (*task)(); });
     }
+    m_condition.notify_one();
+    return future;
+  }
 
-    // Buffer
-    VkBufferCreateInfo bufferCreateInfo = {};
-    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCreateInfo.size = size;
-    bufferCreateInfo.usage = usage; // buffer is used as a storage buffer.
-    bufferCreateInfo.sharingMode =
-        VK_SHARING_MODE_EXCLUSIVE; // buffer is exclusive to a single queue
-                                   // family at a time.
+  size_t size() const { return m_threads.size(); }
 
-    if (vkCreateBuffer(m_device, &bufferCreateInfo, VK_NULL_HANDLE,
-                       &m_buffer) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create buffers!");
+private:
+  // Queued tasks still run on shutdown so no future is left broken
+  void work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+        if (m_tasks.empty()) {
+          return;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop();
+      }
+      task();
     }
+  }
 
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(m_device, m_buffer, &memoryRequirements);
+private:
+  bool m_stop;
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::queue<std::function<void()>> m_tasks;
+  std::vector<std::thread> m_threads;
+};
 
-    // Memory
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.allocationSize = memoryRequirements.size;
-    allocateInfo.memoryTypeIndex =
-        findMemoryType(memoryRequirements.memoryTypeBits, properties);
+// Device-level entry points, resolved once per Device through
+// vkGetDeviceProcAddr so calls skip the loader trampoline and go
+// straight to the driver that owns the device
+#define NAIVE_VULKAN_DEVICE_FUNCTIONS(X) \
+  X(vkAllocateCommandBuffers) \
+  X(vkAllocateDescriptorSets) \
+  X(vkAllocateMemory) \
+  X(vkBeginCommandBuffer) \
+  X(vkBindBufferMemory) \
+  X(vkBindImageMemory) \
+  X(vkCmdBeginRenderPass) \
+  X(vkCmdBindDescriptorSets) \
+  X(vkCmdBindIndexBuffer) \
+  X(vkCmdBindPipeline) \
+  X(vkCmdBindVertexBuffers) \
+  X(vkCmdCopyBufferToImage) \
+  X(vkCmdCopyImageToBuffer) \
+  X(vkCmdDispatch) \
+  X(vkCmdDispatchIndirect) \
+  X(vkCmdDraw) \
+  X(vkCmdDrawIndexed) \
+  X(vkCmdEndRenderPass) \
+  X(vkCmdPipelineBarrier) \
+  X(vkCmdPushConstants) \
+  X(vkCmdResetQueryPool) \
+  X(vkCmdSetScissor) \
+  X(vkCmdSetViewport) \
+  X(vkCmdWriteTimestamp) \
+  X(vkCreateBuffer) \
+  X(vkCreateBufferView) \
+  X(vkCreateCommandPool) \
+  X(vkCreateComputePipelines) \
+  X(vkCreateDescriptorPool) \
+  X(vkCreateDescriptorSetLayout) \
+  X(vkCreateFence) \
+  X(vkCreateFramebuffer) \
+  X(vkCreateGraphicsPipelines) \
+  X(vkCreateImage) \
+  X(vkCreateImageView) \
+  X(vkCreatePipelineCache) \
+  X(vkCreatePipelineLayout) \
+  X(vkCreateQueryPool) \
+  X(vkCreateRenderPass) \
+  X(vkCreateSampler) \
+  X(vkCreateSemaphore) \
+  X(vkCreateShaderModule) \
+  X(vkDestroyBuffer) \
+  X(vkDestroyBufferView) \
+  X(vkDestroyCommandPool) \
+  X(vkDestroyDescriptorPool) \
+  X(vkDestroyDescriptorSetLayout) \
+  X(vkDestroyDevice) \
+  X(vkDestroyFence) \
+  X(vkDestroyFramebuffer) \
+  X(vkDestroyImage) \
+  X(vkDestroyImageView) \
+  X(vkDestroyPipeline) \
+  X(vkDestroyPipelineCache) \
+  X(vkDestroyPipelineLayout) \
+  X(vkDestroyQueryPool) \
+  X(vkDestroyRenderPass) \
+  X(vkDestroySampler) \
+  X(vkDestroySemaphore) \
+  X(vkDestroyShaderModule) \
+  X(vkEndCommandBuffer) \
+  X(vkFlushMappedMemoryRanges) \
+  X(vkFreeCommandBuffers) \
+  X(vkFreeDescriptorSets) \
+  X(vkFreeMemory) \
+  X(vkGetBufferMemoryRequirements) \
+  X(vkGetDeviceQueue) \
+  X(vkGetFenceStatus) \
+  X(vkGetImageMemoryRequirements) \
+  X(vkGetQueryPoolResults) \
+  X(vkInvalidateMappedMemoryRanges) \
+  X(vkMapMemory) \
+  X(vkQueueSubmit) \
+  X(vkQueueWaitIdle) \
+  X(vkResetFences) \
+  X(vkUnmapMemory) \
+  X(vkUpdateDescriptorSets) \
+  X(vkWaitForFences)
 
-    if (vkAllocateMemory(m_device, &allocateInfo, VK_NULL_HANDLE,
-                         &m_bufferMemory) != VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate buffer memory!");
+// VK_KHR_swapchain, null unless the device was created with it
+#define NAIVE_VULKAN_SWAPCHAIN_FUNCTIONS(X) \
+  X(vkAcquireNextImageKHR) \
+  X(vkCreateSwapchainKHR) \
+  X(vkDestroySwapchainKHR) \
+  X(vkGetSwapchainImagesKHR) \
+  X(vkQueuePresentKHR)
+
+// VK_EXT_external_memory_host, null unless the device was created with it
+#ifdef VK_EXT_external_memory_host
+#define NAIVE_VULKAN_EXTERNAL_MEMORY_HOST_FUNCTIONS(X) \
+  X(vkGetMemoryHostPointerPropertiesEXT)
+#else
+#define NAIVE_VULKAN_EXTERNAL_MEMORY_HOST_FUNCTIONS(X)
+#endif
+
+struct DeviceTable {
+#define NAIVE_VULKAN_DECLARE(name) PFN_##name name = nullptr;
+  NAIVE_VULKAN_DEVICE_FUNCTIONS(NAIVE_VULKAN_DECLARE)
+  NAIVE_VULKAN_SWAPCHAIN_FUNCTIONS(NAIVE_VULKAN_DECLARE)
+  NAIVE_VULKAN_EXTERNAL_MEMORY_HOST_FUNCTIONS(NAIVE_VULKAN_DECLARE)
+#undef NAIVE_VULKAN_DECLARE
+
+  void load(VkDevice device) {
+#define NAIVE_VULKAN_LOAD(name)                                                \
+  name = reinterpret_cast<PFN_##name>(vkGetDeviceProcAddr(device, #name));     \
+  if (name == nullptr) {                                                       \
+    throw std::runtime_error("failed to load " #name "!");                     \
+  }
+    NAIVE_VULKAN_DEVICE_FUNCTIONS(NAIVE_VULKAN_LOAD)
+#undef NAIVE_VULKAN_LOAD
+  }
+
+  void loadSwapchain(VkDevice device) {
+#define NAIVE_VULKAN_LOAD(name)                                                \
+  name = reinterpret_cast<PFN_##name>(vkGetDeviceProcAddr(device, #name));
+    NAIVE_VULKAN_SWAPCHAIN_FUNCTIONS(NAIVE_VULKAN_LOAD)
+#undef NAIVE_VULKAN_LOAD
+  }
+
+#ifdef VK_EXT_external_memory_host
+  void loadExternalMemoryHost(VkDevice device) {
+#define NAIVE_VULKAN_LOAD(name)                                                \
+  name = reinterpret_cast<PFN_##name>(vkGetDeviceProcAddr(device, #name));
+    NAIVE_VULKAN_EXTERNAL_MEMORY_HOST_FUNCTIONS(NAIVE_VULKAN_LOAD)
+#undef NAIVE_VULKAN_LOAD
+  }
+#endif
+};
+
+// First memory type allowed by typeFilter with all of properties
+inline uint32_t findMemoryType(VkPhysicalDevice physicalDevice,
+                               uint32_t typeFilter,
+                               VkMemoryPropertyFlags properties) {
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+  for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+    if ((typeFilter & (1 << i)) &&
+        (memProperties.memoryTypes[i].propertyFlags & properties) ==
+            properties) {
+      return i;
     }
+  }
 
-    // Bind
-    vkBindBufferMemory(m_device, m_buffer, m_bufferMemory, 0);
+  throw std::runtime_error("failed to find suitable memory type!");
+}
+
+// What the host does with a buffer, memory types are ranked for it
+enum class MemoryIntent {
+  Upload,    // host writes, device reads, write-combined is fine
+  Readback,  // device writes, host reads, wants HOST_CACHED
+  DeviceOnly // never mapped
+};
+
+// Best memory type allowed by typeFilter for intent. Tiers go from most
+// to least wanted, each with properties a type must have and must lack.
+inline uint32_t findMemoryType(VkPhysicalDevice physicalDevice,
+                               uint32_t typeFilter, MemoryIntent intent) {
+  const VkMemoryPropertyFlags visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+  const VkMemoryPropertyFlags coherent = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  const VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  const VkMemoryPropertyFlags local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  std::vector<std::pair<VkMemoryPropertyFlags, VkMemoryPropertyFlags>> tiers;
+  switch (intent) {
+  case MemoryIntent::Upload:
+    // plain system memory first, device local host visible memory is
+    // often a small window
+    tiers = {{visible | coherent, cached | local},
+             {visible | coherent, 0},
+             {visible, 0}};
+    break;
+  case MemoryIntent::Readback:
+    // uncached reads crawl, non-coherent cached memory beats them even
+    // with an invalidate per dump
+    tiers = {{visible | cached | coherent, 0},
+             {visible | cached, 0},
+             {visible | coherent, 0},
+             {visible, 0}};
+    break;
+  case MemoryIntent::DeviceOnly:
+    tiers = {{local, visible}, {local, 0}, {0, 0}};
+    break;
+  }
+
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+  for (const auto &tier : tiers) {
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+      VkMemoryPropertyFlags flags = memProperties.memoryTypes[i].propertyFlags;
+      if ((typeFilter & (1 << i)) && (flags & tier.first) == tier.first &&
+          (flags & tier.second) == 0) {
+        return i;
+      }
+    }
+  }
+
+  throw std::runtime_error("failed to find suitable memory type!");
+}
+
+class Buffer {
+public:
+  Buffer() = delete;
+  Buffer(const VkPhysicalDevice &physicalDevice, const VkDevice &device,
+         const DeviceTable &table, uint32_t size, VkBufferUsageFlags usage,
+         VkMemoryPropertyFlags properties)
+      : m_physicalDevice(physicalDevice), m_device(device), m_table(&table) {
+    VkMemoryRequirements memoryRequirements = create(size, usage);
+    allocate(memoryRequirements,
+             findMemoryType(m_physicalDevice,
+                            memoryRequirements.memoryTypeBits, properties));
+  }
+  Buffer(const VkPhysicalDevice &physicalDevice, const VkDevice &device,
+         const DeviceTable &table, uint32_t size, VkBufferUsageFlags usage,
+         MemoryIntent intent)
+      : m_physicalDevice(physicalDevice), m_device(device), m_table(&table) {
+    VkMemoryRequirements memoryRequirements = create(size, usage);
+    allocate(memoryRequirements,
+             findMemoryType(m_physicalDevice,
+                            memoryRequirements.memoryTypeBits, intent));
+  }
+#if defined(VK_VERSION_1_1) && defined(VK_EXT_external_memory_host)
+  // Over size bytes of host memory at host, such as a shared mapping,
+  // without a copy. Both are aligned to minImportedHostPointerAlignment,
+  // and the memory outlives the buffer.
+  Buffer(const VkPhysicalDevice &physicalDevice, const VkDevice &device,
+         const DeviceTable &table, void *host, uint32_t size,
+         VkBufferUsageFlags usage)
+      : m_physicalDevice(physicalDevice), m_device(device), m_table(&table) {
+    const auto handleType =
+        VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    VkExternalMemoryBufferCreateInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    externalInfo.handleTypes = handleType;
+    VkMemoryRequirements memoryRequirements =
+        create(size, usage, &externalInfo);
+
+    VkMemoryHostPointerPropertiesEXT pointerProperties = {};
+    pointerProperties.sType =
+        VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    if (m_table->vkGetMemoryHostPointerPropertiesEXT == nullptr ||
+        m_table->vkGetMemoryHostPointerPropertiesEXT(
+            m_device, handleType, host, &pointerProperties) != VK_SUCCESS) {
+      m_table->vkDestroyBuffer(m_device, m_buffer, VK_NULL_HANDLE);
+      throw std::runtime_error("failed to import host memory!");
+    }
+    VkImportMemoryHostPointerInfoEXT importInfo = {};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    importInfo.handleType = handleType;
+    importInfo.pHostPointer = host;
+    // refused imports are expected, callers fall back to a copy. The
+    // memory is never mapped here to be flushed, so it must be coherent
+    try {
+      allocate(memoryRequirements,
+               findMemoryType(m_physicalDevice,
+                              memoryRequirements.memoryTypeBits &
+                                  pointerProperties.memoryTypeBits,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+               &importInfo);
+    } catch (...) {
+      m_table->vkDestroyBuffer(m_device, m_buffer, VK_NULL_HANDLE);
+      throw;
+    }
+  }
+#endif
+  Buffer(const Buffer &) = delete;
+  Buffer(Buffer &&other) noexcept
+      : m_physicalDevice(other.m_physicalDevice), m_device(other.m_device),
+        m_table(other.m_table), m_buffer(other.m_buffer),
+        m_bufferMemory(other.m_bufferMemory), m_size(other.m_size),
+        m_memoryProperties(other.m_memoryProperties),
+        m_descType(other.m_descType) {
+    other.m_buffer = VK_NULL_HANDLE;
+    other.m_bufferMemory = VK_NULL_HANDLE;
   }
-  ~Buffer() {
-    vkFreeMemory(m_device, m_bufferMemory, VK_NULL_HANDLE);
-    vkDestroyBuffer(m_device, m_buffer, VK_NULL_HANDLE);
+  ~Buffer() { destroy(); }
+
+  Buffer &operator=(const Buffer &) = delete;
+  Buffer &operator=(Buffer &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_physicalDevice = other.m_physicalDevice;
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_buffer = other.m_buffer;
+      m_bufferMemory = other.m_bufferMemory;
+      m_size = other.m_size;
+      m_memoryProperties = other.m_memoryProperties;
+      m_descType = other.m_descType;
+      other.m_buffer = VK_NULL_HANDLE;
+      other.m_bufferMemory = VK_NULL_HANDLE;
+    }
+    return *this;
   }
 
 public:
   const VkBuffer &buf() const { return m_buffer; }
   const VkDeviceMemory &mem() const { return m_bufferMemory; }
 
+  // Of the memory type the buffer ended up in
+  VkMemoryPropertyFlags memoryProperties() const { return m_memoryProperties; }
+
   const VkDescriptorType &descType() const { return m_descType; }
 
   void update(void *in, size_t size) {
+    NAIVE_VULKAN_TRACE("Buffer::update");
     void *data;
-    VkMemoryRequirements memoryRequirements = {};
-    vkGetBufferMemoryRequirements(m_device, m_buffer, &memoryRequirements);
-    //
-    vkMapMemory(m_device, m_bufferMemory, 0, memoryRequirements.size, 0,
-                reinterpret_cast<void **>(&data));
-    std::memcpy(data, in, std::min(size_t(memoryRequirements.size), size));
-    vkUnmapMemory(m_device, m_bufferMemory);
+    m_table->vkMapMemory(m_device, m_bufferMemory, 0, m_size, 0,
+                         reinterpret_cast<void **>(&data));
+    std::memcpy(data, in, std::min(size_t(m_size), size));
+    if (!(m_memoryProperties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+      VkMappedMemoryRange range = mappedRange();
+      m_table->vkFlushMappedMemoryRanges(m_device, 1, &range);
+    }
+    m_table->vkUnmapMemory(m_device, m_bufferMemory);
+  }
+
+  // Typed copies, T as the kernel declares the elements, e.g. half
+  template <typename T> void update(const std::vector<T> &in) {
+    update(const_cast<T *>(in.data()), in.size() * sizeof(T));
+  }
+
+  template <typename T> void dump(std::vector<T> &out) const {
+    dump(out.data(), out.size() * sizeof(T));
   }
 
   void print() const {
     void *data;
-    VkMemoryRequirements memoryRequirements = {};
-    vkGetBufferMemoryRequirements(m_device, m_buffer, &memoryRequirements);
-    //
-    vkMapMemory(m_device, m_bufferMemory, 0, memoryRequirements.size, 0,
-                reinterpret_cast<void **>(&data));
-    for (size_t i = 0; i < memoryRequirements.size / sizeof(uint32_t); i += 1) {
+    m_table->vkMapMemory(m_device, m_bufferMemory, 0, m_size, 0,
+                         reinterpret_cast<void **>(&data));
+    invalidate();
+    for (size_t i = 0; i < m_size / sizeof(uint32_t); i += 1) {
       std::cout << reinterpret_cast<uint32_t *>(data)[i] << " ";
     }
     std::cout << std::endl;
     //
-    vkUnmapMemory(m_device, m_bufferMemory);
+    m_table->vkUnmapMemory(m_device, m_bufferMemory);
   }
 
   void dump(void *out, size_t size) const {
+    NAIVE_VULKAN_TRACE("Buffer::dump");
     void *data;
-    VkMemoryRequirements memoryRequirements = {};
-    vkGetBufferMemoryRequirements(m_device, m_buffer, &memoryRequirements);
-    //
-    vkMapMemory(m_device, m_bufferMemory, 0, memoryRequirements.size, 0,
-                reinterpret_cast<void **>(&data));
-    std::memcpy(out, data, std::min(size_t(memoryRequirements.size), size));
-    vkUnmapMemory(m_device, m_bufferMemory);
+    m_table->vkMapMemory(m_device, m_bufferMemory, 0, m_size, 0,
+                         reinterpret_cast<void **>(&data));
+    invalidate();
+    std::memcpy(out, data, std::min(size_t(m_size), size));
+    m_table->vkUnmapMemory(m_device, m_bufferMemory);
   }
 
 private:
-  uint32_t findMemoryType(uint32_t typeFilter,
-                          VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memProperties);
+  // Whole mapping, VK_WHOLE_SIZE needs no nonCoherentAtomSize rounding
+  VkMappedMemoryRange mappedRange() const {
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = m_bufferMemory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    return range;
+  }
 
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-      if ((typeFilter & (1 << i)) &&
-          (memProperties.memoryTypes[i].propertyFlags & properties) ==
-              properties) {
-        return i;
-      }
+  // Device writes become visible to a mapping of non-coherent memory
+  // only after an invalidate
+  void invalidate() const {
+    if (!(m_memoryProperties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+      VkMappedMemoryRange range = mappedRange();
+      m_table->vkInvalidateMappedMemoryRanges(m_device, 1, &range);
     }
-
-    throw std::runtime_error("failed to find suitable memory type!");
   }
 
-private:
-  const VkPhysicalDevice &m_physicalDevice;
-  const VkDevice &m_device;
-  VkBuffer m_buffer;
-  VkDeviceMemory m_bufferMemory;
-  VkDescriptorType m_descType;
-};
+  VkMemoryRequirements create(uint32_t size, VkBufferUsageFlags usage,
+                              const void *next = nullptr) {
+    // At most one descriptor usage, others such as indirect may be added.
+    // Vertex, index and transfer buffers have none.
+    VkBufferUsageFlags descUsage =
+        usage & (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    if (descUsage == VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+      m_descType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    } else if (descUsage == VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+      m_descType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    } else if (descUsage == 0 && usage != 0) {
+      m_descType = VK_DESCRIPTOR_TYPE_MAX_ENUM;
+    } else {
+      throw std::runtime_error("not implemented");
+    }
 
-class Shader {
-public:
-  Shader() = delete;
-  Shader(const VkDevice &device, const std::vector<uint8_t> &spvByteCode,
-         VkShaderStageFlagBits shaderStage)
-      : m_device(device), m_shaderStage(shaderStage) {
-    // Shader module
-    auto createShaderModule =
-        [&](const std::vector<uint8_t> &code) -> VkShaderModule {
-      VkShaderModuleCreateInfo createInfo = {};
-      createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-      createInfo.codeSize = code.size();
-      createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
-
-      VkShaderModule shaderModule;
-      if (vkCreateShaderModule(m_device, &createInfo, VK_NULL_HANDLE,
-                               &shaderModule) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create shader module!");
-      }
-      return shaderModule;
-    };
-    m_compShaderModule = createShaderModule(spvByteCode);
-  }
-  ~Shader() {
-    vkDestroyShaderModule(m_device, m_compShaderModule, VK_NULL_HANDLE);
+    // Buffer
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.pNext = next;
+    bufferCreateInfo.size = size;
+    bufferCreateInfo.usage = usage; // buffer is used as a storage buffer.
+    bufferCreateInfo.sharingMode =
+        VK_SHARING_MODE_EXCLUSIVE; // buffer is exclusive to a single queue
+                                   // family at a time.
+
+    if (m_table->vkCreateBuffer(m_device, &bufferCreateInfo, VK_NULL_HANDLE,
+                                &m_buffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create buffers!");
+    }
+
+    VkMemoryRequirements memoryRequirements;
+    m_table->vkGetBufferMemoryRequirements(m_device, m_buffer,
+                                           &memoryRequirements);
+    return memoryRequirements;
   }
 
-public:
-  VkShaderStageFlagBits stage() const { return m_shaderStage; }
+  void allocate(const VkMemoryRequirements &memoryRequirements,
+                uint32_t memoryType, const void *next = nullptr) {
+    // Memory
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.pNext = next;
+    allocateInfo.allocationSize = memoryRequirements.size;
+    allocateInfo.memoryTypeIndex = memoryType;
 
-  const VkShaderModule &module() const { return m_compShaderModule; }
+    if (m_table->vkAllocateMemory(m_device, &allocateInfo, VK_NULL_HANDLE,
+                                  &m_bufferMemory) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate buffer memory!");
+    }
 
-private:
-  const VkDevice &m_device;
-  VkShaderStageFlagBits m_shaderStage;
-  VkShaderModule m_compShaderModule;
-};
+    // Bind
+    m_table->vkBindBufferMemory(m_device, m_buffer, m_bufferMemory, 0);
+    m_size = memoryRequirements.size;
 
-class Fence {
-public:
-  Fence() = delete;
-  Fence(const VkDevice &device) : m_device(device) {
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = 0;
-    vkCreateFence(m_device, &fenceCreateInfo, VK_NULL_HANDLE, &m_fence);
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memProperties);
+    m_memoryProperties = memProperties.memoryTypes[memoryType].propertyFlags;
   }
-  ~Fence() { vkDestroyFence(m_device, m_fence, VK_NULL_HANDLE); }
-
-public:
-  const VkFence &get() const { return m_fence; }
 
-  void wait() const {
-    // wait finish
-    vkWaitForFences(m_device, 1, &m_fence, VK_TRUE, 0xFFFFFFFF);
+  void destroy() {
+    m_table->vkFreeMemory(m_device, m_bufferMemory, VK_NULL_HANDLE);
+    m_table->vkDestroyBuffer(m_device, m_buffer, VK_NULL_HANDLE);
   }
 
 private:
-  const VkDevice &m_device;
-  VkFence m_fence;
+  VkPhysicalDevice m_physicalDevice;
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkBuffer m_buffer;
+  VkDeviceMemory m_bufferMemory;
+  VkDeviceSize m_size;
+  VkMemoryPropertyFlags m_memoryProperties;
+  VkDescriptorType m_descType;
 };
 
-class Command {
-public:
-  Command() = delete;
-  Command(const VkDevice &device, const VkQueue &graphicsQueue,
-          const VkPipelineLayout &pipelineLayout,
-          const VkPipeline &computePipeline,
-          const std::vector<VkDescriptorSet> &descriptorSets,
-          const VkCommandPool &commandPool,
-          const std::vector<uint32_t> &workers)
-      : m_device(device), m_graphicsQueue(graphicsQueue),
-        m_commandPool(commandPool) {
-    // Create
-    VkCommandBufferAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocateInfo.commandPool = m_commandPool;
-    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocateInfo.commandBufferCount = 1;
+// Tightly packed pixels between a buffer and an image in the general
+// layout, from Image::copy()
+struct ImageCopy {
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  VkImage image;
+  uint32_t width;
+  uint32_t height;
+};
 
-    if (vkAllocateCommandBuffers(device, &allocateInfo, &m_commandBuffer) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to allocate command buffers!");
+// A 2-D, single mip image in device memory with a view of all of it,
+// such as an offscreen render target
+class Image {
+public:
+  Image() = delete;
+  Image(VkPhysicalDevice physicalDevice, VkDevice device,
+        const DeviceTable &table, uint32_t width, uint32_t height,
+        VkFormat format, VkImageUsageFlags usage)
+      : m_device(device), m_table(&table), m_width(width), m_height(height),
+        m_format(format), m_image(VK_NULL_HANDLE),
+        m_imageMemory(VK_NULL_HANDLE), m_view(VK_NULL_HANDLE) {
+    VkImageCreateInfo imageCreateInfo = {};
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent = {width, height, 1};
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageCreateInfo.usage = usage;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (m_table->vkCreateImage(m_device, &imageCreateInfo, VK_NULL_HANDLE,
+                               &m_image) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create image!");
     }
 
-    // Record
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-
-    if (vkBeginCommandBuffer(m_commandBuffer, &beginInfo) != VK_SUCCESS) {
-      throw std::runtime_error("failed to begin recording command buffer!");
+    VkMemoryRequirements memoryRequirements;
+    m_table->vkGetImageMemoryRequirements(m_device, m_image,
+                                          &memoryRequirements);
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = memoryRequirements.size;
+    allocateInfo.memoryTypeIndex =
+        findMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,
+                       MemoryIntent::DeviceOnly);
+    if (m_table->vkAllocateMemory(m_device, &allocateInfo, VK_NULL_HANDLE,
+                                  &m_imageMemory) != VK_SUCCESS) {
+      destroy();
+      throw std::runtime_error("failed to allocate image memory!");
     }
+    m_table->vkBindImageMemory(m_device, m_image, m_imageMemory, 0);
 
-    vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                      computePipeline);
-    vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                            pipelineLayout, 0,
-                            static_cast<uint32_t>(descriptorSets.size()),
-                            descriptorSets.data(), 0, VK_NULL_HANDLE);
-
-    if (workers.size() == 0) {
-      vkCmdDispatch(m_commandBuffer, 0, 0, 0);
-    } else if (workers.size() == 1) {
-      vkCmdDispatch(m_commandBuffer, workers[0], 1, 1);
-    } else if (workers.size() == 2) {
-      vkCmdDispatch(m_commandBuffer, workers[0], workers[1], 1);
-    } else {
-      vkCmdDispatch(m_commandBuffer, workers[0], workers[1], workers[2]);
+    VkImageViewCreateInfo viewCreateInfo = {};
+    viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewCreateInfo.image = m_image;
+    viewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    viewCreateInfo.format = format;
+    viewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewCreateInfo.subresourceRange.levelCount = 1;
+    viewCreateInfo.subresourceRange.layerCount = 1;
+    if (m_table->vkCreateImageView(m_device, &viewCreateInfo, VK_NULL_HANDLE,
+                                   &m_view) != VK_SUCCESS) {
+      destroy();
+      throw std::runtime_error("failed to create image view!");
     }
+  }
+  Image(const Image &) = delete;
+  Image(Image &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_width(other.m_width), m_height(other.m_height),
+        m_format(other.m_format), m_image(other.m_image),
+        m_imageMemory(other.m_imageMemory), m_view(other.m_view) {
+    other.m_image = VK_NULL_HANDLE;
+    other.m_imageMemory = VK_NULL_HANDLE;
+    other.m_view = VK_NULL_HANDLE;
+  }
+  ~Image() { destroy(); }
 
-    if (vkEndCommandBuffer(m_commandBuffer) != VK_SUCCESS) {
-      throw std::runtime_error("failed to record command buffer!");
+  Image &operator=(const Image &) = delete;
+  Image &operator=(Image &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_width = other.m_width;
+      m_height = other.m_height;
+      m_format = other.m_format;
+      m_image = other.m_image;
+      m_imageMemory = other.m_imageMemory;
+      m_view = other.m_view;
+      other.m_image = VK_NULL_HANDLE;
+      other.m_imageMemory = VK_NULL_HANDLE;
+      other.m_view = VK_NULL_HANDLE;
     }
-  }
-  ~Command() {
-    vkFreeCommandBuffers(m_device, m_commandPool, 1, &m_commandBuffer);
+    return *this;
   }
 
 public:
-  std::unique_ptr<Fence> submit() {
-    auto fence = std::make_unique<Fence>(m_device);
+  const VkImage &get() const { return m_image; }
+  const VkImageView &view() const { return m_view; }
 
-    // submit
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &m_commandBuffer;
-    vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, fence->get());
+  uint32_t width() const { return m_width; }
+  uint32_t height() const { return m_height; }
+  VkFormat format() const { return m_format; }
 
-    return fence;
+  // Whole image to or from buffer at offset, for Device::makeCommand
+  ImageCopy copy(const Buffer &buffer, VkDeviceSize offset = 0) const {
+    return ImageCopy{buffer.buf(), offset, m_image, m_width, m_height};
   }
 
 private:
-  const VkDevice &m_device;
-  const VkQueue &m_graphicsQueue;
-  VkCommandBuffer m_commandBuffer;
-  const VkCommandPool &m_commandPool;
+  void destroy() {
+    m_table->vkDestroyImageView(m_device, m_view, VK_NULL_HANDLE);
+    m_table->vkDestroyImage(m_device, m_image, VK_NULL_HANDLE);
+    m_table->vkFreeMemory(m_device, m_imageMemory, VK_NULL_HANDLE);
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  uint32_t m_width;
+  uint32_t m_height;
+  VkFormat m_format;
+  VkImage m_image;
+  VkDeviceMemory m_imageMemory;
+  VkImageView m_view;
 };
 
-class ComputePipeline {
+// Filtering and addressing for sampled images, normalized coordinates
+class Sampler {
 public:
-  ComputePipeline() = delete;
-  ComputePipeline(
-      const VkDevice &device, uint32_t queueFamilyIndex,
-      const VkQueue &graphicsQueue, const std::unique_ptr<Shader> &shader,
-      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
-          &setsBindings)
-      : m_device(device), m_queueFamilyIndex(queueFamilyIndex),
-        m_graphicsQueue(graphicsQueue) {
-    initDescriptor(setsBindings);
-    initPipeline(shader);
-    initCommandPool();
+  Sampler() = delete;
+  Sampler(VkDevice device, const DeviceTable &table, VkFilter filter,
+          VkSamplerAddressMode addressMode)
+      : m_device(device), m_table(&table), m_sampler(VK_NULL_HANDLE) {
+    VkSamplerCreateInfo samplerCreateInfo = {};
+    samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    samplerCreateInfo.magFilter = filter;
+    samplerCreateInfo.minFilter = filter;
+    samplerCreateInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerCreateInfo.addressModeU = addressMode;
+    samplerCreateInfo.addressModeV = addressMode;
+    samplerCreateInfo.addressModeW = addressMode;
+    samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+    if (m_table->vkCreateSampler(m_device, &samplerCreateInfo, VK_NULL_HANDLE,
+                                 &m_sampler) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create sampler!");
+    }
   }
-  ~ComputePipeline() {
-    vkDestroyCommandPool(m_device, m_commandPool, VK_NULL_HANDLE);
-    //
-    vkDestroyPipeline(m_device, m_computePipeline, VK_NULL_HANDLE);
-    vkDestroyPipelineLayout(m_device, m_pipelineLayout, VK_NULL_HANDLE);
-    //
-    vkFreeDescriptorSets(m_device, m_descriptorPool,
-                         static_cast<uint32_t>(m_descriptorSets.size()),
-                         m_descriptorSets.data());
-    for (auto &setLayout : m_descriptorSetLayouts) {
-      vkDestroyDescriptorSetLayout(m_device, setLayout, VK_NULL_HANDLE);
+  Sampler(const Sampler &) = delete;
+  Sampler(Sampler &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_sampler(other.m_sampler) {
+    other.m_sampler = VK_NULL_HANDLE;
+  }
+  ~Sampler() {
+    m_table->vkDestroySampler(m_device, m_sampler, VK_NULL_HANDLE);
+  }
+
+  Sampler &operator=(const Sampler &) = delete;
+  Sampler &operator=(Sampler &&other) noexcept {
+    if (this != &other) {
+      m_table->vkDestroySampler(m_device, m_sampler, VK_NULL_HANDLE);
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_sampler = other.m_sampler;
+      other.m_sampler = VK_NULL_HANDLE;
     }
-    vkDestroyDescriptorPool(m_device, m_descriptorPool, VK_NULL_HANDLE);
+    return *this;
   }
 
 public:
-  void feedBuffer(uint32_t set, uint32_t binding,
-                  const std::unique_ptr<Buffer> &buffer, uint32_t offset,
-                  uint32_t range) {
-    // Attach our buffer to this set
-    VkDescriptorBufferInfo descriptorBufferInfo = {};
-    descriptorBufferInfo.buffer = buffer->buf();
-    descriptorBufferInfo.offset = offset;
-    descriptorBufferInfo.range = range;
+  const VkSampler &get() const { return m_sampler; }
 
-    VkWriteDescriptorSet writeDescriptorSet = {};
-    writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writeDescriptorSet.dstSet = m_descriptorSets[set];
-    writeDescriptorSet.dstBinding = binding;
-    writeDescriptorSet.descriptorCount = 1;
-    writeDescriptorSet.descriptorType = buffer->descType();
-    writeDescriptorSet.pBufferInfo = &descriptorBufferInfo;
-    vkUpdateDescriptorSets(m_device, 1, &writeDescriptorSet, 0, VK_NULL_HANDLE);
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkSampler m_sampler;
+};
+
+// Formatted view of a buffer for uniform and storage texel buffers, the
+// buffer needs the matching texel usage and must outlive the view
+class BufferView {
+public:
+  BufferView() = delete;
+  BufferView(VkDevice device, const DeviceTable &table, const Buffer &buffer,
+             VkFormat format, VkDeviceSize offset, VkDeviceSize range)
+      : m_device(device), m_table(&table), m_view(VK_NULL_HANDLE) {
+    VkBufferViewCreateInfo viewCreateInfo = {};
+    viewCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO;
+    viewCreateInfo.buffer = buffer.buf();
+    viewCreateInfo.format = format;
+    viewCreateInfo.offset = offset;
+    viewCreateInfo.range = range;
+    if (m_table->vkCreateBufferView(m_device, &viewCreateInfo, VK_NULL_HANDLE,
+                                    &m_view) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create buffer view!");
+    }
+  }
+  BufferView(const BufferView &) = delete;
+  BufferView(BufferView &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_view(other.m_view) {
+    other.m_view = VK_NULL_HANDLE;
+  }
+  ~BufferView() {
+    m_table->vkDestroyBufferView(m_device, m_view, VK_NULL_HANDLE);
   }
 
-  std::unique_ptr<Command> createCommand(uint32_t x, uint32_t y = 1,
-                                         uint32_t z = 1) {
-    std::vector<uint32_t> workers = {x, y, z};
-    return std::make_unique<Command>(m_device, m_graphicsQueue,
-                                     m_pipelineLayout, m_computePipeline,
-                                     m_descriptorSets, m_commandPool, workers);
+  BufferView &operator=(const BufferView &) = delete;
+  BufferView &operator=(BufferView &&other) noexcept {
+    if (this != &other) {
+      m_table->vkDestroyBufferView(m_device, m_view, VK_NULL_HANDLE);
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_view = other.m_view;
+      other.m_view = VK_NULL_HANDLE;
+    }
+    return *this;
   }
 
+public:
+  const VkBufferView &get() const { return m_view; }
+
 private:
-  void initDescriptor(
-      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
-          &setsBindings) {
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkBufferView m_view;
+};
+
+class Reflection {
+public:
+  Reflection() = delete;
+  Reflection(const uint32_t *code, size_t wordCount)
+      : m_pushConstantSize(0), m_localSize({1, 1, 1}),
+        m_localSizeSpecIds({NoSpecId, NoSpecId, NoSpecId}) {
     // ----------
-    // n_sets = 2
-    // setsBindings = {[(0, SSBO)], [(1, UBO), (1, SSBO)]}
+    // header: magic, version, generator, bound, schema
+    // instruction: (wordCount << 16 | opcode), operands...
     // ----------
+    if (wordCount < 5 || code[0] != SpvMagic) {
+      throw std::runtime_error("invalid spirv module!");
+    }
 
-    // Check order, set
+    std::unordered_map<uint32_t, Type> types;
+    std::unordered_map<uint32_t, uint32_t> constants;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> composites;
+    std::unordered_map<uint32_t, Decoration> decorations;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> memberOffsets;
+    std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> variables;
+    std::array<uint32_t, 3> localSizeIds = {0, 0, 0};
 
-    // Pool
-    std::vector<VkDescriptorPoolSize> descriptorPoolSizes(2);
-    descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    descriptorPoolSizes[0].descriptorCount = 0;
-    descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    descriptorPoolSizes[1].descriptorCount = 0;
+    for (size_t i = 5; i < wordCount;) {
+      uint32_t opcode = code[i] & 0xFFFF;
+      uint32_t length = code[i] >> 16;
+      if (length == 0 || i + length > wordCount) {
+        throw std::runtime_error("invalid spirv instruction!");
+      }
+      const uint32_t *op = code + i + 1;
 
-    for (const auto &bindings : setsBindings) {
-      for (const auto &bind : bindings) {
-        switch (std::get<1>(bind)) {
-        case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER: {
-          descriptorPoolSizes[0].descriptorCount += 1;
-          break;
+      switch (opcode) {
+      case OpExecutionMode: {
+        if (op[1] == ExecutionModeLocalSize && length >= 6) {
+          m_localSize = {op[2], op[3], op[4]};
         }
-        case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER: {
-          descriptorPoolSizes[1].descriptorCount += 1;
+        break;
+      }
+      case OpExecutionModeId: {
+        if (op[1] == ExecutionModeLocalSizeId && length >= 6) {
+          localSizeIds = {op[2], op[3], op[4]};
+        }
+        break;
+      }
+      case OpDecorate: {
+        auto &decoration = decorations[op[0]];
+        switch (op[1]) {
+        case DecorationSpecId: {
+          decoration.specId = op[2];
+          break;
+        }
+        case DecorationBufferBlock: {
+          decoration.bufferBlock = true;
+          break;
+        }
+        case DecorationArrayStride: {
+          decoration.arrayStride = op[2];
+          break;
+        }
+        case DecorationBuiltIn: {
+          decoration.workgroupSize = op[2] == BuiltInWorkgroupSize;
+          break;
+        }
+        case DecorationBinding: {
+          decoration.binding = op[2];
+          break;
+        }
+        case DecorationDescriptorSet: {
+          decoration.set = op[2];
           break;
         }
-        default: { throw std::runtime_error("not implemented"); }
+        default: { break; }
+        }
+        break;
+      }
+      case OpMemberDecorate: {
+        if (op[2] == DecorationOffset) {
+          auto &offsets = memberOffsets[op[0]];
+          if (offsets.size() <= op[1]) {
+            offsets.resize(op[1] + 1, 0);
+          }
+          offsets[op[1]] = op[3];
+        }
+        break;
+      }
+      case OpTypeBool:
+      case OpTypeInt:
+      case OpTypeFloat:
+      case OpTypeVector:
+      case OpTypeMatrix:
+      case OpTypeImage:
+      case OpTypeSampler:
+      case OpTypeSampledImage:
+      case OpTypeArray:
+      case OpTypeRuntimeArray:
+      case OpTypeStruct:
+      case OpTypePointer: {
+        Type type;
+        type.opcode = opcode;
+        type.operands.assign(op + 1, op + length - 1);
+        types[op[0]] = type;
+        break;
+      }
+      case OpConstant:
+      case OpSpecConstant: {
+        constants[op[1]] = op[2];
+        break;
+      }
+      case OpConstantComposite:
+      case OpSpecConstantComposite: {
+        composites[op[1]].assign(op + 2, op + length - 1);
+        break;
+      }
+      case OpVariable: {
+        variables.push_back(std::make_tuple(op[0], op[1], op[2]));
+        break;
+      }
+      default: { break; }
+      }
+      i += length;
+    }
+
+    // Local size, WorkgroupSize builtin wins over the execution mode
+    auto constantOf = [&](uint32_t id, uint32_t fallback) -> uint32_t {
+      auto it = constants.find(id);
+      return it == constants.end() ? fallback : it->second;
+    };
+    auto specIdOf = [&](uint32_t id) -> uint32_t {
+      auto it = decorations.find(id);
+      return it == decorations.end() ? uint32_t(NoSpecId) : it->second.specId;
+    };
+    if (localSizeIds[0] != 0) {
+      for (size_t i = 0; i < 3; i += 1) {
+        m_localSize[i] = constantOf(localSizeIds[i], m_localSize[i]);
+        m_localSizeSpecIds[i] = specIdOf(localSizeIds[i]);
+      }
+    }
+    for (const auto &composite : composites) {
+      auto it = decorations.find(composite.first);
+      if (it != decorations.end() && it->second.workgroupSize &&
+          composite.second.size() == 3) {
+        for (size_t i = 0; i < 3; i += 1) {
+          m_localSize[i] = constantOf(composite.second[i], m_localSize[i]);
+          m_localSizeSpecIds[i] = specIdOf(composite.second[i]);
+        }
+      }
+    }
+
+    // Byte size of a type, as laid out by Offset / ArrayStride
+    std::function<uint32_t(uint32_t)> sizeOf = [&](uint32_t id) -> uint32_t {
+      auto it = types.find(id);
+      if (it == types.end()) {
+        return 0;
+      }
+      const auto &type = it->second;
+      switch (type.opcode) {
+      case OpTypeBool: {
+        return 4;
+      }
+      case OpTypeInt:
+      case OpTypeFloat: {
+        return type.operands[0] / 8;
+      }
+      case OpTypeVector:
+      case OpTypeMatrix: {
+        return sizeOf(type.operands[0]) * type.operands[1];
+      }
+      case OpTypeArray: {
+        uint32_t stride = decorations[id].arrayStride;
+        if (stride == 0) {
+          stride = sizeOf(type.operands[0]);
+        }
+        return stride * constantOf(type.operands[1], 1);
+      }
+      case OpTypeStruct: {
+        const auto &offsets = memberOffsets[id];
+        uint32_t size = 0;
+        for (size_t m = 0; m < type.operands.size(); m += 1) {
+          uint32_t offset = m < offsets.size() ? offsets[m] : size;
+          size = std::max(size, offset + sizeOf(type.operands[m]));
+        }
+        return size;
+      }
+      default: { return 0; }
+      }
+    };
+
+    // Resources
+    std::map<uint32_t, std::map<uint32_t, VkDescriptorType>> sets;
+    std::map<uint32_t, std::map<uint32_t, uint32_t>> counts;
+    for (const auto &variable : variables) {
+      uint32_t pointerId, id, storageClass;
+      std::tie(pointerId, id, storageClass) = variable;
+
+      auto pointer = types.find(pointerId);
+      if (pointer == types.end() || pointer->second.opcode != OpTypePointer) {
+        continue;
+      }
+      uint32_t typeId = pointer->second.operands[1];
+      uint32_t count = 1;
+      bool runtimeArray = false;
+      while (types.count(typeId) &&
+             (types[typeId].opcode == OpTypeArray ||
+              types[typeId].opcode == OpTypeRuntimeArray)) {
+        if (types[typeId].opcode == OpTypeArray) {
+          count *= constantOf(types[typeId].operands[1], 1);
+        } else {
+          runtimeArray = true;
+        }
+        typeId = types[typeId].operands[0];
+      }
+      if (types.count(typeId) == 0) {
+        continue;
+      }
+      const auto &type = types[typeId];
+
+      if (storageClass == StorageClassPushConstant) {
+        m_pushConstantSize = std::max(m_pushConstantSize, sizeOf(typeId));
+        continue;
+      }
+
+      VkDescriptorType descType;
+      if (storageClass == StorageClassStorageBuffer) {
+        descType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      } else if (storageClass == StorageClassUniform) {
+        descType = decorations[typeId].bufferBlock
+                       ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                       : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      } else if (storageClass == StorageClassUniformConstant) {
+        if (type.opcode == OpTypeSampler) {
+          descType = VK_DESCRIPTOR_TYPE_SAMPLER;
+        } else if (type.opcode == OpTypeSampledImage) {
+          const auto &image = types[type.operands[0]];
+          descType = image.operands[1] == DimBuffer
+                         ? VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER
+                         : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        } else if (type.opcode == OpTypeImage) {
+          bool storage = type.operands[5] == 2;
+          if (type.operands[1] == DimBuffer) {
+            descType = storage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                               : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+          } else {
+            descType = storage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                               : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+          }
+        } else {
+          continue;
+        }
+      } else {
+        continue;
+      }
+
+      // unsized descriptor arrays need descriptor indexing
+      if (runtimeArray) {
+        throw std::runtime_error("runtime descriptor arrays not supported!");
+      }
+      const auto &decoration = decorations[id];
+      sets[decoration.set][decoration.binding] = descType;
+      if (count != 1) {
+        counts[decoration.set][decoration.binding] = count;
+      }
+    }
+
+    // Sets are dense, unused set numbers get an empty layout
+    if (!sets.empty()) {
+      m_setsBindings.resize(sets.rbegin()->first + 1);
+      m_descriptorCounts.resize(sets.rbegin()->first + 1);
+    }
+    for (const auto &set : counts) {
+      m_descriptorCounts[set.first] = set.second;
+    }
+    for (const auto &set : sets) {
+      for (const auto &bind : set.second) {
+        m_setsBindings[set.first].push_back(
+            std::make_tuple(bind.first, bind.second));
+      }
+    }
+  }
+
+public:
+  const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>> &
+  setsBindings() const {
+    return m_setsBindings;
+  }
+
+  // Array length of each arrayed binding per set, the rest hold one
+  const std::vector<std::map<uint32_t, uint32_t>> &descriptorCounts() const {
+    return m_descriptorCounts;
+  }
+
+  uint32_t pushConstantSize() const { return m_pushConstantSize; }
+
+  const std::array<uint32_t, 3> &localSize() const { return m_localSize; }
+
+  // Specialization constant id of each local size component, if any
+  const std::array<uint32_t, 3> &localSizeSpecIds() const {
+    return m_localSizeSpecIds;
+  }
+
+public:
+  enum : uint32_t { NoSpecId = 0xFFFFFFFF };
+
+private:
+  enum : uint32_t {
+    SpvMagic = 0x07230203,
+    // opcodes
+    OpExecutionMode = 16,
+    OpTypeBool = 20,
+    OpTypeInt = 21,
+    OpTypeFloat = 22,
+    OpTypeVector = 23,
+    OpTypeMatrix = 24,
+    OpTypeImage = 25,
+    OpTypeSampler = 26,
+    OpTypeSampledImage = 27,
+    OpTypeArray = 28,
+    OpTypeRuntimeArray = 29,
+    OpTypeStruct = 30,
+    OpTypePointer = 32,
+    OpConstant = 43,
+    OpConstantComposite = 44,
+    OpSpecConstant = 50,
+    OpSpecConstantComposite = 51,
+    OpVariable = 59,
+    OpDecorate = 71,
+    OpMemberDecorate = 72,
+    OpExecutionModeId = 331,
+    // execution modes
+    ExecutionModeLocalSize = 17,
+    ExecutionModeLocalSizeId = 38,
+    // decorations
+    DecorationSpecId = 1,
+    DecorationBufferBlock = 3,
+    DecorationArrayStride = 6,
+    DecorationBuiltIn = 11,
+    DecorationBinding = 33,
+    DecorationDescriptorSet = 34,
+    DecorationOffset = 35,
+    BuiltInWorkgroupSize = 25,
+    // storage classes
+    StorageClassUniformConstant = 0,
+    StorageClassUniform = 2,
+    StorageClassPushConstant = 9,
+    StorageClassStorageBuffer = 12,
+    // image dims
+    DimBuffer = 5,
+  };
+
+  struct Type {
+    uint32_t opcode = 0;
+    std::vector<uint32_t> operands;
+  };
+
+  struct Decoration {
+    uint32_t set = 0;
+    uint32_t binding = 0;
+    uint32_t arrayStride = 0;
+    uint32_t specId = NoSpecId;
+    bool bufferBlock = false;
+    bool workgroupSize = false;
+  };
+
+private:
+  std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+      m_setsBindings;
+  std::vector<std::map<uint32_t, uint32_t>> m_descriptorCounts;
+  uint32_t m_pushConstantSize;
+  std::array<uint32_t, 3> m_localSize;
+  std::array<uint32_t, 3> m_localSizeSpecIds;
+};
+
+class Shader {
+public:
+  Shader() = delete;
+  Shader(const VkDevice &device, const DeviceTable &table,
+         const uint32_t *spvCode, size_t spvSize,
+         VkShaderStageFlagBits shaderStage)
+      : m_device(device), m_table(&table), m_shaderStage(shaderStage),
+        m_reflection(spvCode, spvSize / sizeof(uint32_t)) {
+    // Shader module
+    VkShaderModuleCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.codeSize = spvSize;
+    createInfo.pCode = spvCode;
+
+    if (m_table->vkCreateShaderModule(m_device, &createInfo, VK_NULL_HANDLE,
+                                      &m_compShaderModule) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create shader module!");
+    }
+  }
+  Shader(const Shader &) = delete;
+  Shader(Shader &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_shaderStage(other.m_shaderStage),
+        m_reflection(std::move(other.m_reflection)),
+        m_compShaderModule(other.m_compShaderModule) {
+    other.m_compShaderModule = VK_NULL_HANDLE;
+  }
+  ~Shader() {
+    m_table->vkDestroyShaderModule(m_device, m_compShaderModule,
+                                   VK_NULL_HANDLE);
+  }
+
+  Shader &operator=(const Shader &) = delete;
+  Shader &operator=(Shader &&other) noexcept {
+    if (this != &other) {
+      m_table->vkDestroyShaderModule(m_device, m_compShaderModule,
+                                     VK_NULL_HANDLE);
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_shaderStage = other.m_shaderStage;
+      m_reflection = std::move(other.m_reflection);
+      m_compShaderModule = other.m_compShaderModule;
+      other.m_compShaderModule = VK_NULL_HANDLE;
+    }
+    return *this;
+  }
+
+public:
+  VkShaderStageFlagBits stage() const { return m_shaderStage; }
+
+  const VkShaderModule &module() const { return m_compShaderModule; }
+
+  const Reflection &reflection() const { return m_reflection; }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkShaderStageFlagBits m_shaderStage;
+  Reflection m_reflection;
+  VkShaderModule m_compShaderModule;
+};
+
+class ShaderCache {
+public:
+  ShaderCache() = delete;
+  ShaderCache(const VkDevice &device, const DeviceTable &table)
+      : m_device(device), m_table(&table) {}
+
+public:
+  // Same bytes and stage give the same module while anyone holds it
+  std::shared_ptr<Shader> get(const void *spvCode, size_t spvSize,
+                              VkShaderStageFlagBits shaderStage) {
+    if (spvSize % sizeof(uint32_t) != 0) {
+      throw std::runtime_error("invalid spirv size!");
+    }
+    auto key = std::make_tuple(hash(spvCode, spvSize), spvSize, shaderStage);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_shaders.find(key);
+    if (it != m_shaders.end()) {
+      if (auto shader = it->second.lock()) {
+        return shader;
+      }
+    }
+
+    // pCode must be 4-byte aligned, only copy when the caller's is not
+    std::shared_ptr<Shader> shader;
+    if (reinterpret_cast<uintptr_t>(spvCode) % alignof(uint32_t) == 0) {
+      shader = std::make_shared<Shader>(
+          m_device, *m_table, reinterpret_cast<const uint32_t *>(spvCode),
+          spvSize, shaderStage);
+    } else {
+      std::vector<uint32_t> aligned(spvSize / sizeof(uint32_t));
+      std::memcpy(aligned.data(), spvCode, spvSize);
+      shader = std::make_shared<Shader>(m_device, *m_table, aligned.data(),
+                                        spvSize, shaderStage);
+    }
+    m_shaders[key] = shader;
+    return shader;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t count = 0;
+    for (const auto &shader : m_shaders) {
+      count += shader.second.expired() ? 0 : 1;
+    }
+    return count;
+  }
+
+private:
+  // 64-bit FNV-1a
+  static uint64_t hash(const void *data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    uint64_t seed = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i += 1) {
+      seed = (seed ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return seed;
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  mutable std::mutex m_mutex;
+  std::map<std::tuple<uint64_t, size_t, VkShaderStageFlagBits>,
+           std::weak_ptr<Shader>>
+      m_shaders;
+};
+
+class Fence {
+public:
+  Fence() = delete;
+  Fence(const VkDevice &device, const DeviceTable &table)
+      : m_device(device), m_table(&table) {
+    VkFenceCreateInfo fenceCreateInfo = {};
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.flags = 0;
+    if (m_table->vkCreateFence(m_device, &fenceCreateInfo, VK_NULL_HANDLE,
+                               &m_fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create fence!");
+    }
+  }
+  Fence(const Fence &) = delete;
+  Fence(Fence &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_fence(other.m_fence) {
+    other.m_fence = VK_NULL_HANDLE;
+  }
+  ~Fence() { m_table->vkDestroyFence(m_device, m_fence, VK_NULL_HANDLE); }
+
+  Fence &operator=(const Fence &) = delete;
+  Fence &operator=(Fence &&other) noexcept {
+    if (this != &other) {
+      m_table->vkDestroyFence(m_device, m_fence, VK_NULL_HANDLE);
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_fence = other.m_fence;
+      other.m_fence = VK_NULL_HANDLE;
+    }
+    return *this;
+  }
+
+public:
+  const VkFence &get() const { return m_fence; }
+
+  // Back to unsignaled for another submit, the fence must not be pending
+  void reset() {
+    if (m_table->vkResetFences(m_device, 1, &m_fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to reset fence!");
+    }
+  }
+
+  // Non-blocking poll
+  bool isReady() const {
+    VkResult result = m_table->vkGetFenceStatus(m_device, m_fence);
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+      throw std::runtime_error("failed to get fence status!");
+    }
+    return result == VK_SUCCESS;
+  }
+
+  // Returns false if the timeout (in nanoseconds) expires first
+  bool waitFor(uint64_t timeout) const {
+    NAIVE_VULKAN_TRACE("Fence::wait");
+    return checkWait(
+        m_table->vkWaitForFences(m_device, 1, &m_fence, VK_TRUE, timeout));
+  }
+
+  // Spin while recent waits were short, block once they are not
+  void wait() const {
+    NAIVE_VULKAN_TRACE("Fence::wait");
+    auto begin = std::chrono::steady_clock::now();
+    uint64_t budget = spinBudget();
+    bool ready = isReady();
+    while (!ready && elapsed(begin) < budget) {
+      std::this_thread::yield();
+      ready = isReady();
+    }
+    if (!ready) {
+      checkWait(m_table->vkWaitForFences(m_device, 1, &m_fence, VK_TRUE,
+                                         UINT64_MAX));
+    }
+    recordWait(elapsed(begin));
+  }
+
+  // Index of a signaled fence, or fences.size() on timeout. Fences are
+  // held by value or by std::unique_ptr
+  template <typename F>
+  static size_t waitAny(const std::vector<F> &fences,
+                        uint64_t timeout = UINT64_MAX) {
+    if (fences.empty() || !waitMany(fences, VK_FALSE, timeout)) {
+      return fences.size();
+    }
+    for (size_t i = 0; i < fences.size(); i += 1) {
+      if (self(fences[i]).isReady()) {
+        return i;
+      }
+    }
+    return fences.size();
+  }
+
+  template <typename F>
+  static bool waitAll(const std::vector<F> &fences,
+                      uint64_t timeout = UINT64_MAX) {
+    return fences.empty() || waitMany(fences, VK_TRUE, timeout);
+  }
+
+private:
+  static const Fence &self(const Fence &fence) { return fence; }
+  static const Fence &self(const std::unique_ptr<Fence> &fence) {
+    return *fence;
+  }
+
+  template <typename F>
+  static bool waitMany(const std::vector<F> &fences, VkBool32 waitAll,
+                       uint64_t timeout) {
+    NAIVE_VULKAN_TRACE("Fence::waitMany");
+    std::vector<VkFence> handles;
+    handles.reserve(fences.size());
+    for (const auto &fence : fences) {
+      handles.push_back(self(fence).get());
+    }
+    const Fence &first = self(fences[0]);
+    return checkWait(first.m_table->vkWaitForFences(
+        first.m_device, static_cast<uint32_t>(handles.size()), handles.data(),
+        waitAll, timeout));
+  }
+
+  static bool checkWait(VkResult result) {
+    if (result != VK_SUCCESS && result != VK_TIMEOUT) {
+      throw std::runtime_error("failed to wait for fence!");
+    }
+    return result == VK_SUCCESS;
+  }
+
+  static uint64_t elapsed(std::chrono::steady_clock::time_point begin) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin)
+            .count());
+  }
+
+  // Moving average of recent wait times, shared by all fences
+  static std::atomic<uint64_t> &averageWait() {
+    static std::atomic<uint64_t> average(MaxSpin / 4);
+    return average;
+  }
+
+  static uint64_t spinBudget() {
+    uint64_t average = averageWait().load(std::memory_order_relaxed);
+    return average > MaxSpin ? 0 : std::min(2 * average, uint64_t(MaxSpin));
+  }
+
+  static void recordWait(uint64_t duration) {
+    auto &average = averageWait();
+    uint64_t previous = average.load(std::memory_order_relaxed);
+    average.store(previous - previous / 4 + duration / 4,
+                  std::memory_order_relaxed);
+  }
+
+private:
+  enum : uint64_t { MaxSpin = 200000 };
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkFence m_fence;
+};
+
+class QueryPool {
+public:
+  QueryPool() = delete;
+  QueryPool(const VkDevice &device, const DeviceTable &table,
+            float timestampPeriod, uint32_t timestampValidBits,
+            uint32_t queryCount = 1024)
+      : m_device(device), m_table(&table), m_timestampPeriod(timestampPeriod),
+        m_timestampMask(timestampValidBits >= 64
+                            ? ~uint64_t(0)
+                            : (uint64_t(1) << timestampValidBits) - 1) {
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = queryCount;
+
+    if (m_table->vkCreateQueryPool(m_device, &queryPoolCreateInfo,
+                                   VK_NULL_HANDLE,
+                                   &m_queryPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create query pool!");
+    }
+    m_freeRanges[0] = queryCount;
+  }
+  ~QueryPool() {
+    m_table->vkDestroyQueryPool(m_device, m_queryPool, VK_NULL_HANDLE);
+  }
+
+public:
+  const VkQueryPool &get() const { return m_queryPool; }
+
+  // First fit over the free ranges
+  uint32_t acquire(uint32_t count) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_freeRanges.begin(); it != m_freeRanges.end(); ++it) {
+      if (it->second >= count) {
+        uint32_t first = it->first;
+        uint32_t remain = it->second - count;
+        m_freeRanges.erase(it);
+        if (remain != 0) {
+          m_freeRanges[first + count] = remain;
+        }
+        return first;
+      }
+    }
+    throw std::runtime_error("failed to acquire timestamp queries!");
+  }
+
+  void release(uint32_t first, uint32_t count) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_freeRanges.emplace(first, count).first;
+    auto next = std::next(it);
+    if (next != m_freeRanges.end() && it->first + it->second == next->first) {
+      it->second += next->second;
+      m_freeRanges.erase(next);
+    }
+    if (it != m_freeRanges.begin()) {
+      auto prev = std::prev(it);
+      if (prev->first + prev->second == it->first) {
+        prev->second += it->second;
+        m_freeRanges.erase(it);
+      }
+    }
+  }
+
+  // (begin, end) pairs starting at first, in nanoseconds
+  std::vector<double> durations(uint32_t first, uint32_t pairCount) const {
+    std::vector<uint64_t> timestamps(2 * pairCount);
+    if (m_table->vkGetQueryPoolResults(
+            m_device, m_queryPool, first,
+            static_cast<uint32_t>(timestamps.size()),
+            timestamps.size() * sizeof(uint64_t), timestamps.data(),
+            sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+      throw std::runtime_error("failed to get query results!");
+    }
+
+    std::vector<double> result(pairCount);
+    for (uint32_t i = 0; i < pairCount; i += 1) {
+      uint64_t ticks =
+          (timestamps[2 * i + 1] - timestamps[2 * i]) & m_timestampMask;
+      result[i] = double(ticks) * m_timestampPeriod;
+    }
+    return result;
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  float m_timestampPeriod;
+  uint64_t m_timestampMask;
+  VkQueryPool m_queryPool;
+  std::mutex m_mutex;
+  std::map<uint32_t, uint32_t> m_freeRanges;
+};
+
+struct Dispatch {
+  VkPipeline pipeline;
+  VkPipelineLayout pipelineLayout;
+  std::vector<VkDescriptorSet> descriptorSets;
+  std::vector<uint8_t> pushConstants;
+  std::array<uint32_t, 3> workers;
+  // When set, the workgroup counts are read from a VkDispatchIndirectCommand
+  // in this buffer at submit time instead of workers
+  VkBuffer indirectBuffer = VK_NULL_HANDLE;
+  VkDeviceSize indirectOffset = 0;
+};
+
+// One draw of a GraphicsPipeline, from GraphicsPipeline::draw*()
+struct Draw {
+  VkPipeline pipeline;
+  VkPipelineLayout pipelineLayout;
+  std::vector<VkDescriptorSet> descriptorSets;
+  std::vector<uint8_t> pushConstants;
+  VkShaderStageFlags pushConstantStages;
+  VkBuffer vertexBuffer;
+  VkDeviceSize vertexOffset;
+  // VK_NULL_HANDLE for a non-indexed draw
+  VkBuffer indexBuffer = VK_NULL_HANDLE;
+  VkDeviceSize indexOffset = 0;
+  VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+  uint32_t count;             // indices when indexed, vertices otherwise
+  uint32_t instanceCount = 1;
+};
+
+// Draws into one render target, from RenderTarget::pass(). The target is
+// cleared first and copied to its readback buffer after.
+struct Pass {
+  VkRenderPass renderPass;
+  VkFramebuffer framebuffer;
+  VkImage image;
+  VkBuffer readback; // VK_NULL_HANDLE to keep the pixels on the device
+  uint32_t width;
+  uint32_t height;
+  std::array<float, 4> clearColor;
+  std::vector<Draw> draws;
+};
+
+// Copies packed pixels into a swapchain image after the dispatches and
+// leaves it ready to present, from Presenter
+struct PresentCopy {
+  VkBuffer pixels;
+  VkDeviceSize offset;
+  VkImage image;
+  uint32_t width;
+  uint32_t height;
+};
+
+class Command {
+public:
+  Command() = delete;
+  Command(const VkDevice &device, const DeviceTable &table,
+          const VkQueue &graphicsQueue, const VkCommandPool &commandPool,
+          const std::vector<Dispatch> &dispatches,
+          QueryPool *queryPool = nullptr)
+      : m_device(device), m_table(&table), m_graphicsQueue(graphicsQueue),
+        m_commandPool(commandPool), m_queryPool(queryPool), m_firstQuery(0),
+        m_dispatchCount(static_cast<uint32_t>(dispatches.size())) {
+    begin();
+    if (m_queryPool != nullptr) {
+      m_firstQuery = m_queryPool->acquire(2 * m_dispatchCount);
+      m_table->vkCmdResetQueryPool(m_commandBuffer, m_queryPool->get(),
+                                   m_firstQuery, 2 * m_dispatchCount);
+    }
+
+    recordDispatches(dispatches);
+    end();
+  }
+
+  // Render passes in order, each with its own target
+  Command(const VkDevice &device, const DeviceTable &table,
+          const VkQueue &graphicsQueue, const VkCommandPool &commandPool,
+          const std::vector<Pass> &passes)
+      : m_device(device), m_table(&table), m_graphicsQueue(graphicsQueue),
+        m_commandPool(commandPool), m_queryPool(nullptr), m_firstQuery(0),
+        m_dispatchCount(0) {
+    begin();
+    bool readback = false;
+    for (const auto &pass : passes) {
+      recordPass(pass);
+      readback = readback || pass.readback != VK_NULL_HANDLE;
+    }
+    // The copies are visible to the host once the fence signals
+    if (readback) {
+      VkMemoryBarrier memoryBarrier = {};
+      memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+      m_table->vkCmdPipelineBarrier(
+          m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, VK_NULL_HANDLE,
+          0, VK_NULL_HANDLE);
+    }
+    end();
+  }
+  // Dispatches, then their output copied into a swapchain image. Waits
+  // for the copy out of the previous frame before writing pixels again.
+  Command(const VkDevice &device, const DeviceTable &table,
+          const VkQueue &graphicsQueue, const VkCommandPool &commandPool,
+          const std::vector<Dispatch> &dispatches, const PresentCopy &copy)
+      : m_device(device), m_table(&table), m_graphicsQueue(graphicsQueue),
+        m_commandPool(commandPool), m_queryPool(nullptr), m_firstQuery(0),
+        m_dispatchCount(0) {
+    begin();
+    m_table->vkCmdPipelineBarrier(
+        m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, VK_NULL_HANDLE, 0,
+        VK_NULL_HANDLE, 0, VK_NULL_HANDLE);
+    recordDispatches(dispatches);
+
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    // The old contents are not needed, the whole image is overwritten
+    VkImageMemoryBarrier imageBarrier = {};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.srcAccessMask = 0;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = copy.image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.layerCount = 1;
+    m_table->vkCmdPipelineBarrier(
+        m_commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0,
+        VK_NULL_HANDLE, 1, &imageBarrier);
+
+    VkBufferImageCopy region = {};
+    region.bufferOffset = copy.offset;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = {copy.width, copy.height, 1};
+    m_table->vkCmdCopyBufferToImage(m_commandBuffer, copy.pixels, copy.image,
+                                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                                    &region);
+
+    // The present waits on a semaphore, no access to make visible
+    imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.dstAccessMask = 0;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    m_table->vkCmdPipelineBarrier(
+        m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, VK_NULL_HANDLE, 0,
+        VK_NULL_HANDLE, 1, &imageBarrier);
+    end();
+  }
+  // Buffers copied into images, the dispatches, then images copied out.
+  // The images stay in the general layout throughout.
+  Command(const VkDevice &device, const DeviceTable &table,
+          const VkQueue &graphicsQueue, const VkCommandPool &commandPool,
+          const std::vector<ImageCopy> &uploads,
+          const std::vector<Dispatch> &dispatches,
+          const std::vector<ImageCopy> &downloads)
+      : m_device(device), m_table(&table), m_graphicsQueue(graphicsQueue),
+        m_commandPool(commandPool), m_queryPool(nullptr), m_firstQuery(0),
+        m_dispatchCount(0) {
+    begin();
+    if (!uploads.empty()) {
+      // kernels of an earlier submit may still read the images
+      memoryBarrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT);
+      recordCopies(uploads, true);
+      memoryBarrier(VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+    }
+    recordDispatches(dispatches);
+    if (!downloads.empty()) {
+      memoryBarrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_READ_BIT);
+      recordCopies(downloads, false);
+      // The copies are visible to the host once the fence signals
+      memoryBarrier(VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                    VK_ACCESS_HOST_READ_BIT);
+    }
+    end();
+  }
+  Command(const Command &) = delete;
+  Command(Command &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_graphicsQueue(other.m_graphicsQueue),
+        m_commandBuffer(other.m_commandBuffer),
+        m_commandPool(other.m_commandPool), m_queryPool(other.m_queryPool),
+        m_firstQuery(other.m_firstQuery),
+        m_dispatchCount(other.m_dispatchCount) {
+    other.m_commandBuffer = VK_NULL_HANDLE;
+    other.m_queryPool = nullptr;
+  }
+  ~Command() { destroy(); }
+
+  Command &operator=(const Command &) = delete;
+  Command &operator=(Command &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_graphicsQueue = other.m_graphicsQueue;
+      m_commandBuffer = other.m_commandBuffer;
+      m_commandPool = other.m_commandPool;
+      m_queryPool = other.m_queryPool;
+      m_firstQuery = other.m_firstQuery;
+      m_dispatchCount = other.m_dispatchCount;
+      other.m_commandBuffer = VK_NULL_HANDLE;
+      other.m_queryPool = nullptr;
+    }
+    return *this;
+  }
+
+public:
+  std::unique_ptr<Fence> submit() {
+    NAIVE_VULKAN_TRACE("Command::submit");
+    auto fence = std::make_unique<Fence>(m_device, *m_table);
+    enqueue(fence->get());
+    return fence;
+  }
+
+  // Signals fence again instead of creating one, nothing is allocated
+  void submit(Fence &fence) {
+    NAIVE_VULKAN_TRACE("Command::submit");
+    fence.reset();
+    enqueue(fence.get());
+  }
+
+  // Starts waitStage once wait is signaled and signals signal when done,
+  // for swapchain images
+  void submit(Fence &fence, VkSemaphore wait, VkPipelineStageFlags waitStage,
+              VkSemaphore signal) {
+    NAIVE_VULKAN_TRACE("Command::submit");
+    fence.reset();
+    enqueue(fence.get(), wait, waitStage, signal);
+  }
+
+  // GPU time of each dispatch in nanoseconds, valid once the fence signals
+  std::vector<double> durations() const {
+    if (m_queryPool == nullptr) {
+      return std::vector<double>();
+    }
+    return m_queryPool->durations(m_firstQuery, m_dispatchCount);
+  }
+
+private:
+  void begin() {
+    VkCommandBufferAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocateInfo.commandPool = m_commandPool;
+    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocateInfo.commandBufferCount = 1;
+
+    if (m_table->vkAllocateCommandBuffers(m_device, &allocateInfo,
+                                          &m_commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate command buffers!");
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+    if (m_table->vkBeginCommandBuffer(m_commandBuffer, &beginInfo) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording command buffer!");
+    }
+  }
+
+  void end() {
+    if (m_table->vkEndCommandBuffer(m_commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record command buffer!");
+    }
+  }
+
+  void memoryBarrier(VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+                     VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    VkMemoryBarrier memoryBarrier = {};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = srcAccess;
+    memoryBarrier.dstAccessMask = dstAccess;
+    m_table->vkCmdPipelineBarrier(m_commandBuffer, srcStage, dstStage, 0, 1,
+                                  &memoryBarrier, 0, VK_NULL_HANDLE, 0,
+                                  VK_NULL_HANDLE);
+  }
+
+  void recordCopies(const std::vector<ImageCopy> &copies, bool toImage) {
+    for (const auto &copy : copies) {
+      VkBufferImageCopy region = {};
+      region.bufferOffset = copy.offset;
+      region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      region.imageSubresource.layerCount = 1;
+      region.imageExtent = {copy.width, copy.height, 1};
+      if (toImage) {
+        m_table->vkCmdCopyBufferToImage(m_commandBuffer, copy.buffer,
+                                        copy.image, VK_IMAGE_LAYOUT_GENERAL,
+                                        1, &region);
+      } else {
+        m_table->vkCmdCopyImageToBuffer(m_commandBuffer, copy.image,
+                                        VK_IMAGE_LAYOUT_GENERAL, copy.buffer,
+                                        1, &region);
+      }
+    }
+  }
+
+  // Timed when there is a query pool
+  void recordDispatches(const std::vector<Dispatch> &dispatches) {
+    for (uint32_t i = 0; i < dispatches.size(); i += 1) {
+      const auto &dispatch = dispatches[i];
+
+      // Later dispatches see the writes of earlier ones
+      if (i != 0) {
+        VkMemoryBarrier memoryBarrier = {};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                      VK_ACCESS_SHADER_WRITE_BIT |
+                                      VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        m_table->vkCmdPipelineBarrier(m_commandBuffer,
+                                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                                      0, 1,
+                                      &memoryBarrier, 0, VK_NULL_HANDLE, 0,
+                                      VK_NULL_HANDLE);
+      }
+
+      m_table->vkCmdBindPipeline(m_commandBuffer,
+                                 VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 dispatch.pipeline);
+      if (!dispatch.descriptorSets.empty()) {
+        m_table->vkCmdBindDescriptorSets(
+            m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            dispatch.pipelineLayout, 0,
+            static_cast<uint32_t>(dispatch.descriptorSets.size()),
+            dispatch.descriptorSets.data(), 0, VK_NULL_HANDLE);
+      }
+      if (!dispatch.pushConstants.empty()) {
+        m_table->vkCmdPushConstants(
+            m_commandBuffer, dispatch.pipelineLayout,
+            VK_SHADER_STAGE_COMPUTE_BIT, 0,
+            static_cast<uint32_t>(dispatch.pushConstants.size()),
+            dispatch.pushConstants.data());
+      }
+
+      if (m_queryPool != nullptr) {
+        m_table->vkCmdWriteTimestamp(
+            m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+            m_queryPool->get(), m_firstQuery + 2 * i);
+      }
+      bool labeled = trace::cmdBeginLabel(m_commandBuffer, "vkCmdDispatch");
+      if (dispatch.indirectBuffer != VK_NULL_HANDLE) {
+        m_table->vkCmdDispatchIndirect(m_commandBuffer, dispatch.indirectBuffer,
+                                       dispatch.indirectOffset);
+      } else {
+        m_table->vkCmdDispatch(m_commandBuffer, dispatch.workers[0],
+                               dispatch.workers[1], dispatch.workers[2]);
+      }
+      if (labeled) {
+        trace::cmdEndLabel(m_commandBuffer);
+      }
+      if (m_queryPool != nullptr) {
+        m_table->vkCmdWriteTimestamp(
+            m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            m_queryPool->get(), m_firstQuery + 2 * i + 1);
+      }
+    }
+  }
+
+  void recordPass(const Pass &pass) {
+    VkClearValue clearValue = {};
+    std::copy(pass.clearColor.begin(), pass.clearColor.end(),
+              clearValue.color.float32);
+
+    VkRenderPassBeginInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = pass.renderPass;
+    renderPassInfo.framebuffer = pass.framebuffer;
+    renderPassInfo.renderArea.extent = {pass.width, pass.height};
+    renderPassInfo.clearValueCount = 1;
+    renderPassInfo.pClearValues = &clearValue;
+    m_table->vkCmdBeginRenderPass(m_commandBuffer, &renderPassInfo,
+                                  VK_SUBPASS_CONTENTS_INLINE);
+
+    VkViewport viewport = {};
+    viewport.width = float(pass.width);
+    viewport.height = float(pass.height);
+    viewport.maxDepth = 1.0f;
+    VkRect2D scissor = {};
+    scissor.extent = {pass.width, pass.height};
+    m_table->vkCmdSetViewport(m_commandBuffer, 0, 1, &viewport);
+    m_table->vkCmdSetScissor(m_commandBuffer, 0, 1, &scissor);
+
+    // Draws of a batch mostly share the pipeline, bind it on change only
+    VkPipeline bound = VK_NULL_HANDLE;
+    for (const auto &draw : pass.draws) {
+      if (draw.pipeline != bound) {
+        m_table->vkCmdBindPipeline(m_commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                   draw.pipeline);
+        bound = draw.pipeline;
+      }
+      if (!draw.descriptorSets.empty()) {
+        m_table->vkCmdBindDescriptorSets(
+            m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+            draw.pipelineLayout, 0,
+            static_cast<uint32_t>(draw.descriptorSets.size()),
+            draw.descriptorSets.data(), 0, VK_NULL_HANDLE);
+      }
+      if (!draw.pushConstants.empty()) {
+        m_table->vkCmdPushConstants(
+            m_commandBuffer, draw.pipelineLayout, draw.pushConstantStages, 0,
+            static_cast<uint32_t>(draw.pushConstants.size()),
+            draw.pushConstants.data());
+      }
+      m_table->vkCmdBindVertexBuffers(m_commandBuffer, 0, 1,
+                                      &draw.vertexBuffer, &draw.vertexOffset);
+      if (draw.indexBuffer != VK_NULL_HANDLE) {
+        m_table->vkCmdBindIndexBuffer(m_commandBuffer, draw.indexBuffer,
+                                      draw.indexOffset, draw.indexType);
+        m_table->vkCmdDrawIndexed(m_commandBuffer, draw.count,
+                                  draw.instanceCount, 0, 0, 0);
+      } else {
+        m_table->vkCmdDraw(m_commandBuffer, draw.count, draw.instanceCount, 0,
+                           0);
+      }
+    }
+    m_table->vkCmdEndRenderPass(m_commandBuffer);
+
+    // The render pass leaves the image ready to copy from
+    if (pass.readback != VK_NULL_HANDLE) {
+      VkBufferImageCopy region = {};
+      region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      region.imageSubresource.layerCount = 1;
+      region.imageExtent = {pass.width, pass.height, 1};
+      m_table->vkCmdCopyImageToBuffer(m_commandBuffer, pass.image,
+                                      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                      pass.readback, 1, &region);
+    }
+  }
+
+  void enqueue(VkFence fence, VkSemaphore wait = VK_NULL_HANDLE,
+               VkPipelineStageFlags waitStage = 0,
+               VkSemaphore signal = VK_NULL_HANDLE) {
+    trace::QueueLabel label(m_graphicsQueue, "Command::submit");
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &m_commandBuffer;
+    if (wait != VK_NULL_HANDLE) {
+      submitInfo.waitSemaphoreCount = 1;
+      submitInfo.pWaitSemaphores = &wait;
+      submitInfo.pWaitDstStageMask = &waitStage;
+    }
+    if (signal != VK_NULL_HANDLE) {
+      submitInfo.signalSemaphoreCount = 1;
+      submitInfo.pSignalSemaphores = &signal;
+    }
+    if (m_table->vkQueueSubmit(m_graphicsQueue, 1, &submitInfo, fence) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to submit command buffer!");
+    }
+  }
+
+  void destroy() {
+    if (m_queryPool != nullptr) {
+      m_queryPool->release(m_firstQuery, 2 * m_dispatchCount);
+    }
+    if (m_commandBuffer != VK_NULL_HANDLE) {
+      m_table->vkFreeCommandBuffers(m_device, m_commandPool, 1,
+                                    &m_commandBuffer);
+    }
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkQueue m_graphicsQueue;
+  VkCommandBuffer m_commandBuffer;
+  VkCommandPool m_commandPool;
+  QueryPool *m_queryPool;
+  uint32_t m_firstQuery;
+  uint32_t m_dispatchCount;
+};
+
+class LayoutCache {
+public:
+  LayoutCache() = delete;
+  LayoutCache(const VkDevice &device, const DeviceTable &table)
+      : m_device(device), m_table(&table) {}
+  ~LayoutCache() {
+    for (auto &pipelineLayout : m_pipelineLayouts) {
+      m_table->vkDestroyPipelineLayout(m_device, pipelineLayout.second,
+                                       VK_NULL_HANDLE);
+    }
+    for (auto &setLayout : m_setLayouts) {
+      m_table->vkDestroyDescriptorSetLayout(m_device, setLayout.second,
+                                            VK_NULL_HANDLE);
+    }
+  }
+
+public:
+  // Layouts are owned by the cache and live as long as the device,
+  // stages are the shader stages that see the bindings and counts the
+  // array length of arrayed bindings
+  VkDescriptorSetLayout getSetLayout(
+      const std::vector<std::tuple<uint32_t, VkDescriptorType>> &bindings,
+      VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT,
+      const std::map<uint32_t, uint32_t> &counts = {}) {
+    SetKey key;
+    for (const auto &bind : bindings) {
+      auto it = counts.find(std::get<0>(bind));
+      std::get<0>(key).push_back(std::make_tuple(
+          std::get<0>(bind), std::get<1>(bind),
+          it == counts.end() ? 1u : it->second));
+    }
+    std::get<1>(key) = stages;
+    std::sort(std::get<0>(key).begin(), std::get<0>(key).end());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_setLayouts.find(key);
+    if (it != m_setLayouts.end()) {
+      return it->second;
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings;
+    for (const auto &bind : std::get<0>(key)) {
+      VkDescriptorSetLayoutBinding setLayoutBinding = {};
+      std::tie(setLayoutBinding.binding, setLayoutBinding.descriptorType,
+               setLayoutBinding.descriptorCount) = bind;
+      setLayoutBinding.stageFlags = stages;
+      setLayoutBindings.push_back(setLayoutBinding);
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+    descriptorSetLayoutCreateInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.bindingCount =
+        static_cast<uint32_t>(setLayoutBindings.size());
+    descriptorSetLayoutCreateInfo.pBindings = setLayoutBindings.data();
+
+    VkDescriptorSetLayout descriptorSetLayout;
+    if (m_table->vkCreateDescriptorSetLayout(
+            m_device, &descriptorSetLayoutCreateInfo, VK_NULL_HANDLE,
+            &descriptorSetLayout) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create descriptor!");
+    }
+    m_setLayouts.emplace(key, descriptorSetLayout);
+    return descriptorSetLayout;
+  }
+
+  VkPipelineLayout
+  getPipelineLayout(const std::vector<VkDescriptorSetLayout> &setLayouts,
+                    uint32_t pushConstantSize,
+                    VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT) {
+    auto key = std::make_tuple(setLayouts, pushConstantSize, stages);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pipelineLayouts.find(key);
+    if (it != m_pipelineLayouts.end()) {
+      return it->second;
+    }
+
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.stageFlags = stages;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantSize;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+    pipelineLayoutCreateInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.setLayoutCount =
+        static_cast<uint32_t>(setLayouts.size());
+    pipelineLayoutCreateInfo.pSetLayouts = setLayouts.data();
+    if (pushConstantSize != 0) {
+      pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+      pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    }
+
+    VkPipelineLayout pipelineLayout;
+    if (m_table->vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo,
+                                        VK_NULL_HANDLE,
+                                        &pipelineLayout) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create pipeline layout!");
+    }
+    m_pipelineLayouts.emplace(key, pipelineLayout);
+    return pipelineLayout;
+  }
+
+  size_t setLayoutCount() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_setLayouts.size();
+  }
+
+  size_t pipelineLayoutCount() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pipelineLayouts.size();
+  }
+
+private:
+  typedef std::tuple<
+      std::vector<std::tuple<uint32_t, VkDescriptorType, uint32_t>>,
+      VkShaderStageFlags>
+      SetKey;
+  typedef std::tuple<std::vector<VkDescriptorSetLayout>, uint32_t,
+                     VkShaderStageFlags>
+      PipelineKey;
+
+  struct LayoutHash {
+    static void combine(size_t &seed, size_t value) {
+      seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+
+    size_t operator()(const SetKey &key) const {
+      size_t seed = std::get<0>(key).size();
+      combine(seed, std::get<1>(key));
+      for (const auto &bind : std::get<0>(key)) {
+        combine(seed, std::get<0>(bind));
+        combine(seed, static_cast<size_t>(std::get<1>(bind)));
+        combine(seed, std::get<2>(bind));
+      }
+      return seed;
+    }
+
+    size_t operator()(const PipelineKey &key) const {
+      size_t seed = std::get<1>(key);
+      combine(seed, std::get<2>(key));
+      for (const auto &setLayout : std::get<0>(key)) {
+        combine(seed, std::hash<VkDescriptorSetLayout>()(setLayout));
+      }
+      return seed;
+    }
+  };
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  mutable std::mutex m_mutex;
+  std::unordered_map<SetKey, VkDescriptorSetLayout, LayoutHash> m_setLayouts;
+  std::unordered_map<PipelineKey, VkPipelineLayout, LayoutHash>
+      m_pipelineLayouts;
+};
+
+// Descriptor sets of one pipeline, from a pool sized for their bindings.
+// Set layouts come from the device cache.
+class Descriptors {
+public:
+  Descriptors() = delete;
+  Descriptors(
+      VkDevice device, const DeviceTable &table, LayoutCache &layoutCache,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      VkShaderStageFlags stages,
+      const std::vector<std::map<uint32_t, uint32_t>> &setsCounts = {})
+      : m_device(device), m_table(&table), m_descriptorPool(VK_NULL_HANDLE),
+        m_setsBindings(setsBindings) {
+    // ----------
+    // n_sets = 2
+    // setsBindings = {[(0, SSBO)], [(1, UBO), (1, SSBO)]}
+    // ----------
+
+    // Pool, one size per descriptor type in use
+    static const std::map<uint32_t, uint32_t> single;
+    auto countsOf = [&](size_t set) -> const std::map<uint32_t, uint32_t> & {
+      return set < setsCounts.size() ? setsCounts[set] : single;
+    };
+    std::map<VkDescriptorType, uint32_t> counts;
+    for (size_t set = 0; set < setsBindings.size(); set += 1) {
+      for (const auto &bind : setsBindings[set]) {
+        auto it = countsOf(set).find(std::get<0>(bind));
+        switch (std::get<1>(bind)) {
+        case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+        case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+        case VK_DESCRIPTOR_TYPE_SAMPLER:
+        case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+        case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+        case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+        case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+        case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER: {
+          counts[std::get<1>(bind)] +=
+              it == countsOf(set).end() ? 1 : it->second;
+          break;
+        }
+        default: { throw std::runtime_error("not implemented"); }
+        }
+      }
+    }
+    std::vector<VkDescriptorPoolSize> descriptorPoolSizes;
+    for (const auto &count : counts) {
+      descriptorPoolSizes.push_back({count.first, count.second});
+    }
+
+    // Sets binding layout, shared through the device cache
+    for (size_t set = 0; set < setsBindings.size(); set += 1) {
+      m_descriptorSetLayouts.push_back(
+          layoutCache.getSetLayout(setsBindings[set], stages, countsOf(set)));
+    }
+    if (descriptorPoolSizes.empty()) {
+      m_descriptorPool = VK_NULL_HANDLE;
+      return;
+    }
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
+    descriptorPoolCreateInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.maxSets =
+        static_cast<uint32_t>(setsBindings.size());
+    descriptorPoolCreateInfo.poolSizeCount =
+        static_cast<uint32_t>(descriptorPoolSizes.size());
+    descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes.data();
+    descriptorPoolCreateInfo.flags =
+        VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+
+    if (m_table->vkCreateDescriptorPool(m_device, &descriptorPoolCreateInfo,
+                                        VK_NULL_HANDLE,
+                                        &m_descriptorPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create descriptor pool!");
+    }
+
+    // Descriptor
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {};
+    descriptorSetAllocateInfo.sType =
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.descriptorPool = m_descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount =
+        static_cast<uint32_t>(m_descriptorSetLayouts.size());
+    descriptorSetAllocateInfo.pSetLayouts = m_descriptorSetLayouts.data();
+
+    m_descriptorSets.resize(m_descriptorSetLayouts.size());
+    if (m_table->vkAllocateDescriptorSets(m_device, &descriptorSetAllocateInfo,
+                                          m_descriptorSets.data()) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to create descriptor pool!");
+    }
+  }
+  Descriptors(const Descriptors &) = delete;
+  Descriptors(Descriptors &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_descriptorPool(other.m_descriptorPool),
+        m_setsBindings(std::move(other.m_setsBindings)),
+        m_descriptorSetLayouts(std::move(other.m_descriptorSetLayouts)),
+        m_descriptorSets(std::move(other.m_descriptorSets)) {
+    other.m_descriptorPool = VK_NULL_HANDLE;
+  }
+  ~Descriptors() { destroy(); }
+
+  Descriptors &operator=(const Descriptors &) = delete;
+  Descriptors &operator=(Descriptors &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_descriptorPool = other.m_descriptorPool;
+      m_setsBindings = std::move(other.m_setsBindings);
+      m_descriptorSetLayouts = std::move(other.m_descriptorSetLayouts);
+      m_descriptorSets = std::move(other.m_descriptorSets);
+      other.m_descriptorPool = VK_NULL_HANDLE;
+    }
+    return *this;
+  }
+
+public:
+  const std::vector<VkDescriptorSetLayout> &setLayouts() const {
+    return m_descriptorSetLayouts;
+  }
+
+  const std::vector<VkDescriptorSet> &sets() const { return m_descriptorSets; }
+
+  void feedBuffer(uint32_t set, uint32_t binding, const Buffer &buffer,
+                  uint32_t offset, uint32_t range) {
+    if (buffer.descType() == VK_DESCRIPTOR_TYPE_MAX_ENUM) {
+      throw std::runtime_error("buffer has no descriptor usage!");
+    }
+    // Attach our buffer to this set
+    VkDescriptorBufferInfo descriptorBufferInfo = {};
+    descriptorBufferInfo.buffer = buffer.buf();
+    descriptorBufferInfo.offset = offset;
+    descriptorBufferInfo.range = range;
+
+    VkWriteDescriptorSet writeDescriptorSet = {};
+    writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet.dstSet = m_descriptorSets[set];
+    writeDescriptorSet.dstBinding = binding;
+    writeDescriptorSet.descriptorCount = 1;
+    writeDescriptorSet.descriptorType = buffer.descType();
+    writeDescriptorSet.pBufferInfo = &descriptorBufferInfo;
+    m_table->vkUpdateDescriptorSets(m_device, 1, &writeDescriptorSet, 0,
+                                    VK_NULL_HANDLE);
+  }
+
+  // A storage or sampled image binding, or a combined image sampler
+  // when there is a sampler. Images are read in the general layout.
+  void feedImage(uint32_t set, uint32_t binding, const Image &image,
+                 const Sampler *sampler = nullptr) {
+    VkDescriptorType descType = bindingType(set, binding);
+    bool combined = descType == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    if (combined != (sampler != nullptr) ||
+        (!combined && descType != VK_DESCRIPTOR_TYPE_STORAGE_IMAGE &&
+         descType != VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE)) {
+      throw std::runtime_error("binding is not of this descriptor type!");
+    }
+    VkDescriptorImageInfo descriptorImageInfo = {};
+    descriptorImageInfo.sampler = combined ? sampler->get() : VK_NULL_HANDLE;
+    descriptorImageInfo.imageView = image.view();
+    descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    write(set, binding, descType, &descriptorImageInfo, VK_NULL_HANDLE);
+  }
+
+  void feedSampler(uint32_t set, uint32_t binding, const Sampler &sampler) {
+    VkDescriptorType descType = bindingType(set, binding);
+    if (descType != VK_DESCRIPTOR_TYPE_SAMPLER) {
+      throw std::runtime_error("binding is not of this descriptor type!");
+    }
+    VkDescriptorImageInfo descriptorImageInfo = {};
+    descriptorImageInfo.sampler = sampler.get();
+    write(set, binding, descType, &descriptorImageInfo, VK_NULL_HANDLE);
+  }
+
+  // Uniform or storage texel buffer, as the binding declares
+  void feedTexelBuffer(uint32_t set, uint32_t binding,
+                       const BufferView &view) {
+    VkDescriptorType descType = bindingType(set, binding);
+    if (descType != VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER &&
+        descType != VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER) {
+      throw std::runtime_error("binding is not of this descriptor type!");
+    }
+    write(set, binding, descType, VK_NULL_HANDLE, &view.get());
+  }
+
+private:
+  VkDescriptorType bindingType(uint32_t set, uint32_t binding) const {
+    if (set < m_setsBindings.size()) {
+      for (const auto &bind : m_setsBindings[set]) {
+        if (std::get<0>(bind) == binding) {
+          return std::get<1>(bind);
+        }
+      }
+    }
+    throw std::runtime_error("failed to find binding!");
+  }
+
+  void write(uint32_t set, uint32_t binding, VkDescriptorType descType,
+             const VkDescriptorImageInfo *imageInfo,
+             const VkBufferView *texelBufferView) {
+    VkWriteDescriptorSet writeDescriptorSet = {};
+    writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeDescriptorSet.dstSet = m_descriptorSets[set];
+    writeDescriptorSet.dstBinding = binding;
+    writeDescriptorSet.descriptorCount = 1;
+    writeDescriptorSet.descriptorType = descType;
+    writeDescriptorSet.pImageInfo = imageInfo;
+    writeDescriptorSet.pTexelBufferView = texelBufferView;
+    m_table->vkUpdateDescriptorSets(m_device, 1, &writeDescriptorSet, 0,
+                                    VK_NULL_HANDLE);
+  }
+
+  void destroy() {
+    if (m_descriptorPool != VK_NULL_HANDLE) {
+      m_table->vkFreeDescriptorSets(
+          m_device, m_descriptorPool,
+          static_cast<uint32_t>(m_descriptorSets.size()),
+          m_descriptorSets.data());
+      m_table->vkDestroyDescriptorPool(m_device, m_descriptorPool,
+                                       VK_NULL_HANDLE);
+    }
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkDescriptorPool m_descriptorPool;
+  std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+      m_setsBindings;
+  std::vector<VkDescriptorSetLayout> m_descriptorSetLayouts;
+  std::vector<VkDescriptorSet> m_descriptorSets;
+};
+
+class ComputePipeline {
+public:
+  ComputePipeline() = delete;
+  ComputePipeline(
+      const VkDevice &device, const DeviceTable &table,
+      uint32_t queueFamilyIndex, const VkQueue &graphicsQueue,
+      LayoutCache &layoutCache,
+      const VkPipelineCache &pipelineCache,
+      const std::shared_ptr<Shader> &shader,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization = {})
+      : m_device(device), m_table(&table), m_queueFamilyIndex(queueFamilyIndex),
+        m_graphicsQueue(graphicsQueue), m_layoutCache(&layoutCache),
+        m_shader(shader), m_localSize(shader->reflection().localSize()),
+        m_descriptors(device, table, layoutCache, setsBindings,
+                      VK_SHADER_STAGE_COMPUTE_BIT,
+                      shader->reflection().descriptorCounts()) {
+    NAIVE_VULKAN_TRACE("ComputePipeline::create");
+    // A specialized local size overrides the reflected default
+    const auto &specIds = shader->reflection().localSizeSpecIds();
+    for (size_t i = 0; i < 3; i += 1) {
+      for (const auto &constant : specialization) {
+        if (specIds[i] != Reflection::NoSpecId &&
+            std::get<0>(constant) == specIds[i]) {
+          m_localSize[i] = std::get<1>(constant);
+        }
+      }
+    }
+    initPipeline(shader, pipelineCache, specialization);
+    initCommandPool();
+  }
+  ComputePipeline(const ComputePipeline &) = delete;
+  ComputePipeline(ComputePipeline &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_queueFamilyIndex(other.m_queueFamilyIndex),
+        m_graphicsQueue(other.m_graphicsQueue),
+        m_layoutCache(other.m_layoutCache),
+        m_shader(std::move(other.m_shader)), m_localSize(other.m_localSize),
+        m_descriptors(std::move(other.m_descriptors)),
+        m_pushConstants(std::move(other.m_pushConstants)),
+        m_pipelineLayout(other.m_pipelineLayout),
+        m_computePipeline(other.m_computePipeline),
+        m_commandPool(other.m_commandPool) {
+    other.release();
+  }
+  ~ComputePipeline() { destroy(); }
+
+  ComputePipeline &operator=(const ComputePipeline &) = delete;
+  ComputePipeline &operator=(ComputePipeline &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_queueFamilyIndex = other.m_queueFamilyIndex;
+      m_graphicsQueue = other.m_graphicsQueue;
+      m_layoutCache = other.m_layoutCache;
+      m_shader = std::move(other.m_shader);
+      m_localSize = other.m_localSize;
+      m_descriptors = std::move(other.m_descriptors);
+      m_pushConstants = std::move(other.m_pushConstants);
+      m_pipelineLayout = other.m_pipelineLayout;
+      m_computePipeline = other.m_computePipeline;
+      m_commandPool = other.m_commandPool;
+      other.release();
+    }
+    return *this;
+  }
+
+public:
+  void feedBuffer(uint32_t set, uint32_t binding,
+                  const std::unique_ptr<Buffer> &buffer, uint32_t offset,
+                  uint32_t range) {
+    feedBuffer(set, binding, *buffer, offset, range);
+  }
+
+  void feedBuffer(uint32_t set, uint32_t binding, const Buffer &buffer,
+                  uint32_t offset, uint32_t range) {
+    NAIVE_VULKAN_TRACE("ComputePipeline::feedBuffer");
+    m_descriptors.feedBuffer(set, binding, buffer, offset, range);
+  }
+
+  // Storage or sampled image, in the general layout
+  void feedImage(uint32_t set, uint32_t binding, const Image &image) {
+    m_descriptors.feedImage(set, binding, image);
+  }
+
+  // Combined image sampler
+  void feedImage(uint32_t set, uint32_t binding, const Image &image,
+                 const Sampler &sampler) {
+    m_descriptors.feedImage(set, binding, image, &sampler);
+  }
+
+  void feedSampler(uint32_t set, uint32_t binding, const Sampler &sampler) {
+    m_descriptors.feedSampler(set, binding, sampler);
+  }
+
+  void feedTexelBuffer(uint32_t set, uint32_t binding,
+                       const BufferView &view) {
+    m_descriptors.feedTexelBuffer(set, binding, view);
+  }
+
+  // Recorded into every command created afterwards
+  void pushConstants(const void *data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    m_pushConstants.assign(bytes, bytes + size);
+  }
+
+  // For chaining with other pipelines through Device::createCommand
+  Dispatch dispatch(uint32_t x, uint32_t y = 1, uint32_t z = 1) const {
+    Dispatch dispatch;
+    dispatch.pipeline = m_computePipeline;
+    dispatch.pipelineLayout = m_pipelineLayout;
+    dispatch.descriptorSets = m_descriptors.sets();
+    dispatch.pushConstants = m_pushConstants;
+    dispatch.workers = {x, y, z};
+    return dispatch;
+  }
+
+  // Workgroup counts come from a VkDispatchIndirectCommand at offset in
+  // buffer, created with VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, so a
+  // recorded command can be resubmitted with a different size
+  Dispatch dispatchIndirect(const Buffer &buffer,
+                            VkDeviceSize offset = 0) const {
+    Dispatch dispatch = this->dispatch(0, 0, 0);
+    dispatch.indirectBuffer = buffer.buf();
+    dispatch.indirectOffset = offset;
+    return dispatch;
+  }
+
+  Dispatch dispatchIndirect(const std::unique_ptr<Buffer> &buffer,
+                            VkDeviceSize offset = 0) const {
+    return dispatchIndirect(*buffer, offset);
+  }
+
+  Command makeCommand(uint32_t x, uint32_t y = 1, uint32_t z = 1) {
+    return Command(m_device, *m_table, m_graphicsQueue, m_commandPool,
+                   std::vector<Dispatch>{dispatch(x, y, z)});
+  }
+
+  std::unique_ptr<Command> createCommand(uint32_t x, uint32_t y = 1,
+                                         uint32_t z = 1) {
+    return std::make_unique<Command>(makeCommand(x, y, z));
+  }
+
+  const std::shared_ptr<Shader> &shader() const { return m_shader; }
+
+  const std::array<uint32_t, 3> &localSize() const { return m_localSize; }
+
+private:
+  void destroy() {
+    m_table->vkDestroyCommandPool(m_device, m_commandPool, VK_NULL_HANDLE);
+    //
+    m_table->vkDestroyPipeline(m_device, m_computePipeline, VK_NULL_HANDLE);
+  }
+
+  // Leaves nothing for destroy() after a move
+  void release() {
+    m_computePipeline = VK_NULL_HANDLE;
+    m_commandPool = VK_NULL_HANDLE;
+  }
+
+  void initPipeline(
+      const std::shared_ptr<Shader> &shader,
+      const VkPipelineCache &pipelineCache,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization) {
+    // Specialization constants, 32 bits each
+    std::vector<VkSpecializationMapEntry> mapEntries;
+    std::vector<uint32_t> specializationData;
+    for (const auto &constant : specialization) {
+      VkSpecializationMapEntry mapEntry = {};
+      mapEntry.constantID = std::get<0>(constant);
+      mapEntry.offset =
+          static_cast<uint32_t>(specializationData.size() * sizeof(uint32_t));
+      mapEntry.size = sizeof(uint32_t);
+      mapEntries.push_back(mapEntry);
+      specializationData.push_back(std::get<1>(constant));
+    }
+    VkSpecializationInfo specializationInfo = {};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(mapEntries.size());
+    specializationInfo.pMapEntries = mapEntries.data();
+    specializationInfo.dataSize = specializationData.size() * sizeof(uint32_t);
+    specializationInfo.pData = specializationData.data();
+
+    // Shader stages
+    VkPipelineShaderStageCreateInfo compShaderStageInfo = {};
+    compShaderStageInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    compShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    compShaderStageInfo.module = shader->module();
+    compShaderStageInfo.pName = "main";
+    if (!specialization.empty()) {
+      compShaderStageInfo.pSpecializationInfo = &specializationInfo;
+    }
+
+    // Pipeline layout, shared through the device cache
+    m_pipelineLayout = m_layoutCache->getPipelineLayout(
+        m_descriptors.setLayouts(), shader->reflection().pushConstantSize());
+
+    // pipeline
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.stage = compShaderStageInfo;
+    pipelineCreateInfo.layout = m_pipelineLayout;
+
+    if (m_table->vkCreateComputePipelines(m_device, pipelineCache, 1,
+                                          &pipelineCreateInfo, VK_NULL_HANDLE,
+                                          &m_computePipeline) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create compute pipeline!");
+    }
+  }
+
+  void initCommandPool() {
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+
+    if (m_table->vkCreateCommandPool(m_device, &poolInfo, nullptr,
+                                     &m_commandPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create command pool!");
+    }
+  }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  uint32_t m_queueFamilyIndex;
+  VkQueue m_graphicsQueue;
+  LayoutCache *m_layoutCache;
+  std::shared_ptr<Shader> m_shader;
+  std::array<uint32_t, 3> m_localSize;
+  //
+  Descriptors m_descriptors;
+  std::vector<uint8_t> m_pushConstants;
+  //
+  VkPipelineLayout m_pipelineLayout;
+  VkPipeline m_computePipeline;
+  //
+  VkCommandPool m_commandPool;
+};
+
+// Vertex input of a GraphicsPipeline, one interleaved binding. Attributes
+// are (location, format, offset in the vertex).
+struct VertexLayout {
+  uint32_t stride;
+  std::vector<std::tuple<uint32_t, VkFormat, uint32_t>> attributes;
+};
+
+// An offscreen color image with its framebuffer and a host visible buffer
+// the pixels are copied to, tightly packed, 4 bytes per pixel
+class RenderTarget {
+public:
+  RenderTarget() = delete;
+  RenderTarget(VkPhysicalDevice physicalDevice, VkDevice device,
+               const DeviceTable &table, VkRenderPass renderPass,
+               uint32_t width, uint32_t height, VkFormat format)
+      : m_device(device), m_table(&table), m_renderPass(renderPass),
+        m_image(physicalDevice, device, table, width, height, format,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT),
+        m_readback(physicalDevice, device, table, width * height * 4,
+                   VK_BUFFER_USAGE_TRANSFER_DST_BIT, MemoryIntent::Readback),
+        m_framebuffer(VK_NULL_HANDLE) {
+    VkFramebufferCreateInfo framebufferInfo = {};
+    framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebufferInfo.renderPass = m_renderPass;
+    framebufferInfo.attachmentCount = 1;
+    framebufferInfo.pAttachments = &m_image.view();
+    framebufferInfo.width = width;
+    framebufferInfo.height = height;
+    framebufferInfo.layers = 1;
+    if (m_table->vkCreateFramebuffer(m_device, &framebufferInfo,
+                                     VK_NULL_HANDLE,
+                                     &m_framebuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create framebuffer!");
+    }
+  }
+  RenderTarget(const RenderTarget &) = delete;
+  RenderTarget(RenderTarget &&other) noexcept
+      : m_device(other.m_device), m_table(other.m_table),
+        m_renderPass(other.m_renderPass), m_image(std::move(other.m_image)),
+        m_readback(std::move(other.m_readback)),
+        m_framebuffer(other.m_framebuffer) {
+    other.m_framebuffer = VK_NULL_HANDLE;
+  }
+  ~RenderTarget() {
+    m_table->vkDestroyFramebuffer(m_device, m_framebuffer, VK_NULL_HANDLE);
+  }
+
+  RenderTarget &operator=(const RenderTarget &) = delete;
+  RenderTarget &operator=(RenderTarget &&other) noexcept {
+    if (this != &other) {
+      m_table->vkDestroyFramebuffer(m_device, m_framebuffer, VK_NULL_HANDLE);
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_renderPass = other.m_renderPass;
+      m_image = std::move(other.m_image);
+      m_readback = std::move(other.m_readback);
+      m_framebuffer = other.m_framebuffer;
+      other.m_framebuffer = VK_NULL_HANDLE;
+    }
+    return *this;
+  }
+
+public:
+  const Image &image() const { return m_image; }
+
+  uint32_t width() const { return m_image.width(); }
+  uint32_t height() const { return m_image.height(); }
+
+  // Bytes of the packed pixels
+  size_t size() const { return size_t(width()) * height() * 4; }
+
+  // For Device::createRenderCommand, the pixels are copied out after the
+  // draws unless readback is false
+  Pass pass(const std::vector<Draw> &draws,
+            const std::array<float, 4> &clearColor = {{0.0f, 0.0f, 0.0f,
+                                                       0.0f}},
+            bool readback = true) const {
+    Pass pass;
+    pass.renderPass = m_renderPass;
+    pass.framebuffer = m_framebuffer;
+    pass.image = m_image.get();
+    pass.readback = readback ? m_readback.buf() : VK_NULL_HANDLE;
+    pass.width = width();
+    pass.height = height();
+    pass.clearColor = clearColor;
+    pass.draws = draws;
+    return pass;
+  }
+
+  // Valid once the fence of the command signals
+  void dump(void *out, size_t size) const { m_readback.dump(out, size); }
+
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkRenderPass m_renderPass;
+  Image m_image;
+  Buffer m_readback;
+  VkFramebuffer m_framebuffer;
+};
+
+// Vertex and fragment shader drawing triangle lists into RenderTargets of
+// one color format, no window or surface involved
+class GraphicsPipeline {
+public:
+  GraphicsPipeline() = delete;
+  GraphicsPipeline(VkPhysicalDevice physicalDevice, const VkDevice &device,
+                   const DeviceTable &table, LayoutCache &layoutCache,
+                   const VkPipelineCache &pipelineCache,
+                   const std::shared_ptr<Shader> &vertexShader,
+                   const std::shared_ptr<Shader> &fragmentShader,
+                   const VertexLayout &vertexLayout, VkFormat colorFormat,
+                   bool blend)
+      : m_physicalDevice(physicalDevice), m_device(device), m_table(&table),
+        m_vertexShader(vertexShader), m_fragmentShader(fragmentShader),
+        m_colorFormat(colorFormat),
+        m_descriptors(device, table, layoutCache,
+                      mergeBindings(vertexShader, fragmentShader),
+                      VK_SHADER_STAGE_VERTEX_BIT |
+                          VK_SHADER_STAGE_FRAGMENT_BIT,
+                      mergeCounts(vertexShader, fragmentShader)),
+        m_pipelineLayout(VK_NULL_HANDLE), m_renderPass(VK_NULL_HANDLE),
+        m_graphicsPipeline(VK_NULL_HANDLE) {
+    NAIVE_VULKAN_TRACE("GraphicsPipeline::create");
+    // Targets are read back as packed 32-bit pixels
+    switch (colorFormat) {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+      break;
+    default: { throw std::runtime_error("not implemented"); }
+    }
+
+    // Pipeline layout, shared through the device cache
+    uint32_t pushConstantSize =
+        std::max(vertexShader->reflection().pushConstantSize(),
+                 fragmentShader->reflection().pushConstantSize());
+    m_pipelineLayout = layoutCache.getPipelineLayout(
+        m_descriptors.setLayouts(), pushConstantSize,
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+
+    initRenderPass();
+    try {
+      initPipeline(pipelineCache, vertexLayout, blend);
+    } catch (...) {
+      destroy();
+      throw;
+    }
+  }
+  GraphicsPipeline(const GraphicsPipeline &) = delete;
+  GraphicsPipeline(GraphicsPipeline &&other) noexcept
+      : m_physicalDevice(other.m_physicalDevice), m_device(other.m_device),
+        m_table(other.m_table),
+        m_vertexShader(std::move(other.m_vertexShader)),
+        m_fragmentShader(std::move(other.m_fragmentShader)),
+        m_colorFormat(other.m_colorFormat),
+        m_descriptors(std::move(other.m_descriptors)),
+        m_pushConstants(std::move(other.m_pushConstants)),
+        m_pipelineLayout(other.m_pipelineLayout),
+        m_renderPass(other.m_renderPass),
+        m_graphicsPipeline(other.m_graphicsPipeline) {
+    other.m_renderPass = VK_NULL_HANDLE;
+    other.m_graphicsPipeline = VK_NULL_HANDLE;
+  }
+  ~GraphicsPipeline() { destroy(); }
+
+  GraphicsPipeline &operator=(const GraphicsPipeline &) = delete;
+  GraphicsPipeline &operator=(GraphicsPipeline &&other) noexcept {
+    if (this != &other) {
+      destroy();
+      m_physicalDevice = other.m_physicalDevice;
+      m_device = other.m_device;
+      m_table = other.m_table;
+      m_vertexShader = std::move(other.m_vertexShader);
+      m_fragmentShader = std::move(other.m_fragmentShader);
+      m_colorFormat = other.m_colorFormat;
+      m_descriptors = std::move(other.m_descriptors);
+      m_pushConstants = std::move(other.m_pushConstants);
+      m_pipelineLayout = other.m_pipelineLayout;
+      m_renderPass = other.m_renderPass;
+      m_graphicsPipeline = other.m_graphicsPipeline;
+      other.m_renderPass = VK_NULL_HANDLE;
+      other.m_graphicsPipeline = VK_NULL_HANDLE;
+    }
+    return *this;
+  }
+
+public:
+  void feedBuffer(uint32_t set, uint32_t binding,
+                  const std::unique_ptr<Buffer> &buffer, uint32_t offset,
+                  uint32_t range) {
+    feedBuffer(set, binding, *buffer, offset, range);
+  }
+
+  void feedBuffer(uint32_t set, uint32_t binding, const Buffer &buffer,
+                  uint32_t offset, uint32_t range) {
+    NAIVE_VULKAN_TRACE("GraphicsPipeline::feedBuffer");
+    m_descriptors.feedBuffer(set, binding, buffer, offset, range);
+  }
+
+  // Storage or sampled image, in the general layout
+  void feedImage(uint32_t set, uint32_t binding, const Image &image) {
+    m_descriptors.feedImage(set, binding, image);
+  }
+
+  // Combined image sampler
+  void feedImage(uint32_t set, uint32_t binding, const Image &image,
+                 const Sampler &sampler) {
+    m_descriptors.feedImage(set, binding, image, &sampler);
+  }
+
+  void feedSampler(uint32_t set, uint32_t binding, const Sampler &sampler) {
+    m_descriptors.feedSampler(set, binding, sampler);
+  }
+
+  void feedTexelBuffer(uint32_t set, uint32_t binding,
+                       const BufferView &view) {
+    m_descriptors.feedTexelBuffer(set, binding, view);
+  }
+
+  // Recorded into every draw created afterwards, visible to both stages
+  void pushConstants(const void *data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t *>(data);
+    m_pushConstants.assign(bytes, bytes + size);
+  }
+
+  // count vertices from offset bytes into vertices
+  Draw draw(const Buffer &vertices, uint32_t count,
+            VkDeviceSize offset = 0) const {
+    Draw draw;
+    draw.pipeline = m_graphicsPipeline;
+    draw.pipelineLayout = m_pipelineLayout;
+    draw.descriptorSets = m_descriptors.sets();
+    draw.pushConstants = m_pushConstants;
+    draw.pushConstantStages =
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    draw.vertexBuffer = vertices.buf();
+    draw.vertexOffset = offset;
+    draw.count = count;
+    return draw;
+  }
+
+  // count indices of indexType
+  Draw drawIndexed(const Buffer &vertices, const Buffer &indices,
+                   uint32_t count,
+                   VkIndexType indexType = VK_INDEX_TYPE_UINT32) const {
+    Draw draw = this->draw(vertices, count);
+    draw.indexBuffer = indices.buf();
+    draw.indexType = indexType;
+    return draw;
+  }
+
+  RenderTarget makeTarget(uint32_t width, uint32_t height) const {
+    return RenderTarget(m_physicalDevice, m_device, *m_table, m_renderPass,
+                        width, height, m_colorFormat);
+  }
+
+  std::unique_ptr<RenderTarget> createTarget(uint32_t width,
+                                             uint32_t height) const {
+    return std::make_unique<RenderTarget>(makeTarget(width, height));
+  }
+
+  VkFormat colorFormat() const { return m_colorFormat; }
+
+private:
+  // Both stages see the same sets, a binding declared by either counts
+  static std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+  mergeBindings(const std::shared_ptr<Shader> &vertexShader,
+                const std::shared_ptr<Shader> &fragmentShader) {
+    auto setsBindings = vertexShader->reflection().setsBindings();
+    const auto &fragmentSets = fragmentShader->reflection().setsBindings();
+    if (setsBindings.size() < fragmentSets.size()) {
+      setsBindings.resize(fragmentSets.size());
+    }
+    for (size_t set = 0; set < fragmentSets.size(); set += 1) {
+      auto &bindings = setsBindings[set];
+      for (const auto &bind : fragmentSets[set]) {
+        if (std::find(bindings.begin(), bindings.end(), bind) ==
+            bindings.end()) {
+          bindings.push_back(bind);
+        }
+      }
+      std::sort(bindings.begin(), bindings.end());
+    }
+    return setsBindings;
+  }
+
+  static std::vector<std::map<uint32_t, uint32_t>>
+  mergeCounts(const std::shared_ptr<Shader> &vertexShader,
+              const std::shared_ptr<Shader> &fragmentShader) {
+    auto setsCounts = vertexShader->reflection().descriptorCounts();
+    const auto &fragmentCounts =
+        fragmentShader->reflection().descriptorCounts();
+    if (setsCounts.size() < fragmentCounts.size()) {
+      setsCounts.resize(fragmentCounts.size());
+    }
+    for (size_t set = 0; set < fragmentCounts.size(); set += 1) {
+      for (const auto &count : fragmentCounts[set]) {
+        auto &merged = setsCounts[set][count.first];
+        merged = std::max(merged, count.second);
+      }
+    }
+    return setsCounts;
+  }
+
+  void destroy() {
+    m_table->vkDestroyPipeline(m_device, m_graphicsPipeline, VK_NULL_HANDLE);
+    m_table->vkDestroyRenderPass(m_device, m_renderPass, VK_NULL_HANDLE);
+  }
+
+  void initRenderPass() {
+    // Cleared on load, left ready to be copied out
+    VkAttachmentDescription colorAttachment = {};
+    colorAttachment.format = m_colorFormat;
+    colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+    VkAttachmentReference colorAttachmentRef = {};
+    colorAttachmentRef.attachment = 0;
+    colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = 1;
+    subpass.pColorAttachments = &colorAttachmentRef;
+
+    // The copy of the previous use finishes before the clear, and the
+    // draws finish before the copy out
+    std::array<VkSubpassDependency, 2> dependencies = {};
+    dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[0].dstSubpass = 0;
+    dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    dependencies[0].dstStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].srcSubpass = 0;
+    dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    dependencies[1].srcStageMask =
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    VkRenderPassCreateInfo renderPassInfo = {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    renderPassInfo.attachmentCount = 1;
+    renderPassInfo.pAttachments = &colorAttachment;
+    renderPassInfo.subpassCount = 1;
+    renderPassInfo.pSubpasses = &subpass;
+    renderPassInfo.dependencyCount =
+        static_cast<uint32_t>(dependencies.size());
+    renderPassInfo.pDependencies = dependencies.data();
+
+    if (m_table->vkCreateRenderPass(m_device, &renderPassInfo, VK_NULL_HANDLE,
+                                    &m_renderPass) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create render pass!");
+    }
+  }
+
+  void initPipeline(const VkPipelineCache &pipelineCache,
+                    const VertexLayout &vertexLayout, bool blend) {
+    // Shader stages
+    std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages = {};
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].module = m_vertexShader->module();
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].module = m_fragmentShader->module();
+    shaderStages[1].pName = "main";
+
+    // Vertex input, one interleaved binding
+    VkVertexInputBindingDescription bindingDescription = {};
+    bindingDescription.binding = 0;
+    bindingDescription.stride = vertexLayout.stride;
+    bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
+    for (const auto &attribute : vertexLayout.attributes) {
+      VkVertexInputAttributeDescription attributeDescription = {};
+      attributeDescription.binding = 0;
+      attributeDescription.location = std::get<0>(attribute);
+      attributeDescription.format = std::get<1>(attribute);
+      attributeDescription.offset = std::get<2>(attribute);
+      attributeDescriptions.push_back(attributeDescription);
+    }
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
+    vertexInputInfo.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    vertexInputInfo.vertexAttributeDescriptionCount =
+        static_cast<uint32_t>(attributeDescriptions.size());
+    vertexInputInfo.pVertexAttributeDescriptions =
+        attributeDescriptions.data();
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+    inputAssembly.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    // Viewport and scissor follow the target, set at record time
+    VkPipelineViewportStateCreateInfo viewportState = {};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+
+    std::array<VkDynamicState, 2> dynamicStates = {
+        {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR}};
+    VkPipelineDynamicStateCreateInfo dynamicState = {};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount =
+        static_cast<uint32_t>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
+
+    VkPipelineRasterizationStateCreateInfo rasterizer = {};
+    rasterizer.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer.lineWidth = 1.0f;
+    rasterizer.cullMode = VK_CULL_MODE_NONE;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+    VkPipelineMultisampleStateCreateInfo multisampling = {};
+    multisampling.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    // Straight alpha over what is already there when blending
+    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+    colorBlendAttachment.colorWriteMask =
+        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+        VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = blend ? VK_TRUE : VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colorBlendAttachment.dstColorBlendFactor =
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstAlphaBlendFactor =
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colorBlending = {};
+    colorBlending.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+
+    // pipeline
+    VkGraphicsPipelineCreateInfo pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+    pipelineInfo.pStages = shaderStages.data();
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = m_pipelineLayout;
+    pipelineInfo.renderPass = m_renderPass;
+    pipelineInfo.subpass = 0;
+
+    if (m_table->vkCreateGraphicsPipelines(m_device, pipelineCache, 1,
+                                           &pipelineInfo, VK_NULL_HANDLE,
+                                           &m_graphicsPipeline) !=
+        VK_SUCCESS) {
+      throw std::runtime_error("failed to create graphics pipeline!");
+    }
+  }
+
+private:
+  VkPhysicalDevice m_physicalDevice;
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  std::shared_ptr<Shader> m_vertexShader;
+  std::shared_ptr<Shader> m_fragmentShader;
+  VkFormat m_colorFormat;
+  //
+  Descriptors m_descriptors;
+  std::vector<uint8_t> m_pushConstants;
+  //
+  VkPipelineLayout m_pipelineLayout;
+  VkRenderPass m_renderPass;
+  VkPipeline m_graphicsPipeline;
+};
+
+// A VkSurfaceKHR owned for its instance, from Instance::create*Surface()
+class Surface {
+public:
+  Surface() = delete;
+  Surface(VkInstance instance, VkSurfaceKHR surface)
+      : m_instance(instance), m_surface(surface) {}
+  Surface(const Surface &) = delete;
+  ~Surface() { vkDestroySurfaceKHR(m_instance, m_surface, VK_NULL_HANDLE); }
+
+  Surface &operator=(const Surface &) = delete;
+
+public:
+  const VkSurfaceKHR &get() const { return m_surface; }
+
+private:
+  VkInstance m_instance;
+  VkSurfaceKHR m_surface;
+};
+
+// A swapchain fed from a buffer of packed 32-bit pixels, usually what a
+// kernel just wrote. The copy into the swapchain image runs on the GPU
+// in the same command as the dispatches, the host never maps the pixels.
+// They are in the channel order of format(), R8G8B8A8 where the surface
+// offers it. The surface must outlive the presenter.
+class Presenter {
+public:
+  Presenter() = delete;
+  Presenter(VkPhysicalDevice physicalDevice, const VkDevice &device,
+            const DeviceTable &table, const VkQueue &graphicsQueue,
+            uint32_t queueFamilyIndex, const Surface &surface, uint32_t width,
+            uint32_t height)
+      : m_device(device), m_table(&table), m_graphicsQueue(graphicsQueue),
+        m_swapchain(VK_NULL_HANDLE), m_commandPool(VK_NULL_HANDLE),
+        m_frame(0) {
+    NAIVE_VULKAN_TRACE("Presenter::create");
+    if (m_table->vkCreateSwapchainKHR == nullptr) {
+      throw std::runtime_error("failed to find swapchain support on device!");
+    }
+    VkBool32 supported = VK_FALSE;
+    vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, queueFamilyIndex,
+                                         surface.get(), &supported);
+    if (!supported) {
+      throw std::runtime_error("failed to find present support on queue!");
+    }
+
+    try {
+      initSwapchain(physicalDevice, surface.get(), width, height);
+      initFrames(queueFamilyIndex);
+    } catch (...) {
+      destroy();
+      throw;
+    }
+  }
+  Presenter(const Presenter &) = delete;
+  ~Presenter() { destroy(); }
+
+  Presenter &operator=(const Presenter &) = delete;
+
+public:
+  // One command per swapchain image: the dispatches, then extent() of
+  // packed pixels from offset in pixels copied into the image. pixels
+  // needs VK_BUFFER_USAGE_TRANSFER_SRC_BIT.
+  void record(const std::vector<Dispatch> &dispatches, const Buffer &pixels,
+              VkDeviceSize offset = 0) {
+    NAIVE_VULKAN_TRACE("Presenter::record");
+    wait();
+    m_commands.clear();
+    for (VkImage image : m_images) {
+      PresentCopy copy = {pixels.buf(), offset, image, m_extent.width,
+                          m_extent.height};
+      m_commands.push_back(Command(m_device, *m_table, m_graphicsQueue,
+                                   m_commandPool, dispatches, copy));
+    }
+  }
+
+  // Runs the recorded command on the next image and queues the image
+  // for display, returns its index. Blocks only while the frame slot or
+  // the image is still in flight.
+  uint32_t present() {
+    NAIVE_VULKAN_TRACE("Presenter::present");
+    if (m_commands.empty()) {
+      throw std::runtime_error("nothing recorded to present!");
+    }
+    // the acquire semaphore of this slot is free once its submit is done
+    size_t frame = m_frame;
+    if (m_pending[frame]) {
+      m_fences[frame].wait();
+    }
+
+    uint32_t index = 0;
+    VkResult result = m_table->vkAcquireNextImageKHR(
+        m_device, m_swapchain, UINT64_MAX, m_acquired[frame], VK_NULL_HANDLE,
+        &index);
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+      throw std::runtime_error("failed to acquire swap chain image!");
+    }
+    size_t previous = m_imageFrames[index];
+    if (previous != NoFrame && previous != frame && m_pending[previous]) {
+      m_fences[previous].wait();
+    }
+
+    m_commands[index].submit(m_fences[frame], m_acquired[frame],
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             m_presentable[index]);
+    m_pending[frame] = true;
+    m_imageFrames[index] = frame;
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = &m_presentable[index];
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = &m_swapchain;
+    presentInfo.pImageIndices = &index;
+    result = m_table->vkQueuePresentKHR(m_graphicsQueue, &presentInfo);
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+      throw std::runtime_error("failed to present swap chain image!");
+    }
+    m_frame = (m_frame + 1) % m_fences.size();
+    return index;
+  }
+
+  // Blocks until every submitted frame is done
+  void wait() {
+    for (size_t i = 0; i < m_fences.size(); i += 1) {
+      if (m_pending[i]) {
+        m_fences[i].wait();
+        m_pending[i] = false;
+      }
+    }
+  }
+
+  VkFormat format() const { return m_format; }
+
+  const VkExtent2D &extent() const { return m_extent; }
+
+  size_t imageCount() const { return m_images.size(); }
+
+private:
+  static constexpr size_t NoFrame = ~size_t(0);
+
+  void initSwapchain(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface,
+                     uint32_t width, uint32_t height) {
+    // prepare
+    VkSurfaceCapabilitiesKHR capabilities;
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
+                                              &capabilities);
+    if (!(capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+      throw std::runtime_error("failed to find transfer support on surface!");
+    }
+
+    uint32_t formatCount = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface,
+                                         &formatCount, VK_NULL_HANDLE);
+    std::vector<VkSurfaceFormatKHR> formats(formatCount);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface,
+                                         &formatCount, formats.data());
+
+    uint32_t presentModeCount = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface,
+                                              &presentModeCount,
+                                              VK_NULL_HANDLE);
+    std::vector<VkPresentModeKHR> presentModes(presentModeCount);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(
+        physicalDevice, surface, &presentModeCount, presentModes.data());
+
+    // format, 32-bit pixels in kernel order first
+    VkSurfaceFormatKHR surfaceFormat = {VK_FORMAT_UNDEFINED,
+                                        VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+    if (formats.size() == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
+      surfaceFormat.format = VK_FORMAT_R8G8B8A8_UNORM;
+    }
+    for (VkFormat wanted :
+         {VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_B8G8R8A8_UNORM,
+          VK_FORMAT_R8G8B8A8_SRGB, VK_FORMAT_B8G8R8A8_SRGB}) {
+      for (const auto &available : formats) {
+        if (surfaceFormat.format == VK_FORMAT_UNDEFINED &&
+            available.format == wanted) {
+          surfaceFormat = available;
+        }
+      }
+    }
+    if (surfaceFormat.format == VK_FORMAT_UNDEFINED) {
+      throw std::runtime_error("failed to find a 32-bit surface format!");
+    }
+
+    // present mode, mailbox never blocks a frame, fifo is always there
+    VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    for (const auto &available : presentModes) {
+      if (available == VK_PRESENT_MODE_MAILBOX_KHR) {
+        presentMode = available;
+      }
+    }
+
+    // swap extent, the surface may fix it
+    m_extent = capabilities.currentExtent;
+    if (capabilities.currentExtent.width ==
+        std::numeric_limits<uint32_t>::max()) {
+      m_extent.width =
+          std::max(capabilities.minImageExtent.width,
+                   std::min(capabilities.maxImageExtent.width, width));
+      m_extent.height =
+          std::max(capabilities.minImageExtent.height,
+                   std::min(capabilities.maxImageExtent.height, height));
+    }
+
+    // image count
+    uint32_t imageCount = capabilities.minImageCount + 1;
+    if (capabilities.maxImageCount > 0 &&
+        imageCount > capabilities.maxImageCount) {
+      imageCount = capabilities.maxImageCount;
+    }
+
+    // opaque where possible, else whatever the surface takes
+    VkCompositeAlphaFlagBitsKHR compositeAlpha =
+        VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+    if (!(capabilities.supportedCompositeAlpha & compositeAlpha)) {
+      compositeAlpha = static_cast<VkCompositeAlphaFlagBitsKHR>(
+          capabilities.supportedCompositeAlpha &
+          (~capabilities.supportedCompositeAlpha + 1));
+    }
+
+    // create info
+    VkSwapchainCreateInfoKHR createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    createInfo.surface = surface;
+    createInfo.minImageCount = imageCount;
+    createInfo.imageFormat = surfaceFormat.format;
+    createInfo.imageColorSpace = surfaceFormat.colorSpace;
+    createInfo.imageExtent = m_extent;
+    createInfo.imageArrayLayers = 1;
+    createInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    createInfo.preTransform = capabilities.currentTransform;
+    createInfo.compositeAlpha = compositeAlpha;
+    createInfo.presentMode = presentMode;
+    createInfo.clipped = VK_TRUE;
+    createInfo.oldSwapchain = VK_NULL_HANDLE;
+
+    if (m_table->vkCreateSwapchainKHR(m_device, &createInfo, VK_NULL_HANDLE,
+                                      &m_swapchain) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create swap chain!");
+    }
+    m_format = surfaceFormat.format;
+
+    // images
+    m_table->vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount,
+                                     VK_NULL_HANDLE);
+    m_images.resize(imageCount);
+    m_table->vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount,
+                                     m_images.data());
+  }
+
+  // As many frames in flight as images, each with its own semaphores
+  void initFrames(uint32_t queueFamilyIndex) {
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = queueFamilyIndex;
+    if (m_table->vkCreateCommandPool(m_device, &poolInfo, VK_NULL_HANDLE,
+                                     &m_commandPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create command pool!");
+    }
+
+    VkSemaphoreCreateInfo semaphoreInfo = {};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    for (size_t i = 0; i < m_images.size(); i += 1) {
+      for (auto *semaphores : {&m_acquired, &m_presentable}) {
+        VkSemaphore semaphore;
+        if (m_table->vkCreateSemaphore(m_device, &semaphoreInfo,
+                                       VK_NULL_HANDLE,
+                                       &semaphore) != VK_SUCCESS) {
+          throw std::runtime_error("failed to create semaphore!");
         }
+        semaphores->push_back(semaphore);
       }
+      m_fences.push_back(Fence(m_device, *m_table));
     }
+    m_pending.assign(m_images.size(), false);
+    m_imageFrames.assign(m_images.size(), size_t(NoFrame));
+  }
 
-    // filter
-    std::vector<VkDescriptorPoolSize> temp;
-    for (const auto &x : descriptorPoolSizes) {
-      if (x.descriptorCount != 0) {
-        temp.push_back(x);
+  void destroy() {
+    // the presentation engine may still wait on the semaphores
+    m_table->vkQueueWaitIdle(m_graphicsQueue);
+    m_commands.clear();
+    m_fences.clear();
+    for (auto *semaphores : {&m_acquired, &m_presentable}) {
+      for (VkSemaphore semaphore : *semaphores) {
+        m_table->vkDestroySemaphore(m_device, semaphore, VK_NULL_HANDLE);
       }
+      semaphores->clear();
     }
-    descriptorPoolSizes = temp;
+    m_table->vkDestroyCommandPool(m_device, m_commandPool, VK_NULL_HANDLE);
+    if (m_swapchain != VK_NULL_HANDLE) {
+      m_table->vkDestroySwapchainKHR(m_device, m_swapchain, VK_NULL_HANDLE);
+    }
+  }
 
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
-    descriptorPoolCreateInfo.sType =
-        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descriptorPoolCreateInfo.maxSets =
-        static_cast<uint32_t>(setsBindings.size());
-    descriptorPoolCreateInfo.poolSizeCount =
-        static_cast<uint32_t>(descriptorPoolSizes.size());
-    descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes.data();
-    descriptorPoolCreateInfo.flags =
-        VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+private:
+  VkDevice m_device;
+  const DeviceTable *m_table;
+  VkQueue m_graphicsQueue;
+  VkSwapchainKHR m_swapchain;
+  VkFormat m_format;
+  VkExtent2D m_extent;
+  std::vector<VkImage> m_images;
+  //
+  VkCommandPool m_commandPool;
+  std::vector<Command> m_commands; // one per image
+  // one per frame slot
+  std::vector<VkSemaphore> m_acquired;
+  std::vector<Fence> m_fences;
+  std::vector<bool> m_pending;
+  // one per image
+  std::vector<VkSemaphore> m_presentable;
+  std::vector<size_t> m_imageFrames; // slot that last submitted it
+  size_t m_frame;
+};
 
-    if (vkCreateDescriptorPool(m_device, &descriptorPoolCreateInfo,
-                               VK_NULL_HANDLE,
-                               &m_descriptorPool) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create descriptor pool!");
+// Wall time of each bring-up phase, in the order they ran
+struct StartupTimes {
+  std::vector<std::pair<std::string, double>> phases; // name, microseconds
+
+  // Records the time since begin under name and restarts begin
+  void record(const std::string &name,
+              std::chrono::steady_clock::time_point &begin) {
+    auto now = std::chrono::steady_clock::now();
+    phases.emplace_back(
+        name, std::chrono::duration<double, std::micro>(now - begin).count());
+    begin = now;
+  }
+
+  void append(const StartupTimes &other) {
+    phases.insert(phases.end(), other.phases.begin(), other.phases.end());
+  }
+
+  double total() const {
+    double sum = 0.0;
+    for (const auto &phase : phases) {
+      sum += phase.second;
     }
+    return sum;
+  }
+};
+
+// Negotiated with the device at creation, kernels pick variants by it.
+// Everything is off or 0 where the API version or extension is missing.
+struct Capabilities {
+  uint32_t apiVersion = VK_API_VERSION_1_0; // min of instance and device
+  // Vulkan 1.1 subgroups, operations are VkSubgroupFeatureFlagBits
+  uint32_t subgroupSize = 0;
+  VkShaderStageFlags subgroupStages = 0;
+  VkFlags subgroupOperations = 0;
+  // VK_EXT_subgroup_size_control
+  bool subgroupSizeControl = false;
+  bool computeFullSubgroups = false;
+  uint32_t minSubgroupSize = 0;
+  uint32_t maxSubgroupSize = 0;
+  VkShaderStageFlags requiredSubgroupSizeStages = 0;
+  // arithmetic and storage types, on 1.1 the 8-bit storage and
+  // float16/int8 arithmetic come from their KHR extensions
+  bool shaderInt64 = false;
+  bool shaderInt16 = false;
+  bool shaderFloat64 = false;
+  bool shaderFloat16 = false;
+  bool shaderInt8 = false;
+  bool storageBuffer16BitAccess = false;
+  bool storageBuffer8BitAccess = false;
+  // VK_KHR_swapchain, for Presenter
+  bool swapchain = false;
+  // VK_EXT_external_memory_host, for buffers over host memory
+  bool externalMemoryHost = false;
+  VkDeviceSize minImportedHostPointerAlignment = 0;
+  // out of bounds buffer accesses stay inside the buffer; every device
+  // has it but it costs bounds checks, so it is left to the caller
+  bool robustBufferAccess = false;
+  // device extensions the above need
+  std::vector<const char *> extensions;
+
+  // Every operation of operations in every stage of stages
+  bool subgroups(VkFlags operations,
+                 VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT) const {
+    return subgroupSize != 0 &&
+           (subgroupOperations & operations) == operations &&
+           (subgroupStages & stages) == stages;
+  }
+};
+
+class Device {
+public:
+  Device() = delete;
+  Device(VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex,
+         const Capabilities &capabilities = Capabilities())
+      : m_physicalDevice(physicalDevice), m_queueFamilyIndex(queueFamilyIndex),
+        m_queueFlags(0), m_capabilities(capabilities) {
+    NAIVE_VULKAN_TRACE("Device::create");
+    auto begin = std::chrono::steady_clock::now();
+    // Specifying the queues to be created
+    VkDeviceQueueCreateInfo queueCreateInfo = {};
+    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = m_queueFamilyIndex;
+    float queuePriority = 1.0f;
+    queueCreateInfo.queueCount = 1;
+    queueCreateInfo.pQueuePriorities = &queuePriority;
 
-    // Sets binding layout
-    for (const auto &bindings : setsBindings) {
-      std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings;
+    // Specifying used device features, only what capabilities offers
+    VkPhysicalDeviceFeatures deviceFeatures = {};
+    deviceFeatures.robustBufferAccess = m_capabilities.robustBufferAccess;
+    deviceFeatures.shaderInt64 = m_capabilities.shaderInt64;
+    deviceFeatures.shaderInt16 = m_capabilities.shaderInt16;
+    deviceFeatures.shaderFloat64 = m_capabilities.shaderFloat64;
+    void *next = VK_NULL_HANDLE;
 
-      for (const auto &bind : bindings) {
-        VkDescriptorSetLayoutBinding setLayoutBinding = {};
-        std::tie(setLayoutBinding.binding, setLayoutBinding.descriptorType) =
-            bind;
-        setLayoutBinding.descriptorCount = 1;
-        setLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-        setLayoutBindings.push_back(setLayoutBinding);
+#ifdef VK_VERSION_1_2
+    VkPhysicalDeviceVulkan11Features vulkan11Features = {};
+    vulkan11Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    if (m_capabilities.apiVersion >= VK_API_VERSION_1_2) {
+      vulkan11Features.storageBuffer16BitAccess =
+          m_capabilities.storageBuffer16BitAccess;
+      vulkan12Features.shaderFloat16 = m_capabilities.shaderFloat16;
+      vulkan12Features.shaderInt8 = m_capabilities.shaderInt8;
+      vulkan12Features.storageBuffer8BitAccess =
+          m_capabilities.storageBuffer8BitAccess;
+      vulkan12Features.pNext = next;
+      vulkan11Features.pNext = &vulkan12Features;
+      next = &vulkan11Features;
+    }
+#endif
+#ifdef VK_VERSION_1_1
+    VkPhysicalDevice16BitStorageFeatures storage16Features = {};
+    storage16Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+    if (m_capabilities.apiVersion >= VK_API_VERSION_1_1 &&
+        m_capabilities.apiVersion < VK_API_VERSION_1_2) {
+      storage16Features.storageBuffer16BitAccess =
+          m_capabilities.storageBuffer16BitAccess;
+      storage16Features.pNext = next;
+      next = &storage16Features;
+    }
+#endif
+#ifdef VK_VERSION_1_2
+    // the same structures as VK_KHR_8bit_storage and VK_KHR_shader_float16_int8
+    VkPhysicalDevice8BitStorageFeatures storage8Features = {};
+    storage8Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES;
+    VkPhysicalDeviceShaderFloat16Int8Features float16Int8Features = {};
+    float16Int8Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES;
+    if (m_capabilities.apiVersion < VK_API_VERSION_1_2) {
+      if (m_capabilities.storageBuffer8BitAccess) {
+        storage8Features.storageBuffer8BitAccess = VK_TRUE;
+        storage8Features.pNext = next;
+        next = &storage8Features;
       }
+      if (m_capabilities.shaderFloat16 || m_capabilities.shaderInt8) {
+        float16Int8Features.shaderFloat16 = m_capabilities.shaderFloat16;
+        float16Int8Features.shaderInt8 = m_capabilities.shaderInt8;
+        float16Int8Features.pNext = next;
+        next = &float16Int8Features;
+      }
+    }
+#endif
+#ifdef VK_EXT_subgroup_size_control
+    VkPhysicalDeviceSubgroupSizeControlFeaturesEXT sizeControlFeatures = {};
+    sizeControlFeatures.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_SIZE_CONTROL_FEATURES_EXT;
+    if (m_capabilities.subgroupSizeControl) {
+      sizeControlFeatures.subgroupSizeControl = VK_TRUE;
+      sizeControlFeatures.computeFullSubgroups =
+          m_capabilities.computeFullSubgroups;
+      sizeControlFeatures.pNext = next;
+      next = &sizeControlFeatures;
+    }
+#endif
+
+    // Infomation of layers and extensions
+    VkDeviceCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pNext = next;
+    createInfo.pQueueCreateInfos = &queueCreateInfo;
+    createInfo.queueCreateInfoCount = 1;
+    createInfo.pEnabledFeatures = &deviceFeatures;
+    createInfo.enabledExtensionCount =
+        static_cast<uint32_t>(m_capabilities.extensions.size());
+    createInfo.ppEnabledExtensionNames = m_capabilities.extensions.data();
+    createInfo.enabledLayerCount = 0;
+
+    // create device
+    if (vkCreateDevice(m_physicalDevice, &createInfo, VK_NULL_HANDLE,
+                       &m_device) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create logical device!");
+    }
+    m_table.load(m_device);
+    if (m_capabilities.swapchain) {
+      m_table.loadSwapchain(m_device);
+    }
+#ifdef VK_EXT_external_memory_host
+    if (m_capabilities.externalMemoryHost) {
+      m_table.loadExternalMemoryHost(m_device);
+    }
+#endif
+    m_startup.record("vkCreateDevice", begin);
+
+    // get graphic queue
+    m_table.vkGetDeviceQueue(m_device, m_queueFamilyIndex, 0, &m_graphicsQueue);
 
-      VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
-      descriptorSetLayoutCreateInfo.sType =
-          VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-      descriptorSetLayoutCreateInfo.bindingCount =
-          static_cast<uint32_t>(setLayoutBindings.size());
-      descriptorSetLayoutCreateInfo.pBindings = setLayoutBindings.data();
+    m_layoutCache = std::make_unique<LayoutCache>(m_device, m_table);
+    m_shaderCache = std::make_unique<ShaderCache>(m_device, m_table);
 
-      VkDescriptorSetLayout descriptorSetLayout;
-      if (vkCreateDescriptorSetLayout(m_device, &descriptorSetLayoutCreateInfo,
+    // shared by all pipelines, safe to use from several threads
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
+    pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if (m_table.vkCreatePipelineCache(m_device, &pipelineCacheCreateInfo,
                                       VK_NULL_HANDLE,
-                                      &descriptorSetLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create descriptor!");
+                                      &m_pipelineCache) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create pipeline cache!");
+    }
+
+    // for commands chaining several pipelines
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+
+    if (m_table.vkCreateCommandPool(m_device, &poolInfo, VK_NULL_HANDLE,
+                                    &m_commandPool) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create command pool!");
+    }
+
+    // timestamps, when the queue family supports them
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice,
+                                             &queueFamilyCount, VK_NULL_HANDLE);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        m_physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &deviceProperties);
+
+    m_queueFlags = queueFamilies[m_queueFamilyIndex].queueFlags;
+    uint32_t timestampValidBits =
+        queueFamilies[m_queueFamilyIndex].timestampValidBits;
+    if (timestampValidBits != 0) {
+      m_queryPool = std::make_unique<QueryPool>(
+          m_device, m_table, deviceProperties.limits.timestampPeriod,
+          timestampValidBits);
+    }
+    m_startup.record("device objects", begin);
+  }
+  ~Device() {
+    m_workers.reset();
+    m_queryPool.reset();
+    m_table.vkDestroyCommandPool(m_device, m_commandPool, VK_NULL_HANDLE);
+    m_table.vkDestroyPipelineCache(m_device, m_pipelineCache, VK_NULL_HANDLE);
+    m_shaderCache.reset();
+    m_layoutCache.reset();
+    m_table.vkDestroyDevice(m_device, VK_NULL_HANDLE);
+  }
+
+public:
+  // make*() return the objects by value, to keep in containers or
+  // members, create*() the same on the heap
+  Buffer makeBuffer(uint32_t size, VkBufferUsageFlags usage,
+                    VkMemoryPropertyFlags properties) const {
+    return Buffer(m_physicalDevice, m_device, m_table, size, usage,
+                  properties);
+  }
+
+  std::unique_ptr<Buffer> createBuffer(uint32_t size, VkBufferUsageFlags usage,
+                                       VkMemoryPropertyFlags properties) const {
+    return std::make_unique<Buffer>(makeBuffer(size, usage, properties));
+  }
+
+  // Memory type ranked for what the host does with it, e.g. Readback
+  // for buffers dumped every frame
+  Buffer makeBuffer(uint32_t size, VkBufferUsageFlags usage,
+                    MemoryIntent intent) const {
+    return Buffer(m_physicalDevice, m_device, m_table, size, usage, intent);
+  }
+
+  std::unique_ptr<Buffer> createBuffer(uint32_t size, VkBufferUsageFlags usage,
+                                       MemoryIntent intent) const {
+    return std::make_unique<Buffer>(makeBuffer(size, usage, intent));
+  }
+
+#if defined(VK_VERSION_1_1) && defined(VK_EXT_external_memory_host)
+  // The device works on size bytes at host in place, see
+  // Capabilities::minImportedHostPointerAlignment. Throws when the driver
+  // offers no coherent memory type for it.
+  Buffer importBuffer(void *host, uint32_t size,
+                      VkBufferUsageFlags usage) const {
+    if (!m_capabilities.externalMemoryHost) {
+      throw std::runtime_error("failed to find external memory host support!");
+    }
+    VkDeviceSize alignment = m_capabilities.minImportedHostPointerAlignment;
+    if (reinterpret_cast<uintptr_t>(host) % alignment != 0 ||
+        size % alignment != 0) {
+      throw std::runtime_error("host memory is not aligned for import!");
+    }
+    return Buffer(m_physicalDevice, m_device, m_table, host, size, usage);
+  }
+#endif
+
+  // Unsignaled, for Command::submit(Fence &)
+  Fence makeFence() const { return Fence(m_device, m_table); }
+
+  // count elements of T, 8- and 16-bit elements in storage buffers need
+  // the matching storage capability; memory is property flags or an intent
+  template <typename T, typename Memory = VkMemoryPropertyFlags>
+  std::unique_ptr<Buffer> createArray(uint32_t count, VkBufferUsageFlags usage,
+                                      Memory memory) const {
+    static_assert(sizeof(T) == 1 || sizeof(T) % 2 == 0,
+                  "elements of 8, 16 or more bits only");
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+      if (sizeof(T) == 1 && !m_capabilities.storageBuffer8BitAccess) {
+        throw std::runtime_error("failed to find 8-bit storage on device!");
+      }
+      if (sizeof(T) == 2 && !m_capabilities.storageBuffer16BitAccess) {
+        throw std::runtime_error("failed to find 16-bit storage on device!");
       }
-      m_descriptorSetLayouts.push_back(descriptorSetLayout);
     }
+    return createBuffer(count * sizeof(T), usage, memory);
+  }
 
-    // Descriptor
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {};
-    descriptorSetAllocateInfo.sType =
-        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.descriptorPool = m_descriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount =
-        static_cast<uint32_t>(m_descriptorSetLayouts.size());
-    descriptorSetAllocateInfo.pSetLayouts = m_descriptorSetLayouts.data();
+  std::shared_ptr<Shader> createShader(const void *spvCode, size_t spvSize,
+                                       VkShaderStageFlagBits shaderStage) const {
+    return m_shaderCache->get(spvCode, spvSize, shaderStage);
+  }
 
-    m_descriptorSets.resize(m_descriptorSetLayouts.size());
-    if (vkAllocateDescriptorSets(m_device, &descriptorSetAllocateInfo,
-                                 m_descriptorSets.data()) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create descriptor pool!");
+  std::shared_ptr<Shader>
+  createShader(const std::vector<uint8_t> &spvByteCode,
+               VkShaderStageFlagBits shaderStage) const {
+    return createShader(spvByteCode.data(), spvByteCode.size(), shaderStage);
+  }
+
+  std::shared_ptr<Shader>
+  createShader(const std::string &shaderPath,
+               VkShaderStageFlagBits shaderStage) const {
+#if defined(__unix__) || defined(__APPLE__)
+    // Map the file, the driver copies the code during module creation
+    int fd = open(shaderPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("failed to open file!");
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+      close(fd);
+      throw std::runtime_error("failed to open file!");
+    }
+    size_t fileSize = static_cast<size_t>(fileStat.st_size);
+    void *fileData = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (fileData == MAP_FAILED) {
+      throw std::runtime_error("failed to map file!");
+    }
+
+    try {
+      auto shader = this->createShader(fileData, fileSize, shaderStage);
+      munmap(fileData, fileSize);
+      return shader;
+    } catch (...) {
+      munmap(fileData, fileSize);
+      throw;
     }
+#else
+    std::fstream file(shaderPath, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("failed to open file!");
+    }
+
+    file.seekg(0, std::ios_base::end);
+    size_t fileSize = (size_t)file.tellg();
+    std::vector<uint32_t> fileBuffer((fileSize + 3) / sizeof(uint32_t));
+
+    file.seekg(0, std::ios_base::beg);
+    file.read(reinterpret_cast<char *>(fileBuffer.data()), fileSize);
+
+    file.close();
+
+    return this->createShader(fileBuffer.data(), fileSize, shaderStage);
+#endif
   }
 
-  void initPipeline(const std::unique_ptr<Shader> &shader) {
-    // Shader stages
-    VkPipelineShaderStageCreateInfo compShaderStageInfo = {};
-    compShaderStageInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    compShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    compShaderStageInfo.module = shader->module();
-    compShaderStageInfo.pName = "main";
+  ComputePipeline makeComputePipeline(
+      const std::shared_ptr<Shader> &shader,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization =
+          {}) const {
+    return ComputePipeline(m_device, m_table, m_queueFamilyIndex,
+                           m_graphicsQueue, *m_layoutCache, m_pipelineCache,
+                           shader, setsBindings, specialization);
+  }
+
+  ComputePipeline
+  makeComputePipeline(const std::shared_ptr<Shader> &shader) const {
+    return makeComputePipeline(shader, shader->reflection().setsBindings());
+  }
+
+  std::unique_ptr<ComputePipeline> createComputePipeline(
+      const std::shared_ptr<Shader> &shader,
+      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
+          &setsBindings,
+      const std::vector<std::tuple<uint32_t, uint32_t>> &specialization =
+          {}) const {
+    return std::make_unique<ComputePipeline>(
+        makeComputePipeline(shader, setsBindings, specialization));
+  }
+
+  // Bindings and push constant size are reflected from the shader
+  std::unique_ptr<ComputePipeline>
+  createComputePipeline(const std::shared_ptr<Shader> &shader) const {
+    return createComputePipeline(shader, shader->reflection().setsBindings());
+  }
 
-    // Pipeline layout
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
-    pipelineLayoutCreateInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutCreateInfo.setLayoutCount =
-        static_cast<uint32_t>(m_descriptorSetLayouts.size());
-    pipelineLayoutCreateInfo.pSetLayouts = m_descriptorSetLayouts.data();
+  // One task per pipeline on the device worker pool, futures are in order
+  std::vector<std::future<std::unique_ptr<ComputePipeline>>>
+  createComputePipelinesAsync(
+      const std::vector<std::shared_ptr<Shader>> &shaders) const {
+    std::call_once(m_workersOnce, [this]() {
+      m_workers = std::make_unique<ThreadPool>(
+          std::max(std::thread::hardware_concurrency(), 1u));
+    });
 
-    if (vkCreatePipelineLayout(m_device, &pipelineLayoutCreateInfo,
-                               VK_NULL_HANDLE,
-                               &m_pipelineLayout) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create pipeline layout!");
+    std::vector<std::future<std::unique_ptr<ComputePipeline>>> pipelines;
+    for (const auto &shader : shaders) {
+      pipelines.push_back(m_workers->submit(
+          [this, shader]() { return createComputePipeline(shader); }));
     }
+    return pipelines;
+  }
 
-    // pipeline
-    VkComputePipelineCreateInfo pipelineCreateInfo = {};
-    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    pipelineCreateInfo.stage = compShaderStageInfo;
-    pipelineCreateInfo.layout = m_pipelineLayout;
-
-    if (vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1,
-                                 &pipelineCreateInfo, VK_NULL_HANDLE,
-                                 &m_computePipeline) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create compute pipeline!");
+  // Dispatches run in order, each with its own GPU time when profiled
+  Command makeCommand(const std::vector<Dispatch> &dispatches,
+                      bool profile = false) const {
+    if (profile && m_queryPool == nullptr) {
+      throw std::runtime_error("timestamps not supported by queue!");
     }
+    return Command(m_device, m_table, m_graphicsQueue, m_commandPool,
+                   dispatches, profile ? m_queryPool.get() : nullptr);
   }
 
-  void initCommandPool() {
-    VkCommandPoolCreateInfo poolInfo = {};
-    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+  std::unique_ptr<Command> createCommand(const std::vector<Dispatch> &dispatches,
+                                         bool profile = false) const {
+    return std::make_unique<Command>(makeCommand(dispatches, profile));
+  }
 
-    if (vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool) !=
-        VK_SUCCESS) {
-      throw std::runtime_error("failed to create command pool!");
-    }
+  // Images filled from buffers before the dispatches and copied out
+  // after, from Image::copy(); the copies out are visible to the host
+  // once the fence signals
+  Command makeCommand(const std::vector<ImageCopy> &uploads,
+                      const std::vector<Dispatch> &dispatches,
+                      const std::vector<ImageCopy> &downloads) const {
+    return Command(m_device, m_table, m_graphicsQueue, m_commandPool, uploads,
+                   dispatches, downloads);
   }
 
-private:
-  const VkDevice &m_device;
-  uint32_t m_queueFamilyIndex;
-  const VkQueue &m_graphicsQueue;
-  //
-  VkDescriptorPool m_descriptorPool;
-  std::vector<VkDescriptorSetLayout> m_descriptorSetLayouts;
-  std::vector<VkDescriptorSet> m_descriptorSets;
-  //
-  VkPipelineLayout m_pipelineLayout;
-  VkPipeline m_computePipeline;
-  //
-  VkCommandPool m_commandPool;
-};
+  std::unique_ptr<Command>
+  createCommand(const std::vector<ImageCopy> &uploads,
+                const std::vector<Dispatch> &dispatches,
+                const std::vector<ImageCopy> &downloads) const {
+    return std::make_unique<Command>(
+        makeCommand(uploads, dispatches, downloads));
+  }
 
-class Device {
-public:
-  Device() = delete;
-  Device(VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex)
-      : m_physicalDevice(physicalDevice), m_queueFamilyIndex(queueFamilyIndex) {
-    // Specifying the queues to be created
-    VkDeviceQueueCreateInfo queueCreateInfo = {};
-    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfo.queueFamilyIndex = m_queueFamilyIndex;
-    float queuePriority = 1.0f;
-    queueCreateInfo.queueCount = 1;
-    queueCreateInfo.pQueuePriorities = &queuePriority;
+  // Optimal tiling, in the general layout for kernels and copies. Add
+  // the transfer usages to copy pixels in or out.
+  Image makeImage(uint32_t width, uint32_t height, VkFormat format,
+                  VkImageUsageFlags usage) const {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(m_physicalDevice, format,
+                                        &formatProperties);
+    VkFormatFeatureFlags features = formatProperties.optimalTilingFeatures;
+    if ((usage & VK_IMAGE_USAGE_STORAGE_BIT) &&
+        !(features & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+      throw std::runtime_error("failed to find storage image support!");
+    }
+    if ((usage & VK_IMAGE_USAGE_SAMPLED_BIT) &&
+        !(features & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+      throw std::runtime_error("failed to find sampled image support!");
+    }
+    Image image(m_physicalDevice, m_device, m_table, width, height, format,
+                usage);
+    initLayout(image);
+    return image;
+  }
 
-    // Specifying used device features
-    VkPhysicalDeviceFeatures deviceFeatures = {};
+  std::unique_ptr<Image> createImage(uint32_t width, uint32_t height,
+                                     VkFormat format,
+                                     VkImageUsageFlags usage) const {
+    return std::make_unique<Image>(makeImage(width, height, format, usage));
+  }
 
-    // Infomation of layers and extensions
-    VkDeviceCreateInfo createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    createInfo.pQueueCreateInfos = &queueCreateInfo;
-    createInfo.queueCreateInfoCount = 1;
-    createInfo.pEnabledFeatures = &deviceFeatures;
-    createInfo.enabledExtensionCount = 0;
-    createInfo.enabledLayerCount = 0;
+  Sampler makeSampler(
+      VkFilter filter = VK_FILTER_LINEAR,
+      VkSamplerAddressMode addressMode =
+          VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE) const {
+    return Sampler(m_device, m_table, filter, addressMode);
+  }
 
-    // create device
-    if (vkCreateDevice(m_physicalDevice, &createInfo, VK_NULL_HANDLE,
-                       &m_device) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create logical device!");
+  std::unique_ptr<Sampler> createSampler(
+      VkFilter filter = VK_FILTER_LINEAR,
+      VkSamplerAddressMode addressMode =
+          VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE) const {
+    return std::make_unique<Sampler>(makeSampler(filter, addressMode));
+  }
+
+  // buffer needs VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT or
+  // VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT
+  BufferView makeBufferView(const Buffer &buffer, VkFormat format,
+                            VkDeviceSize offset = 0,
+                            VkDeviceSize range = VK_WHOLE_SIZE) const {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(m_physicalDevice, format,
+                                        &formatProperties);
+    if (!(formatProperties.bufferFeatures &
+          (VK_FORMAT_FEATURE_UNIFORM_TEXEL_BUFFER_BIT |
+           VK_FORMAT_FEATURE_STORAGE_TEXEL_BUFFER_BIT))) {
+      throw std::runtime_error("failed to find texel buffer support!");
     }
+    return BufferView(m_device, m_table, buffer, format, offset, range);
+  }
 
-    // get graphic queue
-    vkGetDeviceQueue(m_device, 0, 0, &m_graphicsQueue);
+  std::unique_ptr<BufferView>
+  createBufferView(const Buffer &buffer, VkFormat format,
+                   VkDeviceSize offset = 0,
+                   VkDeviceSize range = VK_WHOLE_SIZE) const {
+    return std::make_unique<BufferView>(
+        makeBufferView(buffer, format, offset, range));
   }
-  ~Device() { vkDestroyDevice(m_device, VK_NULL_HANDLE); }
 
-public:
-  std::unique_ptr<Buffer> createBuffer(uint32_t size, VkBufferUsageFlags usage,
-                                       VkMemoryPropertyFlags properties) const {
-    return std::make_unique<Buffer>(m_physicalDevice, m_device, size, usage,
-                                    properties);
+  // Offscreen only, the queue needs graphics but no surface
+  GraphicsPipeline
+  makeGraphicsPipeline(const std::shared_ptr<Shader> &vertexShader,
+                       const std::shared_ptr<Shader> &fragmentShader,
+                       const VertexLayout &vertexLayout,
+                       VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM,
+                       bool blend = false) const {
+    if (!(m_queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+      throw std::runtime_error("failed to find graphics support on queue!");
+    }
+    return GraphicsPipeline(m_physicalDevice, m_device, m_table,
+                            *m_layoutCache, m_pipelineCache, vertexShader,
+                            fragmentShader, vertexLayout, colorFormat, blend);
   }
 
-  std::unique_ptr<Shader>
-  createShader(const std::vector<uint8_t> &spvByteCode,
-               VkShaderStageFlagBits shaderStage) const {
-    return std::make_unique<Shader>(m_device, spvByteCode, shaderStage);
+  std::unique_ptr<GraphicsPipeline>
+  createGraphicsPipeline(const std::shared_ptr<Shader> &vertexShader,
+                         const std::shared_ptr<Shader> &fragmentShader,
+                         const VertexLayout &vertexLayout,
+                         VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM,
+                         bool blend = false) const {
+    return std::make_unique<GraphicsPipeline>(makeGraphicsPipeline(
+        vertexShader, fragmentShader, vertexLayout, colorFormat, blend));
   }
 
-  std::unique_ptr<Shader>
-  createShader(const std::string &shaderPath,
-               VkShaderStageFlagBits shaderStage) const {
-    auto readBinaryFile =
-        [](const std::string &filePath) -> std::vector<uint8_t> {
-      std::fstream file(filePath, std::ios::in | std::ios::binary);
-      if (!file.is_open()) {
-        throw std::runtime_error("failed to open file!");
-      }
+  // Passes run in order, the readbacks are complete when the fence signals
+  Command makeRenderCommand(const std::vector<Pass> &passes) const {
+    return Command(m_device, m_table, m_graphicsQueue, m_commandPool, passes);
+  }
 
-      file.seekg(0, std::ios_base::end);
-      size_t fileSize = (size_t)file.tellg();
-      std::vector<uint8_t> fileBuffer(fileSize);
+  std::unique_ptr<Command>
+  createRenderCommand(const std::vector<Pass> &passes) const {
+    return std::make_unique<Command>(makeRenderCommand(passes));
+  }
 
-      file.seekg(0, std::ios_base::beg);
-      file.read(reinterpret_cast<char *>(fileBuffer.data()), fileSize);
+  // Swapchain on surface, width and height unless the surface decides
+  std::unique_ptr<Presenter> createPresenter(const Surface &surface,
+                                             uint32_t width,
+                                             uint32_t height) const {
+    return std::make_unique<Presenter>(m_physicalDevice, m_device, m_table,
+                                       m_graphicsQueue, m_queueFamilyIndex,
+                                       surface, width, height);
+  }
 
-      file.close();
+  const LayoutCache &layoutCache() const { return *m_layoutCache; }
 
-      return fileBuffer;
-    };
-    std::vector<uint8_t> spvByteCode = readBinaryFile(shaderPath);
-    return this->createShader(spvByteCode, shaderStage);
-  }
+  const ShaderCache &shaderCache() const { return *m_shaderCache; }
 
-  std::unique_ptr<ComputePipeline> createComputePipeline(
-      const std::unique_ptr<Shader> &shader,
-      const std::vector<std::vector<std::tuple<uint32_t, VkDescriptorType>>>
-          &setsBindings) const {
-    return std::make_unique<ComputePipeline>(
-        m_device, m_queueFamilyIndex, m_graphicsQueue, shader, setsBindings);
+  std::string name() const {
+    VkPhysicalDeviceProperties deviceProperties = {};
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &deviceProperties);
+    return deviceProperties.deviceName;
   }
 
+  // What the device was created with
+  const Capabilities &capabilities() const { return m_capabilities; }
+
+  const StartupTimes &startupTimes() const { return m_startup; }
+
+  // Entry points of this device, for calls the wrapper does not make
+  const DeviceTable &table() const { return m_table; }
+
 private:
+  // One submit, waited for, leaves a new image in the general layout
+  void initLayout(const Image &image) const {
+    VkCommandBufferAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocateInfo.commandPool = m_commandPool;
+    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocateInfo.commandBufferCount = 1;
+    VkCommandBuffer commandBuffer;
+    if (m_table.vkAllocateCommandBuffers(m_device, &allocateInfo,
+                                         &commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate command buffers!");
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    m_table.vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    VkImageMemoryBarrier imageBarrier = {};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+        VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = image.get();
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.layerCount = 1;
+    m_table.vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, VK_NULL_HANDLE, 0,
+        VK_NULL_HANDLE, 1, &imageBarrier);
+    VkResult result = m_table.vkEndCommandBuffer(commandBuffer);
+
+    Fence fence(m_device, m_table);
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    if (result == VK_SUCCESS) {
+      result = m_table.vkQueueSubmit(m_graphicsQueue, 1, &submitInfo,
+                                     fence.get());
+    }
+    if (result == VK_SUCCESS) {
+      fence.wait();
+    }
+    m_table.vkFreeCommandBuffers(m_device, m_commandPool, 1, &commandBuffer);
+    if (result != VK_SUCCESS) {
+      throw std::runtime_error("failed to initialize image layout!");
+    }
+  }
+
   VkPhysicalDevice m_physicalDevice;
   uint32_t m_queueFamilyIndex;
+  VkQueueFlags m_queueFlags;
+  Capabilities m_capabilities;
+  StartupTimes m_startup;
   VkDevice m_device;
+  DeviceTable m_table;
   VkQueue m_graphicsQueue;
+  std::unique_ptr<LayoutCache> m_layoutCache;
+  std::unique_ptr<ShaderCache> m_shaderCache;
+  VkPipelineCache m_pipelineCache;
+  VkCommandPool m_commandPool;
+  std::unique_ptr<QueryPool> m_queryPool;
+  mutable std::once_flag m_workersOnce;
+  mutable std::unique_ptr<ThreadPool> m_workers;
+};
+
+// What device selection knows about a physical device
+struct PhysicalDeviceInfo {
+  VkPhysicalDevice device;
+  uint32_t queueFamilyIndex;
+  uint32_t queueCount;
+  VkPhysicalDeviceProperties properties;
+  VkPhysicalDeviceFeatures features;
+  uint64_t deviceLocalHeap; // largest device-local heap in bytes
+  uint32_t subgroupSize;    // 0 before Vulkan 1.1
+  // deviceUUID since Vulkan 1.1, pipelineCacheUUID before
+  std::array<uint8_t, VK_UUID_SIZE> deviceUuid;
+  Capabilities capabilities; // everything the device offers
+  int64_t score;
+
+  std::string name() const { return properties.deviceName; }
+
+  // Lower case hex without dashes
+  std::string uuid() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    for (uint8_t byte : deviceUuid) {
+      text += digits[byte >> 4];
+      text += digits[byte & 0xF];
+    }
+    return text;
+  }
 };
 
+inline bool hasExtension(const std::vector<VkExtensionProperties> &extensions,
+                         const char *name) {
+  for (const auto &extension : extensions) {
+    if (std::strcmp(extension.extensionName, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Validation is off in release builds and on Android, and
+// NAIVE_VULKAN_VALIDATION=1 or 0 turns it on or off anywhere. Layers and
+// extensions the loader doesn't offer are left out.
 struct Config {
-#ifdef __ANDROID__
-  const bool enableValidationLayers = false;
+#if defined(NDEBUG) || defined(__ANDROID__)
+  bool enableValidationLayers = false;
 #else
-  const bool enableValidationLayers = true;
+  bool enableValidationLayers = true;
 #endif
 
   const std::vector<const char *> deviceExtensions = {
       VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 
-  std::vector<const char *> getRequiredExtensions() {
+  bool validationEnabled() const {
+    const char *environment = std::getenv("NAIVE_VULKAN_VALIDATION");
+    if (environment != nullptr && environment[0] != '\0') {
+      return environment[0] != '0';
+    }
+    return enableValidationLayers;
+  }
+
+  std::vector<const char *> getRequiredExtensions(
+      const std::vector<const char *> &layers) const {
     std::vector<const char *> extensions;
+    auto available = instanceExtensions(VK_NULL_HANDLE);
 
-    if (enableValidationLayers) {
+    // debug utils usually comes with the validation layer
+    if (validationEnabled() &&
+        (hasExtension(available, VK_EXT_DEBUG_UTILS_EXTENSION_NAME) ||
+         (!layers.empty() &&
+          hasExtension(instanceExtensions(layers[0]),
+                       VK_EXT_DEBUG_UTILS_EXTENSION_NAME)))) {
       extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
     }
 
+    // surfaces for Presenter, without a display on Linux and from the
+    // app's window on Android
+    if (hasExtension(available, VK_KHR_SURFACE_EXTENSION_NAME)) {
+      extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+#ifdef VK_EXT_headless_surface
+      if (hasExtension(available, VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME)) {
+        extensions.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+      }
+#endif
+#ifdef VK_USE_PLATFORM_ANDROID_KHR
+      if (hasExtension(available, VK_KHR_ANDROID_SURFACE_EXTENSION_NAME)) {
+        extensions.push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
+      }
+#endif
+    }
+
     return extensions;
   };
 
-  std::vector<const char *> getValidationLayers() {
+  // The first available of the current layer and the one it replaced
+  std::vector<const char *> getValidationLayers() const {
     std::vector<const char *> layers;
 
-    if (enableValidationLayers) {
-      layers.push_back("VK_LAYER_LUNARG_standard_validation");
+    if (validationEnabled()) {
+      uint32_t layerCount = 0;
+      vkEnumerateInstanceLayerProperties(&layerCount, VK_NULL_HANDLE);
+      std::vector<VkLayerProperties> available(layerCount);
+      vkEnumerateInstanceLayerProperties(&layerCount, available.data());
+      for (const char *name : {"VK_LAYER_KHRONOS_validation",
+                               "VK_LAYER_LUNARG_standard_validation"}) {
+        for (const auto &layer : available) {
+          if (layers.empty() && std::strcmp(layer.layerName, name) == 0) {
+            layers.push_back(name);
+          }
+        }
+      }
     }
 
     return layers;
   };
+
+private:
+  static std::vector<VkExtensionProperties>
+  instanceExtensions(const char *layer) {
+    uint32_t extensionCount = 0;
+    vkEnumerateInstanceExtensionProperties(layer, &extensionCount,
+                                           VK_NULL_HANDLE);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateInstanceExtensionProperties(layer, &extensionCount,
+                                           extensions.data());
+    return extensions;
+  }
 } config;
 
 class Instance {
@@ -640,6 +4280,8 @@ public:
   Instance() = delete;
   Instance(const std::string &appName, uint32_t appVersion,
            const std::string &engineName, uint32_t engineVersion) {
+    NAIVE_VULKAN_TRACE("Instance::create");
+    auto begin = std::chrono::steady_clock::now();
     // Information about our application.
     // Optional, driver could use this to optimize for specific app.
     VkApplicationInfo appInfo = {};
@@ -648,109 +4290,480 @@ public:
     appInfo.applicationVersion = appVersion;
     appInfo.pEngineName = engineName.data();
     appInfo.engineVersion = engineVersion;
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    appInfo.apiVersion = m_apiVersion = negotiateVersion();
+    m_startup.record("loader", begin);
 
     // Information of extensions
     VkInstanceCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     createInfo.pApplicationInfo = &appInfo;
 
-    // extensions
-    auto extensions = config.getRequiredExtensions();
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
-    createInfo.ppEnabledExtensionNames = extensions.data();
-
     // layers
     auto layers = config.getValidationLayers();
     createInfo.enabledLayerCount = static_cast<uint32_t>(layers.size());
     createInfo.ppEnabledLayerNames = layers.data();
 
-    auto b = vkCreateInstance(&createInfo, VK_NULL_HANDLE, &m_instance);
+    // extensions
+    auto extensions = config.getRequiredExtensions(layers);
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
+    m_startup.record("layers", begin);
 
     if (vkCreateInstance(&createInfo, VK_NULL_HANDLE, &m_instance) !=
         VK_SUCCESS) {
       throw std::runtime_error("failed to create instance!");
     }
+    m_startup.record("vkCreateInstance", begin);
+
+    m_extensions = extensions;
+
+    // debug labels follow the trace spans when the extension is enabled
+    if (enabled(VK_EXT_DEBUG_UTILS_EXTENSION_NAME)) {
+      trace::loadLabels(m_instance);
+    }
   }
   ~Instance() { vkDestroyInstance(m_instance, VK_NULL_HANDLE); }
 
 public:
-  std::unique_ptr<Device> getDevice(VkQueueFlagBits queueFlag) const {
-    //
-    uint32_t queueFamilyIndex;
-    VkPhysicalDevice physicalDevice;
-    std::tie(queueFamilyIndex, physicalDevice) = initPhyscalDevice(queueFlag);
+  // The best scored device with a queue of queueFlag. selector, or else
+  // the NAIVE_VULKAN_DEVICE environment variable, picks a device by a
+  // substring of its name or by its uuid instead.
+  std::unique_ptr<Device> getDevice(VkQueueFlagBits queueFlag,
+                                    const std::string &selector = "") const {
+    auto chosen = selectDevice(queueFlag, selector);
+    return std::make_unique<Device>(chosen.device, chosen.queueFamilyIndex,
+                                    chosen.capabilities);
+  }
 
-    //
-    return std::make_unique<Device>(physicalDevice, queueFamilyIndex);
+  // The device getDevice() would create, for changing its capabilities
+  // before creating it
+  PhysicalDeviceInfo selectDevice(VkQueueFlagBits queueFlag,
+                                  const std::string &selector = "") const {
+    auto candidates = physicalDevices(queueFlag);
+    if (candidates.empty()) {
+      throw std::runtime_error("failed to find a suitable device!");
+    }
+
+    std::string wanted = selector;
+    const char *environment = std::getenv("NAIVE_VULKAN_DEVICE");
+    if (wanted.empty() && environment != nullptr) {
+      wanted = environment;
+    }
+    const PhysicalDeviceInfo *chosen = &candidates[0];
+    if (!wanted.empty()) {
+      chosen = nullptr;
+      for (const auto &candidate : candidates) {
+        if (matches(candidate, wanted)) {
+          chosen = &candidate;
+          break;
+        }
+      }
+      if (chosen == nullptr) {
+        throw std::runtime_error("failed to find a device matching " + wanted +
+                                 "!");
+      }
+    }
+    return *chosen;
   }
 
-  std::unique_ptr<Device> getGraphicDevice() const {
-    return getDevice(VK_QUEUE_GRAPHICS_BIT);
+  std::unique_ptr<Device> getGraphicDevice(const std::string &selector = "") const {
+    return getDevice(VK_QUEUE_GRAPHICS_BIT, selector);
   }
 
-  std::unique_ptr<Device> getComputeDevice() const {
-    return getDevice(VK_QUEUE_COMPUTE_BIT);
+  std::unique_ptr<Device> getComputeDevice(const std::string &selector = "") const {
+    return getDevice(VK_QUEUE_COMPUTE_BIT, selector);
   }
 
-private:
-  std::tuple<uint32_t, VkPhysicalDevice>
-  initPhyscalDevice(const VkQueueFlagBits &queueFlag) const {
-    // Count devices
+  // The highest version both the loader and this header know
+  uint32_t apiVersion() const { return m_apiVersion; }
+
+  const VkInstance &get() const { return m_instance; }
+
+  // Whether the instance was created with extension
+  bool enabled(const char *extension) const {
+    for (const char *name : m_extensions) {
+      if (std::strcmp(name, extension) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Never shown, for presenting without a display, e.g. in tests
+  std::unique_ptr<Surface> createHeadlessSurface() const {
+#ifdef VK_EXT_headless_surface
+    auto createSurface = reinterpret_cast<PFN_vkCreateHeadlessSurfaceEXT>(
+        vkGetInstanceProcAddr(m_instance, "vkCreateHeadlessSurfaceEXT"));
+    if (enabled(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME) &&
+        createSurface != nullptr) {
+      VkHeadlessSurfaceCreateInfoEXT createInfo = {};
+      createInfo.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+      VkSurfaceKHR surface;
+      if (createSurface(m_instance, &createInfo, VK_NULL_HANDLE, &surface) !=
+          VK_SUCCESS) {
+        throw std::runtime_error("failed to create headless surface!");
+      }
+      return std::make_unique<Surface>(m_instance, surface);
+    }
+#endif
+    throw std::runtime_error("failed to find headless surface support!");
+  }
+
+#ifdef VK_USE_PLATFORM_ANDROID_KHR
+  std::unique_ptr<Surface> createSurface(ANativeWindow *window) const {
+    VkAndroidSurfaceCreateInfoKHR createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_ANDROID_SURFACE_CREATE_INFO_KHR;
+    createInfo.window = window;
+    VkSurfaceKHR surface;
+    if (!enabled(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME) ||
+        vkCreateAndroidSurfaceKHR(m_instance, &createInfo, VK_NULL_HANDLE,
+                                  &surface) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create window surface!");
+    }
+    return std::make_unique<Surface>(m_instance, surface);
+  }
+#endif
+
+  // Takes over a surface created elsewhere, e.g. by glfwCreateWindowSurface
+  std::unique_ptr<Surface> adoptSurface(VkSurfaceKHR surface) const {
+    return std::make_unique<Surface>(m_instance, surface);
+  }
+
+  const StartupTimes &startupTimes() const { return m_startup; }
+
+  // Every device with a queue of queueFlag, best score first
+  std::vector<PhysicalDeviceInfo>
+  physicalDevices(VkQueueFlagBits queueFlag) const {
     uint32_t deviceCount = 0;
     vkEnumeratePhysicalDevices(m_instance, &deviceCount, VK_NULL_HANDLE);
     if (deviceCount == 0) {
       throw std::runtime_error("failed to find GPUs with Vulkan support!");
     }
-
-    // Enum all physical devices
     std::vector<VkPhysicalDevice> devices(deviceCount);
     vkEnumeratePhysicalDevices(m_instance, &deviceCount, devices.data());
 
-    auto isDeviceSuitable =
-        [&](const VkPhysicalDevice &device) -> std::tuple<bool, uint32_t> {
-      uint32_t queueFamilyCount = 0;
-      vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
-                                               VK_NULL_HANDLE);
+    std::vector<PhysicalDeviceInfo> candidates;
+    for (const auto &device : devices) {
+      PhysicalDeviceInfo info = {};
+      if (describe(device, queueFlag, info)) {
+        candidates.push_back(info);
+      }
+    }
+    // stable, ties keep the enumeration order
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const PhysicalDeviceInfo &a,
+                        const PhysicalDeviceInfo &b) {
+                       return a.score > b.score;
+                     });
+    return candidates;
+  }
 
-      std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
-      vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
-                                               queueFamilies.data());
+private:
+  // False when no queue family supports queueFlag
+  bool describe(VkPhysicalDevice device, VkQueueFlagBits queueFlag,
+                PhysicalDeviceInfo &info) const {
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             VK_NULL_HANDLE);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             queueFamilies.data());
 
-      uint32_t index = 0;
-      for (const auto &queueFamily : queueFamilies) {
-        if (queueFamily.queueCount > 0 && queueFamily.queueFlags & queueFlag) {
-          break;
-        }
-        index += 1;
+    // for compute, a family without graphics runs beside rendering work
+    bool found = false;
+    for (uint32_t index = 0; index < queueFamilyCount; index += 1) {
+      const auto &queueFamily = queueFamilies[index];
+      if (queueFamily.queueCount == 0 || !(queueFamily.queueFlags & queueFlag)) {
+        continue;
       }
-      if (index == queueFamilies.size()) {
-        throw std::runtime_error("failed to find a suitable device!");
+      bool dedicated = queueFlag == VK_QUEUE_COMPUTE_BIT &&
+                       !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+      if (!found || dedicated) {
+        info.queueFamilyIndex = index;
+        info.queueCount = queueFamily.queueCount;
+        found = true;
+      }
+      if (dedicated) {
+        break;
       }
+    }
+    if (!found) {
+      return false;
+    }
 
-      return std::make_tuple(true, index);
-    };
+    info.device = device;
+    vkGetPhysicalDeviceProperties(device, &info.properties);
+    vkGetPhysicalDeviceFeatures(device, &info.features);
+    std::copy(std::begin(info.properties.pipelineCacheUUID),
+              std::end(info.properties.pipelineCacheUUID),
+              info.deviceUuid.begin());
 
-    // Pick one with graphics and compute pipeline support
-    uint32_t queueFamilyIndex;
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
-    for (const auto &device : devices) {
-      bool foundDevice;
-      std::tie(foundDevice, queueFamilyIndex) = isDeviceSuitable(device);
-      if (foundDevice) {
-        physicalDevice = device;
-        break;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(device, &memoryProperties);
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i += 1) {
+      const auto &heap = memoryProperties.memoryHeaps[i];
+      if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+        info.deviceLocalHeap = std::max(info.deviceLocalHeap, heap.size);
       }
     }
-    if (physicalDevice == VK_NULL_HANDLE) {
-      throw std::runtime_error("failed to find a suitable device!");
+
+    auto &capabilities = info.capabilities;
+    capabilities.apiVersion = std::min(m_apiVersion, info.properties.apiVersion);
+    capabilities.shaderInt64 = info.features.shaderInt64;
+    capabilities.shaderInt16 = info.features.shaderInt16;
+    capabilities.shaderFloat64 = info.features.shaderFloat64;
+
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(device, VK_NULL_HANDLE,
+                                         &extensionCount, VK_NULL_HANDLE);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, VK_NULL_HANDLE,
+                                         &extensionCount, extensions.data());
+    // enabled wherever offered, Presenter needs it
+    if (hasExtension(extensions, VK_KHR_SWAPCHAIN_EXTENSION_NAME)) {
+      capabilities.swapchain = true;
+      capabilities.extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
     }
+#ifdef VK_VERSION_1_1
+    if (capabilities.apiVersion >= VK_API_VERSION_1_1) {
+      negotiate(device, extensions, info);
+    }
+#endif
+    info.subgroupSize = capabilities.subgroupSize;
+
+    info.score = score(info);
+    return true;
+  }
+
+#ifdef VK_VERSION_1_1
+  // Properties and features beyond Vulkan 1.0, through the *2 queries
+  void negotiate(VkPhysicalDevice device,
+                 const std::vector<VkExtensionProperties> &extensions,
+                 PhysicalDeviceInfo &info) const {
+    auto &capabilities = info.capabilities;
+    auto getProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2>(
+        vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceProperties2"));
+    auto getFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2>(
+        vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceFeatures2"));
+    if (getProperties2 == nullptr || getFeatures2 == nullptr) {
+      capabilities.apiVersion = VK_API_VERSION_1_0;
+      return;
+    }
+
+    VkPhysicalDeviceIDProperties idProperties = {};
+    idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    VkPhysicalDeviceSubgroupProperties subgroupProperties = {};
+    subgroupProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    subgroupProperties.pNext = &idProperties;
+    VkPhysicalDeviceProperties2 properties2 = {};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &subgroupProperties;
+
+    VkPhysicalDevice16BitStorageFeatures storage16Features = {};
+    storage16Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+    VkPhysicalDeviceFeatures2 features2 = {};
+    features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features2.pNext = &storage16Features;
+
+#ifdef VK_VERSION_1_2
+    // supersedes the 1.1 structure, which may not be chained beside it
+    VkPhysicalDeviceVulkan11Features vulkan11Features = {};
+    vulkan11Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+    vulkan12Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan11Features.pNext = &vulkan12Features;
+    // before 1.2, the same features through extensions
+    VkPhysicalDevice8BitStorageFeatures storage8Features = {};
+    storage8Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES;
+    VkPhysicalDeviceShaderFloat16Int8Features float16Int8Features = {};
+    float16Int8Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_FLOAT16_INT8_FEATURES;
+    bool storage8 = false, float16Int8 = false;
+    if (capabilities.apiVersion >= VK_API_VERSION_1_2) {
+      features2.pNext = &vulkan11Features;
+    } else {
+      storage8 = hasExtension(extensions, VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+      float16Int8 =
+          hasExtension(extensions, VK_KHR_SHADER_FLOAT16_INT8_EXTENSION_NAME);
+      if (storage8) {
+        storage8Features.pNext = features2.pNext;
+        features2.pNext = &storage8Features;
+      }
+      if (float16Int8) {
+        float16Int8Features.pNext = features2.pNext;
+        features2.pNext = &float16Int8Features;
+      }
+    }
+#endif
+
+#ifdef VK_EXT_subgroup_size_control
+    VkPhysicalDeviceSubgroupSizeControlPropertiesEXT sizeControlProperties =
+        {};
+    sizeControlProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_SIZE_CONTROL_PROPERTIES_EXT;
+    VkPhysicalDeviceSubgroupSizeControlFeaturesEXT sizeControlFeatures = {};
+    sizeControlFeatures.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_SIZE_CONTROL_FEATURES_EXT;
+    bool sizeControl =
+        hasExtension(extensions, VK_EXT_SUBGROUP_SIZE_CONTROL_EXTENSION_NAME);
+    if (sizeControl) {
+      idProperties.pNext = &sizeControlProperties;
+      sizeControlFeatures.pNext = features2.pNext;
+      features2.pNext = &sizeControlFeatures;
+    }
+#endif
+
+#ifdef VK_EXT_external_memory_host
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties = {};
+    hostProperties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+    bool externalMemoryHost =
+        hasExtension(extensions, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    if (externalMemoryHost) {
+      hostProperties.pNext = properties2.pNext;
+      properties2.pNext = &hostProperties;
+    }
+#endif
+
+    getProperties2(device, &properties2);
+    getFeatures2(device, &features2);
+
+    std::copy(std::begin(idProperties.deviceUUID),
+              std::end(idProperties.deviceUUID), info.deviceUuid.begin());
+    capabilities.subgroupSize = subgroupProperties.subgroupSize;
+    capabilities.subgroupStages = subgroupProperties.supportedStages;
+    capabilities.subgroupOperations = subgroupProperties.supportedOperations;
+    capabilities.storageBuffer16BitAccess =
+        storage16Features.storageBuffer16BitAccess;
+#ifdef VK_VERSION_1_2
+    if (capabilities.apiVersion >= VK_API_VERSION_1_2) {
+      capabilities.storageBuffer16BitAccess =
+          vulkan11Features.storageBuffer16BitAccess;
+      capabilities.shaderFloat16 = vulkan12Features.shaderFloat16;
+      capabilities.shaderInt8 = vulkan12Features.shaderInt8;
+      capabilities.storageBuffer8BitAccess =
+          vulkan12Features.storageBuffer8BitAccess;
+    }
+    if (storage8 && storage8Features.storageBuffer8BitAccess) {
+      capabilities.storageBuffer8BitAccess = true;
+      capabilities.extensions.push_back(VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+    }
+    if (float16Int8 &&
+        (float16Int8Features.shaderFloat16 || float16Int8Features.shaderInt8)) {
+      capabilities.shaderFloat16 = float16Int8Features.shaderFloat16;
+      capabilities.shaderInt8 = float16Int8Features.shaderInt8;
+      capabilities.extensions.push_back(
+          VK_KHR_SHADER_FLOAT16_INT8_EXTENSION_NAME);
+    }
+#endif
+#ifdef VK_EXT_subgroup_size_control
+    if (sizeControl && sizeControlFeatures.subgroupSizeControl) {
+      capabilities.extensions.push_back(
+          VK_EXT_SUBGROUP_SIZE_CONTROL_EXTENSION_NAME);
+      capabilities.subgroupSizeControl = true;
+      capabilities.computeFullSubgroups =
+          sizeControlFeatures.computeFullSubgroups;
+      capabilities.minSubgroupSize = sizeControlProperties.minSubgroupSize;
+      capabilities.maxSubgroupSize = sizeControlProperties.maxSubgroupSize;
+      capabilities.requiredSubgroupSizeStages =
+          sizeControlProperties.requiredSubgroupSizeStages;
+    }
+#endif
+#ifdef VK_EXT_external_memory_host
+    // external memory itself is core since 1.1
+    if (externalMemoryHost) {
+      capabilities.extensions.push_back(
+          VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+      capabilities.externalMemoryHost = true;
+      capabilities.minImportedHostPointerAlignment =
+          hostProperties.minImportedHostPointerAlignment;
+    }
+#endif
+  }
+#endif
 
-    return std::make_tuple(queueFamilyIndex, physicalDevice);
+  // Structures of newer versions are unknown to older headers
+  static uint32_t negotiateVersion() {
+    uint32_t version = VK_API_VERSION_1_0;
+#ifdef VK_VERSION_1_1
+    // absent from 1.0 loaders
+    auto enumerateVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+        vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion"));
+    if (enumerateVersion == nullptr ||
+        enumerateVersion(&version) != VK_SUCCESS) {
+      version = VK_API_VERSION_1_0;
+    }
+#endif
+#if defined(VK_VERSION_1_2)
+    return std::min(version, uint32_t(VK_API_VERSION_1_2));
+#elif defined(VK_VERSION_1_1)
+    return std::min(version, uint32_t(VK_API_VERSION_1_1));
+#else
+    return version;
+#endif
+  }
+
+  // Device type dominates, a discrete GPU beats any integrated one and
+  // a software rasterizer comes last. Memory, queues, subgroup width and
+  // compute features break ties within a type.
+  static int64_t score(const PhysicalDeviceInfo &info) {
+    int64_t score = 0;
+    switch (info.properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: {
+      score += 4000000;
+      break;
+    }
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: {
+      score += 3000000;
+      break;
+    }
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: {
+      score += 2000000;
+      break;
+    }
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: {
+      break;
+    }
+    default: {
+      score += 1000000;
+      break;
+    }
+    }
+    // about 1000 per GiB, up to 256 GiB
+    score += int64_t(std::min(info.deviceLocalHeap >> 20, uint64_t(256 << 10)));
+    score += 1000 * int64_t(std::min(info.queueCount, 16u));
+    score += 100 * int64_t(std::min(info.subgroupSize, 128u));
+    const VkBool32 features[] = {info.features.shaderInt64,
+                                 info.features.shaderInt16,
+                                 info.features.shaderFloat64};
+    for (VkBool32 feature : features) {
+      score += feature ? 1000 : 0;
+    }
+    return score;
+  }
+
+  // A uuid matches in full, dashes ignored, a name by case-sensitive substring
+  static bool matches(const PhysicalDeviceInfo &info,
+                      const std::string &selector) {
+    std::string uuid;
+    for (char c : selector) {
+      if (c != '-') {
+        uuid += char(std::tolower(static_cast<unsigned char>(c)));
+      }
+    }
+    return uuid == info.uuid() || info.name().find(selector) != std::string::npos;
   }
 
 private:
   VkInstance m_instance;
+  uint32_t m_apiVersion;
+  std::vector<const char *> m_extensions;
+  StartupTimes m_startup;
 };
 
 std::unique_ptr<Instance>
@@ -762,6 +4775,55 @@ createInstance(const std::string &appName = "Demo",
                                     engineVersion);
 }
 
+// One instance and compute device for the whole process. get() hands
+// out references, the context lives while any is held and the next
+// get() after the last is dropped brings it up again.
+class Context {
+public:
+  static std::shared_ptr<Context> get() {
+    static std::mutex mutex;
+    static std::weak_ptr<Context> shared;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto context = shared.lock();
+    if (!context) {
+      context = std::shared_ptr<Context>(new Context());
+      shared = context;
+    }
+    return context;
+  }
+
+public:
+  const std::unique_ptr<Instance> &instance() const { return m_instance; }
+
+  const std::unique_ptr<Device> &device() const { return m_device; }
+
+  // Instance phases, device selection, then device phases
+  const StartupTimes &startupTimes() const { return m_startup; }
+
+private:
+  Context() {
+    NAIVE_VULKAN_TRACE("Context::create");
+    m_instance = createInstance("naive_vulkan");
+    m_startup.append(m_instance->startupTimes());
+
+    auto begin = std::chrono::steady_clock::now();
+    m_device = m_instance->getComputeDevice();
+    double device = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - begin)
+                        .count();
+    const auto &deviceTimes = m_device->startupTimes();
+    m_startup.phases.emplace_back("device selection",
+                                  device - deviceTimes.total());
+    m_startup.append(deviceTimes);
+  }
+
+private:
+  // the device goes first
+  std::unique_ptr<Instance> m_instance;
+  std::unique_ptr<Device> m_device;
+  StartupTimes m_startup;
+};
+
 } // namespace vk
 
 #endif
\ No newline at end of file
@@ -1,14 +1,28 @@
 // clang-format off
+#include <array>
+#include <cmath>
 #include <tuple>
+#include <random>
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+#include <algorithm>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
 #include <naive_vulkan/vulkan.hpp>
+#include <naive_vulkan/bitmap.hpp>
+#include <naive_vulkan/gemm.hpp>
+#include <naive_vulkan/host.hpp>
+#include <naive_vulkan/mandelbrot.hpp>
+#include <naive_vulkan/multi_device.hpp>
+#include <naive_vulkan/primitives.hpp>
+#ifdef __linux__
+#include <naive_vulkan/service.hpp>
+#endif
 // clang-format on
 
 class GraphicBase {
@@ -381,11 +395,29 @@ public:
   }
 };
 
+void test_context() {
+  auto context = vk::Context::get();
+  if (vk::Context::get() != context) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Context shared" << std::endl;
+
+  const auto &startup = context->startupTimes();
+  for (const auto &phase : startup.phases) {
+    std::cout << "   " << phase.first << " " << phase.second << " us"
+              << std::endl;
+  }
+  if (startup.phases.empty() || startup.total() <= 0.0) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Startup took " << startup.total() << " us" << std::endl;
+}
+
 void test_buffer() {
-  auto instance = vk::createInstance();
-  std::cout << "1. Instance ready" << std::endl;
+  auto context = vk::Context::get();
+  std::cout << "1. Context ready" << std::endl;
 
-  auto device = instance->getComputeDevice();
+  const auto &device = context->device();
   std::cout << "2. Device ready" << std::endl;
 
   auto shader =
@@ -420,10 +452,10 @@ void test_buffer() {
 }
 
 void test_uniform() {
-  auto instance = vk::createInstance();
-  std::cout << "1. Instance ready" << std::endl;
+  auto context = vk::Context::get();
+  std::cout << "1. Context ready" << std::endl;
 
-  auto device = instance->getComputeDevice();
+  const auto &device = context->device();
   std::cout << "2. Device ready" << std::endl;
 
   auto shader =
@@ -462,7 +494,1351 @@ void test_uniform() {
   std::cout << "8. Finish" << std::endl;
 }
 
+void test_reflection() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  // the context device is shared, earlier tests may have filled the caches
+  auto shaders = device->shaderCache().size();
+  auto setLayouts = device->layoutCache().setLayoutCount();
+  auto pipelineLayouts = device->layoutCache().pipelineLayoutCount();
+  auto shader =
+      device->createShader("./shaders/test_2.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+  if (device->createShader("./shaders/test_2.spv",
+                           VK_SHADER_STAGE_COMPUTE_BIT) != shader ||
+      device->shaderCache().size() > shaders + 1) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Shader ready" << std::endl;
+
+  auto &setsBindings = shader->reflection().setsBindings();
+  if (setsBindings.size() != 1 || setsBindings[0].size() != 2 ||
+      setsBindings[0][0] !=
+          std::make_tuple(0u, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) ||
+      setsBindings[0][1] !=
+          std::make_tuple(1u, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Reflection ready" << std::endl;
+
+  std::vector<std::unique_ptr<vk::ComputePipeline>> pipelines;
+  for (size_t i = 0; i < 50; i += 1) {
+    pipelines.push_back(device->createComputePipeline(shader));
+  }
+  auto futures = device->createComputePipelinesAsync(
+      std::vector<std::shared_ptr<vk::Shader>>(50, shader));
+  for (auto &future : futures) {
+    pipelines.push_back(future.get());
+  }
+  if (device->layoutCache().setLayoutCount() > setLayouts + 1 ||
+      device->layoutCache().pipelineLayoutCount() > pipelineLayouts + 1) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Pipelines share layouts" << std::endl;
+
+  // buffer B { uint x; } b[4]; at set 0, binding 1, then unsized b[]
+  auto module = [](bool runtimeArray) {
+    std::vector<uint32_t> words = {0x07230203, 0x00010000, 0, 10, 0,
+                                   (3 << 16) | 71, 2, 3,     // BufferBlock
+                                   (4 << 16) | 71, 8, 34, 0, // DescriptorSet
+                                   (4 << 16) | 71, 8, 33, 1, // Binding
+                                   (4 << 16) | 21, 1, 32, 0, // OpTypeInt
+                                   (3 << 16) | 30, 2, 1,     // OpTypeStruct
+                                   (4 << 16) | 43, 1, 3, 4}; // OpConstant
+    if (runtimeArray) {
+      words.insert(words.end(), {(3 << 16) | 29, 4, 2}); // OpTypeRuntimeArray
+    } else {
+      words.insert(words.end(), {(4 << 16) | 28, 4, 2, 3}); // OpTypeArray
+    }
+    words.insert(words.end(), {(4 << 16) | 32, 5, 2, 4,  // OpTypePointer
+                               (4 << 16) | 59, 5, 8, 2}); // OpVariable
+    return words;
+  };
+  auto words = module(false);
+  vk::Reflection arrays(words.data(), words.size());
+  if (arrays.setsBindings().size() != 1 ||
+      arrays.setsBindings()[0] !=
+          std::vector<std::tuple<uint32_t, VkDescriptorType>>{
+              std::make_tuple(1u, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)} ||
+      arrays.descriptorCounts()[0] != std::map<uint32_t, uint32_t>{{1, 4}}) {
+    throw std::runtime_error("check error");
+  }
+  words = module(true);
+  bool rejected = false;
+  try {
+    vk::Reflection(words.data(), words.size());
+  } catch (const std::runtime_error &) {
+    rejected = true;
+  }
+  if (!rejected) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Descriptor arrays reflected" << std::endl;
+  std::cout << "5. Finish" << std::endl;
+}
+
+void test_profile() {
+  vk::trace::enable();
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  auto fill = device->createComputePipeline(
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto scale = device->createComputePipeline(
+      device->createShader("./shaders/test_2.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  std::cout << "1. Pipeline ready" << std::endl;
+
+  auto buffer = device->createBuffer(64 * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  auto uniform = device->createBuffer(1 * sizeof(uint32_t),
+                                      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  uint32_t scalar = 3;
+  uniform->update(&scalar, sizeof(scalar));
+  fill->feedBuffer(0, 0, buffer, 0, 64 * sizeof(uint32_t));
+  scale->feedBuffer(0, 0, uniform, 0, 1 * sizeof(uint32_t));
+  scale->feedBuffer(0, 1, buffer, 0, 64 * sizeof(uint32_t));
+  std::cout << "2. Buffer ready" << std::endl;
+
+  auto command =
+      device->createCommand({fill->dispatch(64), scale->dispatch(64)}, true);
+  command->submit()->wait();
+  auto durations = command->durations();
+  if (durations.size() != 2) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. fill " << durations[0] << " ns, scale " << durations[1]
+            << " ns" << std::endl;
+
+  auto fillCommand = fill->createCommand(64);
+  std::vector<std::unique_ptr<vk::Fence>> fences;
+  for (size_t i = 0; i < 4; i += 1) {
+    fences.push_back(fillCommand->submit());
+  }
+  if (vk::Fence::waitAny(fences) == fences.size() ||
+      !vk::Fence::waitAll(fences) || !fences[0]->isReady() ||
+      !fences[3]->waitFor(0)) {
+    throw std::runtime_error("check error");
+  }
+
+  std::ostringstream trace;
+  vk::trace::tracer().write(trace);
+  if (trace.str().find("\"Fence::wait\"") == std::string::npos) {
+    throw std::runtime_error("check error");
+  }
+  vk::trace::dump("trace.json");
+  vk::trace::enable(false);
+  std::cout << "4. Trace saved to trace.json" << std::endl;
+}
+
+void test_primitives() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  vk::Primitives primitives(*device);
+  std::cout << "1. Primitives ready"
+            << (primitives.subgroups() ? " with subgroups" : "") << std::endl;
+
+  const uint32_t count = 100000;
+  std::mt19937 random(42);
+  std::vector<uint32_t> keys(count), values(count), flags(count);
+  std::vector<float> reals(count);
+  for (uint32_t i = 0; i < count; i += 1) {
+    keys[i] = random();
+    values[i] = i;
+    flags[i] = random() % 3 == 0 ? 1 : 0;
+    reals[i] = float(random() % 1000) / 1000.0f;
+  }
+  auto upload = [&](const void *data) {
+    auto buffer = device->createBuffer(count * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    buffer->update(const_cast<void *>(data), count * sizeof(uint32_t));
+    return buffer;
+  };
+  auto keyBuffer = upload(keys.data());
+  auto valueBuffer = upload(values.data());
+  auto flagBuffer = upload(flags.data());
+  auto realBuffer = upload(reals.data());
+  auto output = upload(values.data());
+  std::cout << "2. Buffer ready" << std::endl;
+
+  uint32_t sum = 0;
+  double realSum = 0.0;
+  for (uint32_t i = 0; i < count; i += 1) {
+    sum += keys[i];
+    realSum += reals[i];
+  }
+  if (primitives.reduce<uint32_t>(keyBuffer, count, vk::ReduceOp::Sum) != sum ||
+      primitives.reduce<uint32_t>(keyBuffer, count, vk::ReduceOp::Min) !=
+          *std::min_element(keys.begin(), keys.end()) ||
+      primitives.reduce<uint32_t>(keyBuffer, count, vk::ReduceOp::Max) !=
+          *std::max_element(keys.begin(), keys.end()) ||
+      std::abs(primitives.reduce<float>(realBuffer, count, vk::ReduceOp::Sum) -
+               realSum) > 1e-4 * realSum) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Reduce checked" << std::endl;
+
+  auto data = std::vector<uint32_t>(count);
+  primitives.exclusiveScan(flagBuffer, output, count);
+  output->dump(data.data(), count * sizeof(uint32_t));
+  for (uint32_t i = 0, prefix = 0; i < count; prefix += flags[i], i += 1) {
+    if (data[i] != prefix) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "4. Scan checked" << std::endl;
+
+  uint32_t kept = primitives.compact(valueBuffer, flagBuffer, output, count);
+  output->dump(data.data(), count * sizeof(uint32_t));
+  for (uint32_t i = 0, j = 0; i < count; i += 1) {
+    if (flags[i] != 0 && data[j++] != values[i]) {
+      throw std::runtime_error("check error");
+    }
+    if (i == count - 1 && j != kept) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "5. Compact checked" << std::endl;
+
+  auto order = std::vector<uint32_t>(values);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+  primitives.sortPairs(keyBuffer, valueBuffer, count);
+  auto sortedKeys = std::vector<uint32_t>(count);
+  keyBuffer->dump(sortedKeys.data(), count * sizeof(uint32_t));
+  valueBuffer->dump(data.data(), count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i += 1) {
+    if (data[i] != order[i] || sortedKeys[i] != keys[order[i]]) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "6. Sort checked" << std::endl;
+}
+
+void test_gemm() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  vk::Gemm gemm(*device);
+  std::cout << "1. Gemm ready" << std::endl;
+
+  // one large product, then a batch of small ones
+  for (const auto &shape : {std::make_tuple(100u, 70u, 130u, 1u),
+                            std::make_tuple(8u, 8u, 8u, 64u)}) {
+    uint32_t m, n, k, batch;
+    std::tie(m, n, k, batch) = shape;
+    std::mt19937 random(42);
+    std::vector<float> a(batch * m * k), b(batch * k * n), c(batch * m * n);
+    for (auto *matrix : {&a, &b, &c}) {
+      for (auto &value : *matrix) {
+        value = float(random() % 200) / 100.0f - 1.0f;
+      }
+    }
+    auto upload = [&](std::vector<float> &data) {
+      auto buffer = device->createBuffer(data.size() * sizeof(float),
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+      buffer->update(data.data(), data.size() * sizeof(float));
+      return buffer;
+    };
+    auto bufferA = upload(a), bufferB = upload(b), bufferC = upload(c);
+    gemm.run(bufferA, bufferB, bufferC, m, n, k, 1.5f, 0.5f, batch);
+
+    auto result = std::vector<float>(c.size());
+    bufferC->dump(result.data(), result.size() * sizeof(float));
+    for (uint32_t z = 0; z < batch; z += 1) {
+      for (uint32_t i = 0; i < m; i += 1) {
+        for (uint32_t j = 0; j < n; j += 1) {
+          float expect = 0.0f;
+          for (uint32_t p = 0; p < k; p += 1) {
+            expect += a[z * m * k + i * k + p] * b[z * k * n + p * n + j];
+          }
+          size_t index = z * m * n + i * n + j;
+          expect = 1.5f * expect + 0.5f * c[index];
+          if (std::abs(result[index] - expect) > 1e-3f) {
+            throw std::runtime_error("check error");
+          }
+        }
+      }
+    }
+    std::cout << "2. " << batch << " x " << m << "x" << n << "x" << k
+              << " checked" << std::endl;
+  }
+}
+
+void test_bitmap() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  vk::BitmapOps ops(*device);
+  std::cout << "1. BitmapOps ready" << std::endl;
+
+  const uint32_t width = 64, height = 48;
+  std::mt19937 random(42);
+  std::vector<uint32_t> pixels(width * height);
+  for (auto &pixel : pixels) {
+    pixel = random();
+  }
+  auto createImage = [&](uint32_t count) {
+    return device->createBuffer(count * sizeof(uint32_t),
+                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  };
+  auto channel = [](uint32_t pixel, uint32_t c) {
+    return int((pixel >> (c * 8)) & 0xFF);
+  };
+  auto pack = [](const float *rgba) {
+    uint32_t pixel = 0;
+    for (uint32_t c = 0; c < 4; c += 1) {
+      float value = std::min(std::max(rgba[c], 0.0f), 1.0f);
+      pixel |= uint32_t(std::round(value * 255.0f)) << (c * 8);
+    }
+    return pixel;
+  };
+  auto near = [&](const std::vector<uint32_t> &a,
+                  const std::vector<uint32_t> &b) {
+    for (size_t i = 0; i < a.size(); i += 1) {
+      for (uint32_t c = 0; c < 4; c += 1) {
+        if (std::abs(channel(a[i], c) - channel(b[i], c)) > 1) {
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  // blur, invert and histogram in place, one submit and one readback
+  auto image = createImage(width * height);
+  image->update(pixels.data(), pixels.size() * sizeof(uint32_t));
+  auto hist = createImage(1024);
+  std::vector<float> taps = {1 / 16.0f, 4 / 16.0f, 6 / 16.0f, 4 / 16.0f,
+                             1 / 16.0f};
+  std::array<uint32_t, 256> invert;
+  for (uint32_t v = 0; v < 256; v += 1) {
+    invert[v] = (255 - v) * 0x01010101u;
+  }
+  ops.run({ops.convolve(image, image, width, height, taps),
+           {ops.applyLut(image, width, height, invert)},
+           ops.histogram(image, width, height, hist)});
+
+  auto blurred = pixels;
+  for (uint32_t pass = 0; pass < 2; pass += 1) {
+    auto source = blurred;
+    for (uint32_t y = 0; y < height; y += 1) {
+      for (uint32_t x = 0; x < width; x += 1) {
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = -2; i <= 2; i += 1) {
+          int sx = int(x), sy = int(y);
+          if (pass == 0) {
+            sx = std::min(std::max(sx + i, 0), int(width) - 1);
+          } else {
+            sy = std::min(std::max(sy + i, 0), int(height) - 1);
+          }
+          for (uint32_t c = 0; c < 4; c += 1) {
+            sum[c] += taps[i + 2] * channel(source[sy * width + sx], c) /
+                      255.0f;
+          }
+        }
+        blurred[y * width + x] = pack(sum);
+      }
+    }
+  }
+  for (auto &pixel : blurred) {
+    pixel = ~pixel;
+  }
+  auto result = std::vector<uint32_t>(pixels.size());
+  image->dump(result.data(), result.size() * sizeof(uint32_t));
+  if (!near(result, blurred)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Convolve and LUT checked" << std::endl;
+
+  auto bins = std::vector<uint32_t>(1024);
+  hist->dump(bins.data(), bins.size() * sizeof(uint32_t));
+  auto expect = std::vector<uint32_t>(1024, 0);
+  for (auto pixel : result) {
+    for (uint32_t c = 0; c < 4; c += 1) {
+      expect[c * 256 + channel(pixel, c)] += 1;
+    }
+  }
+  if (bins != expect) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Histogram checked" << std::endl;
+
+  const uint32_t targetWidth = 40, targetHeight = 30;
+  auto source = createImage(width * height);
+  source->update(pixels.data(), pixels.size() * sizeof(uint32_t));
+  auto target = createImage(targetWidth * targetHeight);
+  ops.run({{ops.resize(source, target, width, height, targetWidth,
+                       targetHeight)}});
+  auto resized = std::vector<uint32_t>(targetWidth * targetHeight);
+  for (uint32_t y = 0; y < targetHeight; y += 1) {
+    for (uint32_t x = 0; x < targetWidth; x += 1) {
+      float px = (x + 0.5f) * width / targetWidth - 0.5f;
+      float py = (y + 0.5f) * height / targetHeight - 0.5f;
+      px = std::min(std::max(px, 0.0f), float(width - 1));
+      py = std::min(std::max(py, 0.0f), float(height - 1));
+      int x0 = int(px), y0 = int(py);
+      int x1 = std::min(x0 + 1, int(width) - 1);
+      int y1 = std::min(y0 + 1, int(height) - 1);
+      float fx = px - x0, fy = py - y0;
+      float rgba[4];
+      for (uint32_t c = 0; c < 4; c += 1) {
+        auto at = [&](int sx, int sy) {
+          return channel(pixels[sy * width + sx], c) / 255.0f;
+        };
+        float top = at(x0, y0) + (at(x1, y0) - at(x0, y0)) * fx;
+        float bottom = at(x0, y1) + (at(x1, y1) - at(x0, y1)) * fx;
+        rgba[c] = top + (bottom - top) * fy;
+      }
+      resized[y * targetWidth + x] = pack(rgba);
+    }
+  }
+  result.resize(resized.size());
+  target->dump(result.data(), result.size() * sizeof(uint32_t));
+  if (!near(result, resized)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Resize checked" << std::endl;
+}
+
+void test_mandelbrot() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  const uint32_t width = 256, height = 192;
+  vk::TiledMandelbrot mandelbrot(*device, width, height);
+  std::cout << "1. TiledMandelbrot ready" << std::endl;
+
+  // same iteration as tile_render.comp at the level pixel under (x, y)
+  auto expect = [&](double centreX, double centreY, double radius, uint32_t x,
+                    uint32_t y) {
+    double step = 2.0 * radius / width;
+    double levelStep = std::exp2(std::floor(std::log2(step) * 8) / 8);
+    double left = (centreX - radius) / levelStep;
+    double top = (centreY - step * height / 2) / levelStep;
+    float cx = float(std::floor(left + x * step / levelStep) * levelStep);
+    float cy = float(std::floor(top + y * step / levelStep) * levelStep);
+    uint32_t c = 0;
+    float zx = 0.0f, zy = 0.0f;
+    for (uint32_t i = 0; i < 50; i += 1) {
+      float t = zx * zx - zy * zy + cx;
+      zy = 2 * zx * zy + cy;
+      zx = t;
+      if (zx * zx + zy * zy > 4.0f) {
+        break;
+      }
+      c += 0x00000500;
+    }
+    return c | 0xFF000000;
+  };
+  // escape counts may differ on the set boundary, allow a few pixels
+  auto check = [&](double centreX, double centreY, double radius) {
+    mandelbrot.render(centreX, centreY, radius)->wait();
+    std::vector<uint32_t> image(width * height);
+    mandelbrot.image()->dump(image.data(), image.size() * sizeof(uint32_t));
+    uint32_t wrong = 0;
+    for (uint32_t y = 0; y < height; y += 1) {
+      for (uint32_t x = 0; x < width; x += 1) {
+        if (image[y * width + x] != expect(centreX, centreY, radius, x, y)) {
+          wrong += 1;
+        }
+      }
+    }
+    if (wrong > width * height / 100) {
+      throw std::runtime_error("check error");
+    }
+    return mandelbrot.renderedTiles();
+  };
+
+  uint32_t first = check(-0.5, 0.0, 1.5);
+  if (first == 0 || first != mandelbrot.cachedTiles()) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. " << first << " tiles rendered" << std::endl;
+
+  if (check(-0.5, 0.0, 1.5) != 0) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Same view served from the cache" << std::endl;
+
+  // a 20 pixel pan exposes at most two columns of tiles
+  double step = 3.0 / width;
+  uint32_t panned = check(-0.5 + 20 * step, 0.0, 1.5);
+  if (panned > 2 * (height / 16 + 2)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Pan rendered " << panned << " tiles" << std::endl;
+
+  // zooming in within a level needs no new tiles
+  if (check(-0.5 + 20 * step, 0.0, 1.49) != 0) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "5. Zoom within a level served from the cache" << std::endl;
+}
+
+void test_perturbation() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  const uint32_t width = 128, height = 96;
+  vk::PerturbationMandelbrot mandelbrot(*device, width, height);
+  std::cout << "1. PerturbationMandelbrot ready" << std::endl;
+
+  // far past float precision, checked against direct long double iteration
+  const long double centreX = -0.743643887037151L, centreY = 0.131825904205330L;
+  const uint32_t maxIterations = 2000;
+  for (long double radius : {1e-12L, 1e-13L}) {
+    mandelbrot.render(centreX, centreY, radius, maxIterations)->wait();
+    std::vector<uint32_t> image(width * height);
+    mandelbrot.image()->dump(image.data(), image.size() * sizeof(uint32_t));
+
+    long double step = 2 * radius / width;
+    uint32_t wrong = 0;
+    for (uint32_t y = 0; y < height; y += 1) {
+      for (uint32_t x = 0; x < width; x += 1) {
+        long double cx = centreX - radius + x * step;
+        long double cy = centreY - step * height / 2 + y * step;
+        long double zx = 0, zy = 0;
+        uint32_t iteration = 0;
+        while (iteration < maxIterations) {
+          long double t = zx * zx - zy * zy + cx;
+          zy = 2 * zx * zy + cy;
+          zx = t;
+          iteration += 1;
+          if (zx * zx + zy * zy > 4) {
+            break;
+          }
+        }
+        uint32_t expect = (((iteration * 5u) & 0xFFu) << 8) | 0xFF000000u;
+        if (image[y * width + x] != expect) {
+          wrong += 1;
+        }
+      }
+    }
+    if (wrong > width * height / 100) {
+      throw std::runtime_error("check error");
+    }
+    std::cout << "2. Radius " << double(radius) << " checked, "
+              << mandelbrot.rebasedPixels() << " pixels rebased" << std::endl;
+  }
+
+  // zooming into the same centre keeps the reference orbit
+  if (mandelbrot.orbitUploads() != 1) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Orbit of " << mandelbrot.orbitLength()
+            << " uploaded once" << std::endl;
+}
+
+// C++ counterparts of shaders/test_1.comp and shaders/test_2.comp
+static bool hostKernels =
+    vk::host::registerKernel(
+        "test_1", {1, 1, 1},
+        [](const vk::host::WorkGroup &group) {
+          auto data = group.buffer<uint32_t>(0);
+          data[group.id[0]] = group.id[0];
+        }) &&
+    vk::host::registerKernel(
+        "test_2", {1, 1, 1}, [](const vk::host::WorkGroup &group) {
+          auto scalar = group.buffer<uint32_t>(0);
+          auto data = group.buffer<uint32_t>(1);
+          data[group.id[0]] = scalar[0] * group.id[0];
+        });
+
+// Written once against the shared API, runs on either backend
+template <typename Device> void runScale(const std::unique_ptr<Device> &device) {
+  auto shader =
+      device->createShader("./shaders/test_2.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+  auto pipeline = device->createComputePipeline(
+      shader, {{std::make_tuple(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER),
+                std::make_tuple(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)}});
+  auto buffer = device->createBuffer(4096 * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  auto uniform = device->createBuffer(sizeof(uint32_t),
+                                      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline->feedBuffer(0, 0, uniform, 0, sizeof(uint32_t));
+  pipeline->feedBuffer(0, 1, buffer, 0, 4096 * sizeof(uint32_t));
+  uint32_t scalar = 3;
+  uniform->update(&scalar, sizeof(scalar));
+  pipeline->createCommand(4096)->submit()->wait();
+
+  auto data = std::vector<uint32_t>(4096);
+  buffer->dump(data.data(), data.size() * sizeof(uint32_t));
+  for (size_t i = 0; i < data.size(); i += 1) {
+    if (data[i] != scalar * i) {
+      throw std::runtime_error("check error");
+    }
+  }
+}
+
+void test_host() {
+  auto instance = vk::host::createInstance();
+  auto device = instance->getComputeDevice();
+  std::cout << "1. " << device->name() << " ready" << std::endl;
+
+  runScale(device);
+  runScale(vk::Context::get()->device());
+  std::cout << "2. Same code checked on host and Vulkan" << std::endl;
+
+  // every index exactly once, however the range is split and stolen
+  vk::host::WorkStealingPool pool(4);
+  std::vector<std::atomic<uint32_t>> hits(100000);
+  for (auto &hit : hits) {
+    hit = 0;
+  }
+  pool.parallelFor(uint32_t(hits.size()),
+                   [&](uint32_t i) { hits[i].fetch_add(1); });
+  for (const auto &hit : hits) {
+    if (hit != 1) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "3. Work stealing checked" << std::endl;
+
+  // indirect 3D dispatch with per-dispatch host timing
+  auto pipeline = device->createComputePipeline(
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->createBuffer(64 * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  auto indirect = device->createBuffer(3 * sizeof(uint32_t),
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                           VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline->feedBuffer(0, 0, buffer, 0, 64 * sizeof(uint32_t));
+  uint32_t workgroups[3] = {64, 1, 1};
+  indirect->update(workgroups, sizeof(workgroups));
+  auto command =
+      device->createCommand({pipeline->dispatchIndirect(indirect)}, true);
+  std::vector<std::unique_ptr<vk::host::Fence>> fences;
+  fences.push_back(command->submit());
+  if (!vk::host::Fence::waitAll(fences) || command->durations().size() != 1) {
+    throw std::runtime_error("check error");
+  }
+  auto data = std::array<uint32_t, 64>();
+  buffer->dump(data.data(), 64 * sizeof(uint32_t));
+  for (size_t i = 0; i < data.size(); i += 1) {
+    if (data[i] != i) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "4. Indirect dispatch checked" << std::endl;
+}
+
+void test_selection() {
+  auto instance = vk::createInstance();
+  auto candidates = instance->physicalDevices(VK_QUEUE_COMPUTE_BIT);
+  for (const auto &candidate : candidates) {
+    std::cout << "   " << candidate.name() << " " << candidate.uuid()
+              << " score " << candidate.score << std::endl;
+  }
+  for (size_t i = 1; i < candidates.size(); i += 1) {
+    if (candidates[i - 1].score < candidates[i].score) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "1. " << candidates.size() << " devices scored" << std::endl;
+
+  if (std::getenv("NAIVE_VULKAN_DEVICE") == nullptr &&
+      instance->getComputeDevice()->name() != candidates.front().name()) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Best device picked by default" << std::endl;
+
+  // the last device by name, then by uuid in upper case with dashes
+  const auto &last = candidates.back();
+  if (instance->getComputeDevice(last.name())->name() != last.name()) {
+    throw std::runtime_error("check error");
+  }
+  std::string uuid = last.uuid();
+  std::transform(uuid.begin(), uuid.end(), uuid.begin(), ::toupper);
+  uuid.insert(8, "-");
+  if (instance->getComputeDevice(uuid)->name() != last.name()) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Override by name and uuid checked" << std::endl;
+
+  bool thrown = false;
+  try {
+    instance->getComputeDevice("no such device");
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  if (!thrown) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Unknown device rejected" << std::endl;
+}
+
+void test_multi_device() {
+  auto instance = vk::createInstance();
+  vk::MultiDevice devices(*instance);
+  for (size_t i = 0; i < devices.size(); i += 1) {
+    std::cout << "   " << devices.device(i).name() << std::endl;
+  }
+  std::cout << "1. " << devices.size() << " devices ready" << std::endl;
+
+  for (uint32_t units : {0u, 1u, 7u, 1024u}) {
+    uint32_t next = 0;
+    for (const auto &share : devices.partition(units)) {
+      if (share.first != next || share.count == 0) {
+        throw std::runtime_error("check error");
+      }
+      next += share.count;
+    }
+    if (next != units) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "2. Partition checked" << std::endl;
+
+  // the same frame as one dispatch of shaders/mandelbrot.comp
+  const uint32_t width = 1024, height = 1024;
+  auto device = instance->getComputeDevice();
+  auto pipeline = device->createComputePipeline(device->createShader(
+      "./shaders/mandelbrot.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->createBuffer(width * height * sizeof(uint32_t),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline->feedBuffer(0, 0, buffer, 0, width * height * sizeof(uint32_t));
+  pipeline->createCommand(width, height)->submit()->wait();
+  std::vector<uint32_t> expected(width * height);
+  buffer->dump(expected.data(), expected.size() * sizeof(uint32_t));
+
+  std::vector<uint32_t> pixels(width * height);
+  for (int frame = 0; frame < 4; frame += 1) {
+    std::fill(pixels.begin(), pixels.end(), 0);
+    devices.dispatch("./shaders/mandelbrot_rows.spv", height,
+                     width * sizeof(uint32_t), 1, pixels.data(), &width,
+                     sizeof(width));
+    // devices may round differently right at the escape radius
+    size_t mismatches = 0;
+    for (size_t i = 0; i < pixels.size(); i += 1) {
+      mismatches += pixels[i] != expected[i] ? 1 : 0;
+    }
+    if (mismatches > pixels.size() / 1000) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "3. Split frame matches one device" << std::endl;
+
+  double sum = 0.0;
+  for (size_t i = 0; i < devices.size(); i += 1) {
+    std::cout << "   weight " << devices.weights()[i] << std::endl;
+    sum += devices.weights()[i];
+  }
+  if (std::abs(sum - 1.0) > 1e-9) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Weights follow throughput" << std::endl;
+
+  // a device 40 times slower drops out and is probed again
+  vk::Balancer balancer(2);
+  const double speed[2] = {40.0, 1.0};
+  size_t probes = 0;
+  for (int round = 0; round < 100; round += 1) {
+    auto shares = balancer.partition(1000);
+    std::vector<double> elapsed;
+    for (const auto &share : shares) {
+      elapsed.push_back(share.count / speed[share.device]);
+      probes += round >= 50 && share.device == 1 ? 1 : 0;
+    }
+    balancer.update(shares, elapsed);
+    const auto &weights = balancer.weights();
+    if (std::abs(weights[0] + weights[1] - 1.0) > 1e-9) {
+      throw std::runtime_error("check error");
+    }
+  }
+  if (probes < 50 / vk::Balancer::ProbeInterval || probes > 50 / 2) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "5. Slow device probed " << probes << " times" << std::endl;
+
+  // an even split over many devices is under MinWeight, all still work
+  vk::Balancer many(32);
+  for (int round = 0; round < 20; round += 1) {
+    auto shares = many.partition(1000);
+    uint32_t next = 0;
+    std::vector<double> elapsed;
+    for (const auto &share : shares) {
+      next = share.first == next ? next + share.count : 0;
+      elapsed.push_back(share.count / (1.0 + share.device % 4));
+    }
+    if (next != 1000 || (round == 0 && shares.size() != 32)) {
+      throw std::runtime_error("check error");
+    }
+    many.update(shares, elapsed);
+  }
+  std::cout << "6. 32 devices partitioned" << std::endl;
+}
+
+void test_capabilities() {
+  auto context = vk::Context::get();
+  const auto &instance = context->instance();
+  const auto &device = context->device();
+  const auto &capabilities = device->capabilities();
+  std::cout << "   api " << VK_VERSION_MAJOR(capabilities.apiVersion) << "."
+            << VK_VERSION_MINOR(capabilities.apiVersion) << ", subgroup "
+            << capabilities.subgroupSize << " ["
+            << capabilities.minSubgroupSize << ", "
+            << capabilities.maxSubgroupSize << "], float16 "
+            << capabilities.shaderFloat16 << std::endl;
+  if (capabilities.apiVersion > instance->apiVersion()) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Capabilities ready" << std::endl;
+
+  // size control reports a range around the default size
+  if (capabilities.subgroupSizeControl &&
+      (capabilities.minSubgroupSize > capabilities.subgroupSize ||
+       capabilities.subgroupSize > capabilities.maxSubgroupSize)) {
+    throw std::runtime_error("check error");
+  }
+  if (capabilities.subgroupSize == 0 && capabilities.subgroups(0)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Subgroup properties checked" << std::endl;
+
+  // float16 gemm is refused rather than failing in the shader
+  bool thrown = false;
+  try {
+    vk::Gemm gemm(*device, "./shaders", true);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  if (thrown == vk::Gemm::supportsFloat16(*device)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Gemm float16 follows capabilities" << std::endl;
+}
+
+void test_storage() {
+  // host conversions, exact where binary16 can hold the value
+  for (float value : {0.0f, 1.0f, -2.5f, 0.099975586f, 65504.0f, 6.1035156e-05f,
+                      5.9604645e-08f}) {
+    if (float(vk::half(value)) != value) {
+      throw std::runtime_error("check error");
+    }
+  }
+  if (vk::half(1.0f + 1.0f / 4096).bits != vk::half(1.0f).bits ||
+      !std::isinf(float(vk::half(70000.0f))) ||
+      !std::isnan(float(vk::half(NAN)))) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Half conversions checked" << std::endl;
+
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  const auto &capabilities = device->capabilities();
+  std::cout << "   16-bit storage " << capabilities.storageBuffer16BitAccess
+            << ", 8-bit storage " << capabilities.storageBuffer8BitAccess
+            << ", float16 " << capabilities.shaderFloat16 << ", int8 "
+            << capabilities.shaderInt8 << std::endl;
+  bool thrown = false;
+  try {
+    device->createArray<uint8_t>(64, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  if (thrown == bool(capabilities.storageBuffer8BitAccess)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Typed buffers follow capabilities" << std::endl;
+
+  // y = 2 * x + y, small integers so every width is exact, the u8
+  // elements with x >= 64 and y = 128 go past 255 and saturate
+  const uint32_t count = 1000;
+  auto axpy = [&](const std::string &name, auto zero, auto convert) {
+    using T = decltype(zero);
+    std::vector<T> x(count), y(count);
+    for (uint32_t i = 0; i < count; i += 1) {
+      x[i] = convert(float(i % 128));
+      y[i] = convert(float(i % 3 * 64));
+    }
+    auto pipeline = device->createComputePipeline(device->createShader(
+        "./shaders/" + name + ".spv", VK_SHADER_STAGE_COMPUTE_BIT));
+    auto bufferX = device->createArray<T>(count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    auto bufferY = device->createArray<T>(count, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    bufferX->update(x);
+    bufferY->update(y);
+    pipeline->feedBuffer(0, 0, bufferX, 0, count * sizeof(T));
+    pipeline->feedBuffer(0, 1, bufferY, 0, count * sizeof(T));
+    struct {
+      uint32_t count;
+      float a;
+    } params = {count, 2.0f};
+    pipeline->pushConstants(&params, sizeof(params));
+    pipeline->createCommand((count + 255) / 256)->submit()->wait();
+
+    std::vector<T> result(count);
+    bufferY->dump(result);
+    for (uint32_t i = 0; i < count; i += 1) {
+      float expect = 2.0f * float(i % 128) + float(i % 3 * 64);
+      if (sizeof(T) == 1) {
+        expect = std::min(expect, 255.0f);
+      }
+      if (float(result[i]) != expect) {
+        throw std::runtime_error("check error");
+      }
+    }
+    std::cout << "   " << name << " checked" << std::endl;
+  };
+  axpy("axpy", 0.0f, [](float value) { return value; });
+  if (capabilities.shaderFloat16 && capabilities.storageBuffer16BitAccess) {
+    axpy("axpy_f16", vk::half(), [](float value) { return vk::half(value); });
+  }
+  if (capabilities.shaderInt8 && capabilities.storageBuffer8BitAccess) {
+    axpy("axpy_u8", uint8_t(0), [](float value) { return uint8_t(value); });
+  }
+  std::cout << "3. Element widths checked" << std::endl;
+}
+
+void test_dispatch_table() {
+  // two devices side by side, each calling through its own table
+  auto context = vk::Context::get();
+  auto other = context->instance()->getComputeDevice();
+  if (context->device()->table().vkCmdDispatch == nullptr ||
+      other->table().vkQueueSubmit == nullptr) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Tables loaded" << std::endl;
+
+  std::vector<std::unique_ptr<vk::Buffer>> buffers;
+  std::vector<std::unique_ptr<vk::ComputePipeline>> pipelines;
+  std::vector<std::unique_ptr<vk::Command>> commands;
+  std::vector<std::unique_ptr<vk::Fence>> fences;
+  for (const auto *device : {context->device().get(), other.get()}) {
+    auto shader = device->createShader("./shaders/test_1.spv",
+                                       VK_SHADER_STAGE_COMPUTE_BIT);
+    pipelines.push_back(device->createComputePipeline(
+        shader, {{std::make_tuple(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)}}));
+    buffers.push_back(device->createBuffer(64 * sizeof(uint32_t),
+                                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT));
+    pipelines.back()->feedBuffer(0, 0, buffers.back(), 0,
+                                 64 * sizeof(uint32_t));
+    commands.push_back(pipelines.back()->createCommand(64));
+    fences.push_back(commands.back()->submit());
+  }
+  std::cout << "2. Both devices submitted" << std::endl;
+
+  for (size_t i = 0; i < fences.size(); i += 1) {
+    fences[i]->wait();
+    auto data = std::array<uint32_t, 64>();
+    buffers[i]->dump(data.data(), 64 * sizeof(uint32_t));
+    for (size_t j = 0; j < data.size(); j += 1) {
+      if (data[j] != j) {
+        throw std::runtime_error("check error");
+      }
+    }
+  }
+  std::cout << "3. Finish" << std::endl;
+}
+
+void test_value_types() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  auto shader =
+      device->createShader("./shaders/test_2.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+
+  // growing the vectors moves the objects, the handles stay valid
+  std::vector<vk::Buffer> buffers;
+  std::vector<vk::ComputePipeline> pipelines;
+  for (uint32_t i = 0; i < 4; i += 1) {
+    buffers.push_back(device->makeBuffer(64 * sizeof(uint32_t),
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT));
+    buffers.push_back(device->makeBuffer(1 * sizeof(uint32_t),
+                                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT));
+    pipelines.push_back(device->makeComputePipeline(shader));
+  }
+  for (uint32_t i = 0; i < 4; i += 1) {
+    pipelines[i].feedBuffer(0, 0, buffers[2 * i + 1], 0, sizeof(uint32_t));
+    pipelines[i].feedBuffer(0, 1, buffers[2 * i], 0, 64 * sizeof(uint32_t));
+  }
+  std::cout << "1. Buffers and pipelines ready" << std::endl;
+
+  std::vector<vk::Command> commands;
+  std::vector<vk::Fence> fences;
+  for (auto &pipeline : pipelines) {
+    commands.push_back(pipeline.makeCommand(64));
+    fences.push_back(device->makeFence());
+  }
+  std::cout << "2. Commands and fences ready" << std::endl;
+
+  // every round reuses the same commands and fences
+  for (uint32_t round = 1; round <= 3; round += 1) {
+    for (uint32_t i = 0; i < 4; i += 1) {
+      uint32_t scalar = round * (i + 1);
+      buffers[2 * i + 1].update(&scalar, sizeof(scalar));
+      commands[i].submit(fences[i]);
+    }
+    if (!vk::Fence::waitAll(fences)) {
+      throw std::runtime_error("check error");
+    }
+    for (uint32_t i = 0; i < 4; i += 1) {
+      auto data = std::array<uint32_t, 64>();
+      buffers[2 * i].dump(data.data(), 64 * sizeof(uint32_t));
+      for (uint32_t j = 0; j < data.size(); j += 1) {
+        if (data[j] != round * (i + 1) * j) {
+          throw std::runtime_error("check error");
+        }
+      }
+    }
+  }
+  std::cout << "3. Fences reused" << std::endl;
+
+  // moving out leaves an empty object that destructs cleanly
+  vk::Buffer moved = std::move(buffers[0]);
+  buffers[0] = std::move(moved);
+  auto data = std::array<uint32_t, 64>();
+  buffers[0].dump(data.data(), 64 * sizeof(uint32_t));
+  if (data[1] != 3) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "4. Finish" << std::endl;
+}
+
+void test_graphics() {
+  auto context = vk::Context::get();
+  auto device = context->instance()->getGraphicDevice();
+  auto vertexShader = device->createShader("./shaders/shape_vert.spv",
+                                           VK_SHADER_STAGE_VERTEX_BIT);
+  auto fragmentShader = device->createShader("./shaders/shape_frag.spv",
+                                             VK_SHADER_STAGE_FRAGMENT_BIT);
+  // x, y, r, g, b, a
+  auto pipeline = device->makeGraphicsPipeline(
+      vertexShader, fragmentShader,
+      {6 * sizeof(float),
+       {std::make_tuple(0, VK_FORMAT_R32G32_SFLOAT, 0),
+        std::make_tuple(1, VK_FORMAT_R32G32B32A32_SFLOAT, 2 * sizeof(float))}});
+  std::cout << "1. Pipeline ready" << std::endl;
+
+  // a red quad, two triangles over four vertices
+  std::vector<float> vertices = {-1.0f, -1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+                                 1.0f,  -1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+                                 1.0f,  1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+                                 -1.0f, 1.0f,  1.0f, 0.0f, 0.0f, 1.0f};
+  std::vector<uint32_t> indices = {0, 1, 2, 2, 3, 0};
+  auto vertexBuffer = device->makeBuffer(
+      vertices.size() * sizeof(float), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  vertexBuffer.update(vertices);
+  auto indexBuffer = device->makeBuffer(
+      indices.size() * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  indexBuffer.update(indices);
+  std::cout << "2. Buffers ready" << std::endl;
+
+  // four targets, the quad over the left half of the first and the top
+  // half of the third, two per command
+  std::vector<vk::RenderTarget> targets;
+  for (uint32_t i = 0; i < 4; i += 1) {
+    targets.push_back(pipeline.makeTarget(64, 64));
+  }
+  std::array<float, 4> blue = {{0.0f, 0.0f, 1.0f, 1.0f}};
+  float left[4] = {0.5f, 1.0f, -0.5f, 0.0f};
+  float top[4] = {1.0f, 0.5f, 0.0f, -0.5f};
+  pipeline.pushConstants(left, sizeof(left));
+  auto leftDraw = pipeline.drawIndexed(vertexBuffer, indexBuffer, 6);
+  pipeline.pushConstants(top, sizeof(top));
+  auto topDraw = pipeline.drawIndexed(vertexBuffer, indexBuffer, 6);
+
+  std::vector<vk::Command> commands;
+  commands.push_back(device->makeRenderCommand(
+      {targets[0].pass({leftDraw}, blue), targets[1].pass({}, blue)}));
+  commands.push_back(device->makeRenderCommand(
+      {targets[2].pass({topDraw}, blue), targets[3].pass({}, blue)}));
+  std::vector<vk::Fence> fences;
+  for (auto &command : commands) {
+    fences.push_back(device->makeFence());
+    command.submit(fences.back());
+  }
+  std::cout << "3. Commands submitted" << std::endl;
+
+  // read back each half of the batch as soon as it is done
+  auto pixel = [](const std::vector<uint8_t> &pixels, uint32_t x,
+                  uint32_t y) {
+    return std::array<uint8_t, 4>{{pixels[(y * 64 + x) * 4 + 0],
+                                   pixels[(y * 64 + x) * 4 + 1],
+                                   pixels[(y * 64 + x) * 4 + 2],
+                                   pixels[(y * 64 + x) * 4 + 3]}};
+  };
+  const std::array<uint8_t, 4> red = {{255, 0, 0, 255}};
+  const std::array<uint8_t, 4> clear = {{0, 0, 255, 255}};
+  std::vector<bool> checked(commands.size(), false);
+  size_t pending = commands.size();
+  while (pending != 0) {
+    for (size_t i = 0; i < fences.size(); i += 1) {
+      if (checked[i] || !fences[i].isReady()) {
+        continue;
+      }
+      checked[i] = true;
+      pending -= 1;
+
+      std::vector<uint8_t> pixels(targets[2 * i].size());
+      targets[2 * i].dump(pixels.data(), pixels.size());
+      auto inside = i == 0 ? pixel(pixels, 16, 32) : pixel(pixels, 32, 16);
+      auto outside = i == 0 ? pixel(pixels, 48, 32) : pixel(pixels, 32, 48);
+      if (inside != red || outside != clear) {
+        throw std::runtime_error("check error");
+      }
+      targets[2 * i + 1].dump(pixels.data(), pixels.size());
+      if (pixel(pixels, 0, 0) != clear || pixel(pixels, 63, 63) != clear) {
+        throw std::runtime_error("check error");
+      }
+    }
+    std::this_thread::yield();
+  }
+  std::cout << "4. Finish" << std::endl;
+}
+
+void test_present() {
+  auto context = vk::Context::get();
+  const auto &instance = context->instance();
+  std::unique_ptr<vk::Surface> surface;
+  try {
+    surface = instance->createHeadlessSurface();
+  } catch (const std::runtime_error &error) {
+    std::cout << "1. Skipped, " << error.what() << std::endl;
+    return;
+  }
+  std::cout << "1. Surface ready" << std::endl;
+
+  auto device = instance->getGraphicDevice();
+  auto presenter = device->createPresenter(*surface, 64, 64);
+  uint32_t pixels = presenter->extent().width * presenter->extent().height;
+  std::cout << "2. Presenter ready, " << presenter->imageCount() << " images"
+            << std::endl;
+
+  // every pixel gets its index, copied into the image on the device
+  auto pipeline = device->makeComputePipeline(
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  auto buffer = device->makeBuffer(
+      pixels * sizeof(uint32_t),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  pipeline.feedBuffer(0, 0, buffer, 0, pixels * sizeof(uint32_t));
+  presenter->record({pipeline.dispatch(pixels)}, buffer);
+  std::cout << "3. Commands recorded" << std::endl;
+
+  // twice around the swapchain, slots and images are reused
+  for (size_t frame = 0; frame < 2 * presenter->imageCount(); frame += 1) {
+    if (presenter->present() >= presenter->imageCount()) {
+      throw std::runtime_error("check error");
+    }
+  }
+  presenter->wait();
+
+  std::vector<uint32_t> data(pixels);
+  buffer.dump(data);
+  for (uint32_t i = 0; i < pixels; i += 1) {
+    if (data[i] != i) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "4. Finish" << std::endl;
+}
+
+void test_memory_intent() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  const uint32_t size = 64 * sizeof(uint32_t);
+  const VkMemoryPropertyFlags visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+  const VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+  auto upload = device->makeBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   vk::MemoryIntent::Upload);
+  auto readback = device->makeBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     vk::MemoryIntent::Readback);
+  auto deviceOnly = device->makeBuffer(
+      size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, vk::MemoryIntent::DeviceOnly);
+  if (!deviceOnly.buf() || !(upload.memoryProperties() & visible) ||
+      !(readback.memoryProperties() & visible)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "1. Buffers ready" << std::endl;
+
+  // a cached type the buffer could use must win for readback
+  bool hasCached = true;
+  try {
+    device->makeBuffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                       visible | cached);
+  } catch (const std::runtime_error &) {
+    hasCached = false;
+  }
+  if (hasCached && !(readback.memoryProperties() & cached)) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "2. Readback memory is "
+            << (readback.memoryProperties() & cached ? "cached" : "uncached")
+            << std::endl;
+
+  // device writes reach the host through the invalidate, host writes
+  // reach the device through the flush
+  auto pipeline = device->makeComputePipeline(
+      device->createShader("./shaders/test_1.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  pipeline.feedBuffer(0, 0, readback, 0, size);
+  auto command = pipeline.makeCommand(64);
+  auto fence = device->makeFence();
+  command.submit(fence);
+  fence.wait();
+  std::vector<uint32_t> data(64);
+  readback.dump(data);
+  for (uint32_t i = 0; i < 64; i += 1) {
+    if (data[i] != i) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::vector<uint32_t> ones(64, 1);
+  upload.update(ones);
+  upload.dump(data);
+  if (data != ones) {
+    throw std::runtime_error("check error");
+  }
+  std::cout << "3. Finish" << std::endl;
+}
+
+void test_images() {
+  auto context = vk::Context::get();
+  const auto &device = context->device();
+  const uint32_t width = 64, height = 64;
+
+  auto source = device->makeImage(
+      width, height, VK_FORMAT_R8G8B8A8_UNORM,
+      VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+  auto target = device->makeImage(
+      width, height, VK_FORMAT_R8G8B8A8_UNORM,
+      VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+  auto sampler = device->makeSampler(VK_FILTER_LINEAR);
+  std::cout << "1. Images ready" << std::endl;
+
+  // inverts every channel
+  auto lut = device->makeBuffer(256 * sizeof(uint32_t),
+                                VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT,
+                                vk::MemoryIntent::Upload);
+  std::vector<uint32_t> table(256);
+  for (uint32_t v = 0; v < 256; v += 1) {
+    table[v] = (255 - v) * 0x01010101u;
+  }
+  lut.update(table);
+  auto lutView = device->makeBufferView(lut, VK_FORMAT_R32_UINT);
+  std::cout << "2. Texel buffer ready" << std::endl;
+
+  // same size, so the sampler hits pixel centers and copies exactly
+  auto resize = device->makeComputePipeline(device->createShader(
+      "./shaders/image_resize.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  resize.feedImage(0, 0, source, sampler);
+  resize.feedImage(0, 1, target);
+  auto invert = device->makeComputePipeline(device->createShader(
+      "./shaders/image_lut.spv", VK_SHADER_STAGE_COMPUTE_BIT));
+  invert.feedImage(0, 0, target);
+  invert.feedTexelBuffer(0, 1, lutView);
+  std::cout << "3. Pipelines ready" << std::endl;
+
+  auto pixels = device->makeBuffer(
+      width * height * sizeof(uint32_t),
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      vk::MemoryIntent::Readback);
+  std::vector<uint32_t> data(width * height);
+  for (uint32_t y = 0; y < height; y += 1) {
+    for (uint32_t x = 0; x < width; x += 1) {
+      data[y * width + x] = x | (y << 8) | ((x + y) << 16) | 0xFF000000u;
+    }
+  }
+  pixels.update(data);
+
+  // upload, both kernels and the download in one submit
+  auto command = device->makeCommand(
+      {source.copy(pixels)},
+      {resize.dispatch(width / 16, height / 16),
+       invert.dispatch(width / 16, height / 16)},
+      {target.copy(pixels)});
+  auto fence = device->makeFence();
+  command.submit(fence);
+  fence.wait();
+  std::cout << "4. Command ready" << std::endl;
+
+  std::vector<uint32_t> result(width * height);
+  pixels.dump(result);
+  for (size_t i = 0; i < result.size(); i += 1) {
+    if (result[i] != ~data[i]) {
+      throw std::runtime_error("check error");
+    }
+  }
+  std::cout << "5. Finish" << std::endl;
+}
+
+#ifdef __linux__
+void test_service() {
+  auto context = vk::Context::get();
+  auto device = vk::service::createDevice(*context->instance());
+  auto path = "/tmp/naive_vulkan_test_" + std::to_string(getpid()) + ".sock";
+  vk::service::Server server(*device, path);
+  std::thread serving([&]() { server.run(); });
+  std::cout << "1. Server ready" << std::endl;
+
+  {
+    vk::service::Client client(path);
+    auto buffer = client.allocate(64 * sizeof(uint32_t));
+    std::cout << "2. Buffer ready, "
+              << (buffer.imported() ? "imported" : "copied") << std::endl;
+
+    auto data = buffer.as<uint32_t>();
+    for (int round = 0; round < 2; round += 1) {
+      std::fill(data, data + 64, 0u);
+      client.run("test_1", {&buffer}, 64);
+      for (uint32_t i = 0; i < 64; i += 1) {
+        if (data[i] != i) {
+          throw std::runtime_error("check error");
+        }
+      }
+    }
+    std::cout << "3. Jobs done" << std::endl;
+
+    // errors come back to the client, the connection stays usable; jobs
+    // must feed exactly the kernel's bindings and push constants
+    auto fails = [&](const std::string &kernel,
+                     const std::vector<const vk::service::SharedBuffer *>
+                         &buffers) {
+      try {
+        client.run(kernel, buffers, 64);
+      } catch (const std::runtime_error &) {
+        return true;
+      }
+      return false;
+    };
+    bool failed = fails("../test_1", {&buffer}) && fails("test_1", {}) &&
+                  fails("test_1", {&buffer, &buffer});
+    uint32_t constant = 0;
+    client.pushConstants(&constant, sizeof(constant));
+    failed = failed && fails("test_1", {&buffer});
+    client.pushConstants(&constant, 0);
+    client.run("test_1", {&buffer}, 64);
+    if (!failed) {
+      throw std::runtime_error("check error");
+    }
+    std::cout << "4. Errors reported" << std::endl;
+  }
+
+  server.stop();
+  serving.join();
+  std::cout << "5. Finish" << std::endl;
+}
+#endif
+
 int main(int argc, char **argv) {
+  // held for the whole run, so every test shares one instance and device
+  auto context = vk::Context::get();
+
+  std::cout << "----- test_context() begin -----" << std::endl;
+  test_context();
+  std::cout << "----- test_context() finish -----" << std::endl;
+
   std::cout << "----- test_buffer() begin -----" << std::endl;
   test_buffer();
   std::cout << "----- test_buffer() finish -----" << std::endl;
@@ -470,5 +1846,83 @@ int main(int argc, char **argv) {
   std::cout << "----- test_uniform() begin -----" << std::endl;
   test_uniform();
   std::cout << "----- test_uniform() finish -----" << std::endl;
+
+  std::cout << "----- test_reflection() begin -----" << std::endl;
+  test_reflection();
+  std::cout << "----- test_reflection() finish -----" << std::endl;
+
+  std::cout << "----- test_profile() begin -----" << std::endl;
+  test_profile();
+  std::cout << "----- test_profile() finish -----" << std::endl;
+
+  std::cout << "----- test_primitives() begin -----" << std::endl;
+  test_primitives();
+  std::cout << "----- test_primitives() finish -----" << std::endl;
+
+  std::cout << "----- test_gemm() begin -----" << std::endl;
+  test_gemm();
+  std::cout << "----- test_gemm() finish -----" << std::endl;
+
+  std::cout << "----- test_bitmap() begin -----" << std::endl;
+  test_bitmap();
+  std::cout << "----- test_bitmap() finish -----" << std::endl;
+
+  std::cout << "----- test_mandelbrot() begin -----" << std::endl;
+  test_mandelbrot();
+  std::cout << "----- test_mandelbrot() finish -----" << std::endl;
+
+  std::cout << "----- test_perturbation() begin -----" << std::endl;
+  test_perturbation();
+  std::cout << "----- test_perturbation() finish -----" << std::endl;
+
+  std::cout << "----- test_host() begin -----" << std::endl;
+  test_host();
+  std::cout << "----- test_host() finish -----" << std::endl;
+
+  std::cout << "----- test_selection() begin -----" << std::endl;
+  test_selection();
+  std::cout << "----- test_selection() finish -----" << std::endl;
+
+  std::cout << "----- test_multi_device() begin -----" << std::endl;
+  test_multi_device();
+  std::cout << "----- test_multi_device() finish -----" << std::endl;
+
+  std::cout << "----- test_capabilities() begin -----" << std::endl;
+  test_capabilities();
+  std::cout << "----- test_capabilities() finish -----" << std::endl;
+
+  std::cout << "----- test_storage() begin -----" << std::endl;
+  test_storage();
+  std::cout << "----- test_storage() finish -----" << std::endl;
+
+  std::cout << "----- test_dispatch_table() begin -----" << std::endl;
+  test_dispatch_table();
+  std::cout << "----- test_dispatch_table() finish -----" << std::endl;
+
+  std::cout << "----- test_value_types() begin -----" << std::endl;
+  test_value_types();
+  std::cout << "----- test_value_types() finish -----" << std::endl;
+
+  std::cout << "----- test_graphics() begin -----" << std::endl;
+  test_graphics();
+  std::cout << "----- test_graphics() finish -----" << std::endl;
+
+  std::cout << "----- test_present() begin -----" << std::endl;
+  test_present();
+  std::cout << "----- test_present() finish -----" << std::endl;
+
+  std::cout << "----- test_memory_intent() begin -----" << std::endl;
+  test_memory_intent();
+  std::cout << "----- test_memory_intent() finish -----" << std::endl;
+
+  std::cout << "----- test_images() begin -----" << std::endl;
+  test_images();
+  std::cout << "----- test_images() finish -----" << std::endl;
+
+#ifdef __linux__
+  std::cout << "----- test_service() begin -----" << std::endl;
+  test_service();
+  std::cout << "----- test_service() finish -----" << std::endl;
+#endif
   return 0;
 }
@@ -0,0 +1,46 @@
+// clang-format off
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include "naive_vulkan/service.hpp"
+// clang-format on
+
+// Compute service: owns the device and runs kernels for local clients,
+// run from this directory so ./shaders resolves.
+//   ./naive_vulkan_service [--socket path] [--shaders dir]
+
+static vk::service::Server *server = nullptr;
+
+static void onSignal(int) {
+  if (server != nullptr) {
+    server->stop();
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string path = vk::service::defaultPath();
+  std::string shaders = "./shaders";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--socket") == 0) {
+      path = argv[i + 1];
+    } else if (std::strcmp(argv[i], "--shaders") == 0) {
+      shaders = argv[i + 1];
+    }
+  }
+
+  auto instance = vk::createInstance();
+  auto device = vk::service::createDevice(*instance);
+  vk::service::Server service(*device, path, shaders);
+  server = &service;
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+
+  std::cout << "serving " << device->name() << " on " << path
+            << (device->capabilities().externalMemoryHost
+                    ? ", importing shared memory"
+                    : ", copying shared memory")
+            << std::endl;
+  service.run();
+  server = nullptr;
+  return 0;
+}
@@ -0,0 +1,94 @@
+// clang-format off
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include "naive_vulkan/service.hpp"
+// clang-format on
+
+// Load generator for naive_vulkan_service: every client is a thread
+// with its own connection and buffer, one test_1 job in flight at a time.
+//   ./naive_vulkan_load [--clients n] [--jobs n] [--elements n] [--socket path]
+// Prints jobs/s and latency percentiles in the benchmark's csv format.
+
+int main(int argc, char **argv) {
+  std::string path = vk::service::defaultPath();
+  size_t clients = 4, jobs = 1000;
+  uint32_t elements = 1024;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--clients") == 0) {
+      clients = std::stoul(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "--jobs") == 0) {
+      jobs = std::stoul(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "--elements") == 0) {
+      elements = uint32_t(std::stoul(argv[i + 1]));
+    } else if (std::strcmp(argv[i], "--socket") == 0) {
+      path = argv[i + 1];
+    }
+  }
+
+  std::vector<std::vector<double>> latencies(clients);
+  std::vector<std::thread> threads;
+  std::vector<std::string> errors(clients);
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t c = 0; c < clients; c += 1) {
+    threads.emplace_back([&, c]() {
+      try {
+        vk::service::Client client(path);
+        auto buffer = client.allocate(elements * sizeof(uint32_t));
+        auto data = buffer.as<uint32_t>();
+        for (size_t j = 0; j < jobs; j += 1) {
+          data[elements - 1] = 0;
+          auto start = std::chrono::steady_clock::now();
+          client.run("test_1", {&buffer}, elements);
+          auto finish = std::chrono::steady_clock::now();
+          latencies[c].push_back(
+              std::chrono::duration<double, std::micro>(finish - start)
+                  .count());
+          if (data[elements - 1] != elements - 1) {
+            throw std::runtime_error("check error");
+          }
+        }
+      } catch (const std::runtime_error &error) {
+        errors[c] = error.what();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - begin)
+                       .count();
+
+  for (const auto &error : errors) {
+    if (!error.empty()) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  std::vector<double> all;
+  for (const auto &client : latencies) {
+    all.insert(all.end(), client.begin(), client.end());
+  }
+  if (all.empty()) {
+    std::cerr << "no jobs ran" << std::endl;
+    return 1;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&](double p) {
+    return all[std::min(all.size() - 1, size_t(p * all.size()))];
+  };
+
+  auto param = std::to_string(clients) + "x" + std::to_string(elements);
+  std::cout << "name,param,value,unit" << std::endl;
+  std::cout << "service_throughput," << param << "," << all.size() / seconds
+            << ",jobs/s" << std::endl;
+  std::cout << "service_latency," << param << "/p50," << percentile(0.50)
+            << ",us" << std::endl;
+  std::cout << "service_latency," << param << "/p99," << percentile(0.99)
+            << ",us" << std::endl;
+  return 0;
+}
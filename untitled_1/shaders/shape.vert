@@ -0,0 +1,18 @@
+#version 450
+
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec4 color;
+
+layout(location = 0) out vec4 fragColor;
+
+// position in [-1, 1], scaled then moved
+layout(push_constant) uniform PushConstants
+{
+    vec2 scale;
+    vec2 offset;
+};
+
+void main() {
+    gl_Position = vec4(position * scale + offset, 0.0, 1.0);
+    fragColor = color;
+}
@@ -0,0 +1,49 @@
+// Exclusive prefix sum across a 256-wide workgroup
+// every invocation must call it, total receives the sum of all values
+
+shared uint scanShared[256];
+shared uint scanTotal;
+
+uint workgroupExclusiveScan(uint value, out uint total) {
+    uint lid = gl_LocalInvocationID.x;
+#ifdef SUBGROUP
+    uint inclusive = subgroupInclusiveAdd(value);
+    if (gl_SubgroupInvocationID == gl_SubgroupSize - 1) {
+        scanShared[gl_SubgroupID] = inclusive;
+    }
+    barrier();
+    if (gl_SubgroupID == 0) {
+        uint carry = 0;
+        for (uint base = 0; base < gl_NumSubgroups; base += gl_SubgroupSize) {
+            uint i = base + gl_SubgroupInvocationID;
+            uint sum = i < gl_NumSubgroups ? scanShared[i] : 0;
+            uint prefix = subgroupExclusiveAdd(sum);
+            if (i < gl_NumSubgroups) {
+                scanShared[i] = carry + prefix;
+            }
+            carry += subgroupAdd(sum);
+        }
+        if (gl_SubgroupInvocationID == 0) {
+            scanTotal = carry;
+        }
+    }
+    barrier();
+    uint result = scanShared[gl_SubgroupID] + inclusive - value;
+    total = scanTotal;
+    barrier();
+    return result;
+#else
+    scanShared[lid] = value;
+    barrier();
+    for (uint offset = 1; offset < 256; offset <<= 1) {
+        uint add = lid >= offset ? scanShared[lid - offset] : 0;
+        barrier();
+        scanShared[lid] += add;
+        barrier();
+    }
+    uint result = scanShared[lid] - value;
+    total = scanShared[255];
+    barrier();
+    return result;
+#endif
+}